@@ -0,0 +1,878 @@
+/**
+ * File: cache-store.cc
+ * --------------------
+ * Presents the implementation of the CacheStore class, as exported
+ * by cache-store.h.
+ *
+ * On-disk layout:
+ * + <directory>/index is an IndexHeader followed by numSlots IndexSlots, and is
+ *   mapped into memory for the lifetime of the store.  Slots are probed linearly
+ *   from key % numSlots, and removed slots are marked dead (rather than empty) so
+ *   they don't break probe sequences.  When live and dead slots together exceed
+ *   three quarters of the table, it's rebuilt (and, if need be, doubled) into a
+ *   fresh file that's renamed over the old one.
+ * + <directory>/segment-<id> holds records, each a RecordHeader followed by a response's
+ *   header (up to but not including the blank line) and then its payload, so that a large
+ *   payload can be sent with sendfile straight from the segment.  Records are only ever
+ *   appended to the active segment, which is sealed in favor of a new one once it
+ *   reaches its maximum size (an eighth of the budget, within limits).  Sealed segments that
+ *   are less than half live are compacted by copying their live records (save those expired
+ *   for longer than kStaleRetention) into the active segment and unlinking them.
+ * + Each slot carries its record's use count and GDSF priority, and the header carries
+ *   the inflation value, so eviction picks up where it left off across restarts.
+ * + The header's clean flag is set only once a close has flushed the index, and cleared
+ *   (and flushed) as soon as the store is opened.  An index that isn't clean is discarded,
+ *   and rebuilt from the RecordHeaders, which hold everything a slot does save for its use
+ *   count.  Records are only ever appended, so when two records share a key, the one in
+ *   the later segment (or further along in the same segment) is the current one.
+ */
+
+#include "cache-store.h"
+#include "proxy-exception.h"
+#include "metrics.h"
+#include "log.h"
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+using namespace std;
+
+static const uint32_t kIndexMagic = 0x58435250;  // "PRCX"
+static const uint32_t kIndexVersion = 3;
+static const uint32_t kRecordMagic = 0x43455250; // "PREC"
+static const uint64_t kInitialNumSlots = 1 << 14;
+static const uint64_t kMinSegmentSize = 1 << 20;
+static const uint64_t kMaxSegmentSize = 64 << 20;
+static const uint64_t kMinSegmentsPerCapacity = 8;
+static const uint64_t kMaxCapacityFractionPerRecord = 8;
+static const double kEvictionTarget = 0.9;  // of capacity, once eviction has to run
+static const double kMinLiveFraction = 0.5;
+static const chrono::seconds kMaintenanceInterval(30);
+static const unsigned kMaxNumScanners = 8;
+static const string kIndexFileName = "index";
+static const string kSegmentFilePrefix = "segment-";
+static const int kDefaultPermissions = 0644;
+
+static MetricCounter& evictedRecords = MetricsRegistry::getInstance().addCounter(
+  "proxy_cache_evictions_total", "Records evicted from the on-disk cache to stay within its budget.");
+static MetricCounter& expiredRecords = MetricsRegistry::getInstance().addCounter(
+  "proxy_cache_expirations_total", "Records swept from the on-disk cache for having been expired too long.");
+static MetricGauge& liveBytesGauge = MetricsRegistry::getInstance().addGauge(
+  "proxy_cache_live_bytes", "Bytes of live records in the on-disk cache, as of its last maintenance pass.");
+static MetricGauge& diskBytesGauge = MetricsRegistry::getInstance().addGauge(
+  "proxy_cache_disk_bytes", "Bytes of segment files in the on-disk cache, as of its last maintenance pass.");
+
+enum SlotState : uint32_t { kEmptySlot = 0, kLiveSlot = 1, kDeadSlot = 2 };
+enum RecordFlags : uint32_t { kSelfDelimiting = 1 };
+
+struct CacheStore::IndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t numSlots;
+  uint64_t numUsed;       // live and dead slots
+  uint32_t activeSegment;
+  uint32_t clean;         // nonzero only while the store is closed cleanly
+  double inflation;       // the GDSF priority of the last record evicted
+};
+
+struct CacheStore::IndexSlot {
+  uint64_t key;
+  uint64_t offset;        // of the RecordHeader within its segment
+  uint64_t length;        // of the RecordHeader and data together
+  int64_t createTime;
+  int64_t expirationTime;
+  uint32_t segment;
+  uint32_t state;
+  uint32_t headerLength;
+  uint32_t flags;
+  double priority;        // as of the record's last use
+  uint32_t frequency;     // uses since the key was first stored, saturating
+  uint32_t reserved;
+};
+
+struct CacheStore::RecordHeader {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t key;
+  int64_t createTime;
+  int64_t expirationTime;
+  uint64_t headerLength;
+  uint64_t payloadLength;
+};
+
+CacheStore::Segment::~Segment() {
+  ::close(fd);
+}
+
+CacheStore::CacheStore(): indexfd(-1), index(NULL), indexSize(0), capacity(kDefaultCapacity), liveBytes(0),
+  generation(0), rebuilding(false), running(false) {}
+
+CacheStore::~CacheStore() {
+  close();
+}
+
+void CacheStore::open(const string& directory) {
+  lock_guard<mutex> lg(m);
+  this->directory = directory;
+  mapIndex(getIndexFileName(), kInitialNumSlots, /* create = */ false);
+  bool rebuild = index->clean == 0; // freshly initialized indices aren't clean either
+  if (rebuild) {
+    unmapIndex();
+    mapIndex(getIndexFileName(), kInitialNumSlots, /* create = */ true);
+  }
+  // until the next clean close, a crash leaves the index untrustworthy
+  index->clean = 0;
+  msync(index, sizeof(IndexHeader), MS_SYNC);
+  openSegments(rebuild);
+
+  running = true;
+  maintainer = thread([this] { maintain(); });
+  if (rebuilding) rebuilder = thread([this, generation = generation] { rebuildIndex(generation); });
+}
+
+void CacheStore::close() {
+  {
+    lock_guard<mutex> lg(m);
+    running = false;
+    generation++;
+  }
+  maintenanceCV.notify_all();
+  if (maintainer.joinable()) maintainer.join();
+  if (rebuilder.joinable()) rebuilder.join();
+
+  lock_guard<mutex> lg(m);
+  if (index != NULL && !rebuilding) {
+    // the slots have to reach the disk before the flag that vouches for them
+    msync(index, indexSize, MS_SYNC);
+    index->clean = 1;
+    msync(index, sizeof(IndexHeader), MS_SYNC);
+  }
+  unmapIndex();
+  segments.clear();
+  liveBytes = 0;
+  rebuilding = false;
+}
+
+void CacheStore::setCapacity(uint64_t capacity) {
+  lock_guard<mutex> lg(m);
+  this->capacity = capacity;
+  maintenanceCV.notify_all(); // a smaller budget is enforced right away
+}
+
+bool CacheStore::lookup(size_t key, CachedResponse& response, StoredPayload& payload, size_t maxInlinePayload) {
+  IndexSlot slot;
+  shared_ptr<Segment> segment;
+  {
+    lock_guard<mutex> lg(m);
+    if (index == NULL) return false;
+    IndexSlot *found = findSlot(key);
+    if (found == NULL) return false;
+    found->frequency += found->frequency < UINT32_MAX;
+    found->priority = getPriority(*found);
+    slot = *found;
+    auto segmentFound = segments.find(slot.segment);
+    if (segmentFound == segments.end()) return false;
+    segment = segmentFound->second;
+  }
+
+  // the segment stays open while we hold it, even if it's compacted away in the meantime
+  uint64_t payloadLength = slot.length - sizeof(RecordHeader) - slot.headerLength;
+  bool readPayload = payloadLength <= maxInlinePayload;
+  size_t length = readPayload ? slot.length : sizeof(RecordHeader) + slot.headerLength;
+  string record(length, '\0');
+  ssize_t count = pread(segment->fd, &record[0], length, slot.offset);
+  const RecordHeader *header = reinterpret_cast<const RecordHeader *>(record.data());
+  if (count != ssize_t(length) || header->magic != kRecordMagic || header->key != key ||
+      header->headerLength != slot.headerLength || header->payloadLength != payloadLength) {
+    remove(key); // torn or otherwise corrupt record
+    return false;
+  }
+
+  response.header = record.substr(sizeof(RecordHeader), slot.headerLength);
+  response.payload = readPayload ? record.substr(sizeof(RecordHeader) + slot.headerLength) : "";
+  response.selfDelimiting = slot.flags & kSelfDelimiting;
+  response.created = slot.createTime;
+  response.expires = slot.expirationTime;
+  payload = StoredPayload();
+  if (!readPayload) {
+    payload.fd = segment->fd;
+    payload.offset = slot.offset + sizeof(RecordHeader) + slot.headerLength;
+    payload.length = payloadLength;
+    payload.segment = segment;
+  }
+  return true;
+}
+
+void CacheStore::insert(size_t key, const CachedResponse& response, int payloadfd, size_t payloadLength) {
+  lock_guard<mutex> lg(m);
+  if (index == NULL) return;
+  IndexSlot *found = findSlot(key);
+  uint32_t frequency = found != NULL ? found->frequency : 0;
+  if (payloadfd == -1) payloadLength = 0;
+  IndexSlot slot = {key, 0, sizeof(RecordHeader) + response.size() + payloadLength, response.created,
+                    response.expires, 0, kLiveSlot, uint32_t(response.header.size()),
+                    response.selfDelimiting ? kSelfDelimiting : 0};
+  // a record this large would push out many smaller ones, each as likely to be used
+  if (slot.length > capacity / kMaxCapacityFractionPerRecord) {
+    if (found != NULL) releaseSlot(found); // it's out of date either way
+    return;
+  }
+  slot.frequency = frequency + (frequency < UINT32_MAX);
+  slot.priority = getPriority(slot);
+  struct iovec iov[] = {
+    {const_cast<char *>(response.header.data()), response.header.size()},
+    {const_cast<char *>(response.payload.data()), response.payload.size()},
+  };
+  appendRecord(slot, iov, 2, payloadfd);
+  if (liveBytes > capacity) maintenanceCV.notify_all();
+}
+
+void CacheStore::update(size_t key, const CachedResponse& response) {
+  unique_lock<mutex> ul(m);
+  if (index == NULL) return;
+  IndexSlot *found = findSlot(key);
+  if (found == NULL) return;
+  auto segmentFound = segments.find(found->segment);
+  if (segmentFound == segments.end()) return;
+  shared_ptr<Segment> from = segmentFound->second;
+  IndexSlot original = *found;
+  uint64_t payloadLength = original.length - sizeof(RecordHeader) - original.headerLength;
+  IndexSlot slot = original;
+  slot.length = sizeof(RecordHeader) + response.header.size() + payloadLength;
+  slot.headerLength = response.header.size();
+  slot.createTime = response.created;
+  slot.expirationTime = response.expires;
+  if (slot.length > capacity / kMaxCapacityFractionPerRecord) {
+    releaseSlot(found);
+    return;
+  }
+
+  // the payload is copied straight from the original record, without holding the lock
+  uint64_t generation = this->generation;
+  shared_ptr<Segment> to = reserveRecord(slot);
+  ul.unlock();
+  struct iovec iov = {const_cast<char *>(response.header.data()), response.header.size()};
+  bool written = writeRecord(to->fd, slot, &iov, 1, from->fd,
+                             original.offset + sizeof(RecordHeader) + original.headerLength);
+  ul.lock();
+  if (index == NULL || this->generation != generation) return;
+  if (!written) {
+    abandonRecord(*to, slot);
+    throw HTTPCacheAccessException("Failed to append a record to cache segment " + to_string(slot.segment) + ".");
+  }
+
+  // left alone if it was replaced, removed, or moved by compaction in the meantime
+  IndexSlot *current = findSlot(key);
+  if (current == NULL || current->segment != original.segment || current->offset != original.offset) return;
+  slot.frequency = current->frequency;
+  slot.priority = current->priority;
+  addSlot(slot);
+}
+
+int CacheStore::createSpoolFile() {
+  lock_guard<mutex> lg(m);
+  if (index == NULL) return -1;
+  int fd = ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR)) return fd;
+  string pattern = directory + "/spool-XXXXXX"; // no O_TMPFILE support, so settle for unlinking right away
+  fd = mkostemp(&pattern[0], O_CLOEXEC);
+  if (fd != -1) unlink(pattern.c_str());
+  return fd;
+}
+
+void CacheStore::remove(size_t key) {
+  lock_guard<mutex> lg(m);
+  if (index == NULL) return;
+  IndexSlot *slot = findSlot(key);
+  if (slot != NULL) releaseSlot(slot);
+}
+
+/** Private methods **/
+
+string CacheStore::getIndexFileName() const {
+  return directory + "/" + kIndexFileName;
+}
+
+string CacheStore::getSegmentFileName(uint32_t id) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%08u", id);
+  return directory + "/" + kSegmentFilePrefix + name;
+}
+
+CacheStore::IndexSlot *CacheStore::getSlots() const {
+  return reinterpret_cast<IndexSlot *>(index + 1);
+}
+
+CacheStore::IndexSlot *CacheStore::findSlot(uint64_t key) const {
+  IndexSlot *slots = getSlots();
+  for (uint64_t i = 0; i < index->numSlots; i++) {
+    IndexSlot& slot = slots[(key + i) % index->numSlots];
+    if (slot.state == kEmptySlot) return NULL;
+    if (slot.state == kLiveSlot && slot.key == key) return &slot;
+  }
+  return NULL;
+}
+
+CacheStore::IndexSlot *CacheStore::findFreeSlot(uint64_t key) const {
+  IndexSlot *slots = getSlots();
+  for (uint64_t i = 0; i < index->numSlots; i++) {
+    IndexSlot& slot = slots[(key + i) % index->numSlots];
+    if (slot.state != kLiveSlot) return &slot;
+  }
+  return NULL; // unreachable, since the table is never allowed to fill
+}
+
+/**
+ * Maps the index file with the supplied name into memory.  If it doesn't exist, doesn't
+ * look like an index we wrote, or create is true, it's (re)initialized with numSlots empty slots.
+ */
+void CacheStore::mapIndex(const string& filename, uint64_t numSlots, bool create) {
+  int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, kDefaultPermissions);
+  if (fd == -1) throw HTTPCacheConfigException("Failed to open the cache index at \"" + filename + "\".");
+
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  struct stat st;
+  bool valid = !create && fstat(fd, &st) == 0 &&
+    pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+    header.magic == kIndexMagic && header.version == kIndexVersion &&
+    uint64_t(st.st_size) == sizeof(IndexHeader) + header.numSlots * sizeof(IndexSlot);
+  if (!valid) {
+    header = {kIndexMagic, kIndexVersion, numSlots, 0, 0, 0};
+    size_t size = sizeof(IndexHeader) + numSlots * sizeof(IndexSlot);
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0 ||  // truncating to 0 first zeroes every slot
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      ::close(fd);
+      throw HTTPCacheConfigException("Failed to initialize the cache index at \"" + filename + "\".");
+    }
+  }
+
+  indexSize = sizeof(IndexHeader) + header.numSlots * sizeof(IndexSlot);
+  void *mapped = mmap(NULL, indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    ::close(fd);
+    throw HTTPCacheConfigException("Failed to map the cache index at \"" + filename + "\" into memory.");
+  }
+
+  indexfd = fd;
+  index = static_cast<IndexHeader *>(mapped);
+}
+
+void CacheStore::unmapIndex() {
+  if (index == NULL) return;
+  munmap(index, indexSize);
+  ::close(indexfd);
+  index = NULL;
+  indexfd = -1;
+}
+
+/**
+ * Rebuilds the index with numSlots slots, dropping all dead slots.  The new table is
+ * written to a temporary file that replaces the old index only once it's complete.
+ */
+void CacheStore::resizeIndex(uint64_t numSlots) {
+  IndexHeader *oldIndex = index;
+  int oldIndexfd = indexfd;
+  size_t oldIndexSize = indexSize;
+  IndexSlot *oldSlots = getSlots();
+
+  string tempFileName = getIndexFileName() + ".tmp";
+  mapIndex(tempFileName, numSlots, /* create = */ true);
+  index->activeSegment = oldIndex->activeSegment;
+  index->inflation = oldIndex->inflation;
+  for (uint64_t i = 0; i < oldIndex->numSlots; i++) {
+    if (oldSlots[i].state != kLiveSlot) continue;
+    *findFreeSlot(oldSlots[i].key) = oldSlots[i];
+    index->numUsed++;
+  }
+
+  munmap(oldIndex, oldIndexSize);
+  ::close(oldIndexfd);
+  if (rename(tempFileName.c_str(), getIndexFileName().c_str()) != 0)
+    throw HTTPCacheAccessException("Failed to replace the cache index with its resized copy.");
+}
+
+/**
+ * Opens every segment in the directory.  If the index is being rebuilt, new records
+ * are directed to a segment of their own, so that those being scanned never change, and
+ * the rebuild is left to rebuildIndex.  Otherwise, the segments' live byte counts are
+ * recomputed from the index, records expired too long to be of use are trimmed,
+ * and segments left with nothing live are deleted.
+ */
+void CacheStore::openSegments(bool rebuild) {
+  DIR *dir = opendir(directory.c_str());
+  if (dir == NULL) throw HTTPCacheConfigException("Cache directory exists, but we don't "
+                                                  "have permission to open it to find its segments.");
+  while (true) {
+    struct dirent *entry = readdir(dir);
+    if (entry == NULL) break;
+    string name = entry->d_name;
+    if (name.compare(0, kSegmentFilePrefix.size(), kSegmentFilePrefix) != 0) continue;
+    uint32_t id = strtoul(name.c_str() + kSegmentFilePrefix.size(), NULL, 10);
+    segments[id] = openSegment(id, /* create = */ false);
+  }
+  closedir(dir);
+
+  if (rebuild) {
+    if (segments.empty()) return;
+    index->activeSegment = segments.rbegin()->first + 1;
+    rebuilding = true;
+    return;
+  }
+
+  // live byte counts aren't persisted, since they're cheap to recompute
+  IndexSlot *slots = getSlots();
+  for (uint64_t i = 0; i < index->numSlots; i++) {
+    IndexSlot& slot = slots[i];
+    if (slot.state != kLiveSlot) continue;
+    auto found = segments.find(slot.segment);
+    if (found == segments.end()) {
+      slot.state = kDeadSlot; // its segment is gone, so the record is too
+    } else {
+      found->second->liveBytes += slot.length;
+      liveBytes += slot.length;
+    }
+  }
+  sweepExpiredRecords();
+  removeEmptySegments();
+}
+
+/**
+ * Deletes the segments nothing live is stored in.  Assumes the lock is held.
+ */
+void CacheStore::removeEmptySegments() {
+  for (auto curr = segments.begin(); curr != segments.end();) {
+    if (curr->second->liveBytes == 0) {
+      unlink(getSegmentFileName(curr->first).c_str());
+      curr = segments.erase(curr);
+    } else {
+      ++curr;
+    }
+  }
+}
+
+shared_ptr<CacheStore::Segment> CacheStore::openSegment(uint32_t id, bool create) {
+  string filename = getSegmentFileName(id);
+  int fd = ::open(filename.c_str(), O_RDWR | (create ? O_CREAT : 0), kDefaultPermissions);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0)
+    throw HTTPCacheConfigException("Failed to open the cache segment at \"" + filename + "\".");
+  return make_shared<Segment>(fd, st.st_size);
+}
+
+uint32_t CacheStore::getActiveSegment(size_t recordSize) {
+  uint32_t id = index->activeSegment;
+  auto found = segments.find(id);
+  if (found != segments.end()) {
+    const Segment& segment = *found->second;
+    uint64_t maxSegmentSize = clamp(capacity / kMinSegmentsPerCapacity, kMinSegmentSize, kMaxSegmentSize);
+    if (segment.size == 0 || segment.size + recordSize <= maxSegmentSize) return id;
+    id++; // seal the current segment and roll over to a new one
+  }
+
+  segments[id] = openSegment(id, /* create = */ true);
+  index->activeSegment = id;
+  return id;
+}
+
+/**
+ * Returns the supplied slot's GDSF priority: its use count per byte (every record
+ * being taken to cost the same to fetch again), plus the current inflation value.
+ */
+double CacheStore::getPriority(const IndexSlot& slot) const {
+  return index->inflation + double(slot.frequency) / slot.length;
+}
+
+void CacheStore::releaseSlot(IndexSlot *slot) {
+  auto found = segments.find(slot->segment);
+  if (found != segments.end()) {
+    found->second->liveBytes -= slot->length;
+    liveBytes -= slot->length;
+  }
+  slot->state = kDeadSlot;
+}
+
+/**
+ * Copies length bytes from the supplied offset within one file to the supplied
+ * offset within another, within the kernel if at all possible.
+ */
+static bool copyFileRange(int from, off_t fromOffset, int to, off_t offset, size_t length) {
+  while (length > 0) {
+    ssize_t count = copy_file_range(from, &fromOffset, to, &offset, length, 0);
+    if (count == -1 && errno == EINTR) continue;
+    if (count == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) break;
+    if (count <= 0) return false;
+    length -= count;
+  }
+
+  char buffer[1 << 16];
+  while (length > 0) {
+    ssize_t count = pread(from, buffer, min(length, sizeof(buffer)), fromOffset);
+    if (count <= 0 || pwrite(to, buffer, count, offset) != count) return false;
+    fromOffset += count;
+    offset += count;
+    length -= count;
+  }
+  return true;
+}
+
+/**
+ * Returns the slot in which to store the supplied key (which mustn't already be live),
+ * counting it as used, after first rebuilding the index if too few slots remain empty.
+ * Assumes the lock is held.
+ */
+CacheStore::IndexSlot *CacheStore::claimSlot(uint64_t key) {
+  if ((index->numUsed + 1) * 4 > index->numSlots * 3) {
+    uint64_t numLive = 0;
+    IndexSlot *slots = getSlots();
+    for (uint64_t i = 0; i < index->numSlots; i++) numLive += slots[i].state == kLiveSlot;
+    uint64_t numSlots = index->numSlots;
+    while ((numLive + 1) * 2 > numSlots) numSlots *= 2;
+    resizeIndex(numSlots);
+  }
+
+  IndexSlot *free = findFreeSlot(key);
+  if (free->state == kEmptySlot) index->numUsed++;
+  return free;
+}
+
+/**
+ * Sets aside room for a record of slot.length bytes at the end of the active segment,
+ * filling in slot.segment and slot.offset, and returns the segment.  Nothing points
+ * at the room until the record is written and addSlot is called.  Assumes the lock is held.
+ */
+shared_ptr<CacheStore::Segment> CacheStore::reserveRecord(IndexSlot& slot) {
+  slot.segment = getActiveSegment(slot.length);
+  shared_ptr<Segment> segment = segments[slot.segment];
+  slot.offset = segment->size;
+  segment->size += slot.length;
+  return segment;
+}
+
+/**
+ * Writes the record described by the supplied slot into the room reserved for it in
+ * fd.  The record's header and payload are spread across iov, save for whatever's
+ * left over, which is copied from payloadfd, starting at payloadOffset.  Returns false
+ * if the record couldn't be written in full.  Doesn't need the lock, since nothing
+ * else writes there.
+ */
+bool CacheStore::writeRecord(int fd, const IndexSlot& slot, const struct iovec *iov, int iovcnt,
+                             int payloadfd, off_t payloadOffset) {
+  RecordHeader header = {kRecordMagic, slot.flags, slot.key, slot.createTime, slot.expirationTime,
+                         slot.headerLength, slot.length - sizeof(RecordHeader) - slot.headerLength};
+  vector<struct iovec> pieces(1, {&header, sizeof(header)});
+  pieces.insert(pieces.end(), iov, iov + iovcnt);
+  size_t length = 0;
+  for (const struct iovec& piece: pieces) length += piece.iov_len;
+  return pwritev(fd, pieces.data(), pieces.size(), slot.offset) == ssize_t(length) &&
+         (length == slot.length || copyFileRange(payloadfd, payloadOffset, fd, slot.offset + length, slot.length - length));
+}
+
+/**
+ * Gives back the room reserved for a record that couldn't be written.  If other records
+ * have since been reserved after it, it's marked as an expired record instead, so that
+ * scanning the segment can step over it.  Assumes the lock is held.
+ */
+void CacheStore::abandonRecord(Segment& segment, const IndexSlot& slot) {
+  if (segment.size == slot.offset + slot.length) {
+    segment.size = slot.offset;
+    return;
+  }
+  RecordHeader header = {kRecordMagic, 0, slot.key, 0, 0, slot.length - sizeof(RecordHeader), 0};
+  pwrite(segment.fd, &header, sizeof(header), slot.offset);
+}
+
+/**
+ * Points a free slot at the written record the supplied slot describes, releasing
+ * whatever slot its key had before.  Assumes the lock is held.
+ */
+void CacheStore::addSlot(const IndexSlot& slot) {
+  IndexSlot *found = findSlot(slot.key);
+  if (found != NULL) releaseSlot(found);
+  IndexSlot *free = claimSlot(slot.key);
+  *free = slot;
+  free->state = kLiveSlot;
+  Segment& segment = *segments[slot.segment];
+  segment.liveBytes += slot.length;
+  liveBytes += slot.length;
+}
+
+/**
+ * Appends a record described by the supplied slot to the active segment (see writeRecord),
+ * and then points a slot at it in place of whatever slot its key had before, which is
+ * left alone if the record can't be written.  Assumes the lock is held.
+ */
+void CacheStore::appendRecord(IndexSlot slot, const struct iovec *iov, int iovcnt, int payloadfd) {
+  shared_ptr<Segment> segment = reserveRecord(slot);
+  if (!writeRecord(segment->fd, slot, iov, iovcnt, payloadfd)) {
+    abandonRecord(*segment, slot);
+    throw HTTPCacheAccessException("Failed to append a record to cache segment " + to_string(slot.segment) + ".");
+  }
+  addSlot(slot);
+}
+
+void CacheStore::maintain() {
+  unique_lock<mutex> ul(m);
+  while (running) {
+    maintenanceCV.wait_for(ul, kMaintenanceInterval);
+    if (!running) break;
+    if (rebuilding) continue; // the segments can't be touched until they've been scanned
+    sweepExpiredRecords();
+    evictRecords();
+    compactSegments(ul);
+    if (!running || index == NULL) return;
+
+    uint64_t diskBytes = 0;
+    for (const pair<const uint32_t, shared_ptr<Segment>>& p: segments) diskBytes += p.second->size;
+    liveBytesGauge.set(liveBytes);
+    diskBytesGauge.set(diskBytes);
+  }
+}
+
+/**
+ * Releases every record that has been expired for longer than kStaleRetention, so
+ * its space is reclaimed without waiting for it to be looked up.  Assumes the lock is held.
+ */
+void CacheStore::sweepExpiredRecords() {
+  time_t now = time(NULL);
+  IndexSlot *slots = getSlots();
+  for (uint64_t i = 0; i < index->numSlots; i++) {
+    if (slots[i].state == kLiveSlot && slots[i].expirationTime + kStaleRetention < now) {
+      releaseSlot(&slots[i]);
+      expiredRecords.add();
+    }
+  }
+}
+
+/**
+ * If live records exceed the budget, evicts those with the lowest priorities until
+ * they fill no more than kEvictionTarget of it (so that eviction doesn't run again with
+ * every insert), raising the inflation value to the highest priority evicted.  Assumes
+ * the lock is held.
+ */
+void CacheStore::evictRecords() {
+  if (liveBytes <= capacity) return;
+  vector<IndexSlot *> live;
+  IndexSlot *slots = getSlots();
+  for (uint64_t i = 0; i < index->numSlots; i++) {
+    if (slots[i].state == kLiveSlot) live.push_back(&slots[i]);
+  }
+  sort(live.begin(), live.end(), [](const IndexSlot *one, const IndexSlot *two) {
+    return one->priority < two->priority;
+  });
+
+  uint64_t target = capacity * kEvictionTarget;
+  for (IndexSlot *slot: live) {
+    if (liveBytes <= target) break;
+    index->inflation = max(index->inflation, slot->priority);
+    releaseSlot(slot);
+    evictedRecords.add();
+  }
+}
+
+/**
+ * Compacts every sealed segment that's less than kMinLiveFraction live and then, for
+ * as long as the segment files together exceed the budget, whichever of the rest are
+ * the least live.  The lock is held through ul.
+ */
+void CacheStore::compactSegments(unique_lock<mutex>& ul) {
+  vector<pair<double, uint32_t>> sealed; // live fraction and id
+  uint64_t diskBytes = 0;
+  for (const pair<const uint32_t, shared_ptr<Segment>>& p: segments) {
+    const Segment& segment = *p.second;
+    diskBytes += segment.size;
+    if (p.first != index->activeSegment && segment.size > 0)
+      sealed.emplace_back(double(segment.liveBytes) / segment.size, p.first);
+  }
+  sort(sealed.begin(), sealed.end());
+
+  vector<uint32_t> candidates;
+  for (const pair<double, uint32_t>& p: sealed) {
+    if (p.first >= kMinLiveFraction && diskBytes <= capacity) break;
+    const Segment& segment = *segments[p.second];
+    diskBytes -= segment.size - segment.liveBytes; // what compacting it reclaims
+    candidates.push_back(p.second);
+  }
+
+  uint64_t generation = this->generation;
+  for (uint32_t id: candidates) {
+    try {
+      if (!compactSegment(id, ul)) return; // closed in the meantime
+    } catch (const HTTPProxyException& hpe) {
+      break; // most likely out of disk space, so try again later
+    }
+    if (this->generation != generation) return;
+  }
+}
+
+/**
+ * Copies every live record that hasn't been expired for longer than kStaleRetention
+ * out of the supplied segment and into the active one, and then deletes the segment.
+ * The lock, held through ul, is released while each record is copied, so lookups and
+ * inserts aren't held up: sealed segments never change, and the copy is only pointed
+ * to if its key still refers to the original afterward (and is otherwise left for a
+ * later compaction to reclaim).  Returns false if the store was closed
+ * before the segment was done, and throws if a copy can't be written, in which case
+ * the records not yet copied stay where they are.
+ */
+bool CacheStore::compactSegment(uint32_t id, unique_lock<mutex>& ul) {
+  auto found = segments.find(id);
+  if (found == segments.end()) return true;
+  shared_ptr<Segment> segment = found->second;
+  uint64_t generation = this->generation;
+  time_t now = time(NULL);
+  IndexSlot *slots = getSlots();
+  vector<IndexSlot> live;
+  for (uint64_t i = 0; i < index->numSlots; i++) {
+    if (slots[i].state != kLiveSlot || slots[i].segment != id) continue;
+    if (slots[i].expirationTime + kStaleRetention < now) {
+      releaseSlot(&slots[i]);
+    } else {
+      live.push_back(slots[i]);
+    }
+  }
+
+  for (const IndexSlot& original: live) {
+    // a copy made after the key was replaced would be taken for the latest by rebuildIndex
+    IndexSlot *current = findSlot(original.key);
+    if (current == NULL || current->segment != id || current->offset != original.offset) continue;
+    IndexSlot copy = original;
+    shared_ptr<Segment> to = reserveRecord(copy);
+    ul.unlock();
+    string record(original.length, '\0');
+    bool read = pread(segment->fd, &record[0], original.length, original.offset) == ssize_t(original.length);
+    struct iovec iov = {&record[sizeof(RecordHeader)], record.size() - sizeof(RecordHeader)};
+    bool written = read && writeRecord(to->fd, copy, &iov, 1);
+    ul.lock();
+    if (!running || this->generation != generation) return false;
+
+    current = findSlot(original.key);
+    bool unchanged = current != NULL && current->segment == id && current->offset == original.offset;
+    if (!written) {
+      abandonRecord(*to, copy);
+      if (!read) {
+        if (unchanged) releaseSlot(current); // torn or otherwise unreadable
+        continue;
+      }
+      throw HTTPCacheAccessException("Failed to append a record to cache segment " + to_string(copy.segment) + ".");
+    }
+    if (!unchanged) continue; // replaced or removed while it was being copied
+
+    // its use count and times may have changed while it was being copied
+    IndexSlot moved = *current;
+    moved.segment = copy.segment;
+    moved.offset = copy.offset;
+    addSlot(moved);
+  }
+
+  segments.erase(id);
+  unlink(getSegmentFileName(id).c_str());
+  return true;
+}
+
+/**
+ * Rebuilds the index from the records in every segment that existed when the store was
+ * opened, scanning several segments at once, and adding each segment's records to the
+ * index as soon as it's been scanned.  Records inserted in the meantime take precedence,
+ * since they're in later segments.  Gives up if the store is closed (which advances
+ * the generation) before it's done.
+ */
+void CacheStore::rebuildIndex(uint64_t generation) {
+  struct PendingSegment {
+    uint32_t id;
+    shared_ptr<Segment> segment;
+    uint64_t size;
+  };
+  vector<PendingSegment> pending;
+  {
+    lock_guard<mutex> lg(m);
+    for (const pair<const uint32_t, shared_ptr<Segment>>& p: segments) {
+      pending.push_back({p.first, p.second, p.second->size});
+    }
+  }
+
+  time_t now = time(NULL);
+  atomic<size_t> next(0);
+  size_t numRecords = 0;
+  auto scan = [&] {
+    vector<IndexSlot> slots;
+    for (size_t i = next++; i < pending.size(); i = next++) {
+      slots.clear();
+      scanSegment(pending[i].id, pending[i].segment->fd, pending[i].size, now, slots);
+      lock_guard<mutex> lg(m);
+      if (this->generation != generation) return;
+      numRecords += addScannedSlots(slots);
+    }
+  };
+  size_t numScanners = min<size_t>({max(thread::hardware_concurrency(), 1U), kMaxNumScanners, pending.size()});
+  vector<thread> scanners;
+  for (size_t i = 1; i < numScanners; i++) scanners.emplace_back(scan);
+  scan();
+  for (thread& scanner: scanners) scanner.join();
+
+  lock_guard<mutex> lg(m);
+  if (this->generation != generation) return;
+  rebuilding = false;
+  removeEmptySegments();
+  LOG(Info) << "Rebuilt the cache index from " << pending.size() << " segments, finding "
+            << numRecords << " records worth keeping.";
+}
+
+/**
+ * Reads the header of every record in the first size bytes of the supplied segment,
+ * stopping at the first torn or otherwise unreadable one, and adds a slot for each
+ * record that hasn't been expired for longer than kStaleRetention to slots.
+ */
+void CacheStore::scanSegment(uint32_t id, int fd, uint64_t size, time_t now, vector<IndexSlot>& slots) {
+  uint64_t offset = 0;
+  while (size - offset >= sizeof(RecordHeader)) {
+    RecordHeader header;
+    if (pread(fd, &header, sizeof(header), offset) != sizeof(header) || header.magic != kRecordMagic ||
+        header.headerLength > size || header.payloadLength > size) break;
+    uint64_t length = sizeof(RecordHeader) + header.headerLength + header.payloadLength;
+    if (length > size - offset) break;
+    if (header.expirationTime + kStaleRetention >= now) {
+      IndexSlot slot = {header.key, offset, length, header.createTime, header.expirationTime, id, kLiveSlot,
+                        uint32_t(header.headerLength), header.flags};
+      slot.frequency = 1;
+      slots.push_back(slot);
+    }
+    offset += length;
+  }
+}
+
+/**
+ * Points the index at each of the supplied scanned records, unless it already points
+ * at a later record for the same key, and returns the number of keys it hadn't
+ * indexed before.  Assumes the lock is held.
+ */
+size_t CacheStore::addScannedSlots(const vector<IndexSlot>& slots) {
+  size_t numAdded = 0;
+  for (const IndexSlot& slot: slots) {
+    IndexSlot *found = findSlot(slot.key);
+    if (found != NULL) {
+      if (make_pair(found->segment, found->offset) > make_pair(slot.segment, slot.offset)) continue;
+      releaseSlot(found);
+    } else {
+      numAdded++;
+    }
+    IndexSlot *free = claimSlot(slot.key);
+    *free = slot;
+    free->priority = getPriority(slot);
+    Segment& segment = *segments[slot.segment];
+    segment.liveBytes += slot.length;
+    liveBytes += slot.length;
+  }
+  return numAdded;
+}
@@ -0,0 +1,215 @@
+/**
+ * File: cache-store.h
+ * -------------------
+ * Defines the CacheStore class, which persists cached responses as records
+ * appended to a small number of large segment files.  Each record keeps a response's
+ * header and payload apart, so that a large payload can be sent straight from its
+ * segment to a client with sendfile.  A fixed-size, open-addressed
+ * hash table mapping each request hash to the segment, offset, length, and expiration
+ * time of its record lives in its own file and is mapped into memory, so a lookup
+ * costs no directory operations at all and a single pread to fetch the record.
+ * Records that have been superseded, removed, or expired leave garbage behind.
+ *
+ * Live records are kept within a byte budget.  Once they exceed it, the records
+ * least worth keeping are evicted, as ranked by GDSF (Greedy-Dual-Size-Frequency): a
+ * record's priority is the number of times it's been used per byte it occupies,
+ * plus an inflation value that rises to the priority of each record evicted, so that
+ * records that were popular long ago eventually age out too.  A background thread
+ * periodically sweeps away records that have been expired too long to be of use,
+ * evicts as needed, and compacts segments that are mostly garbage (or, when the
+ * segment files together exceed the budget, whichever are the most garbage).
+ *
+ * The index is marked clean when the store is closed, and trusted as is when it's next
+ * opened.  Otherwise (after a crash, or if the index is missing or unreadable) it's rebuilt
+ * from the records themselves by scanning the segments in parallel, in the background,
+ * so that the store can be used while the rebuild is underway, missing only what
+ * hasn't been scanned yet.  Either way, records expired too long to be of use are
+ * trimmed as the index is loaded.
+ */
+
+#ifndef _cache_store_
+#define _cache_store_
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <sys/types.h>
+#include "memory-cache.h"
+
+/**
+ * Struct: StoredPayload
+ * ---------------------
+ * Locates a payload within a segment file so it can be sent without first being
+ * read into memory.  The descriptor remains open for as long as the StoredPayload
+ * (or any copy of it) exists, even if the segment is compacted away in the meantime.
+ * A descriptor of -1 means there's no payload to send beyond what's in memory.
+ */
+struct StoredPayload {
+  int fd = -1;
+  off_t offset = 0;
+  size_t length = 0;
+  std::shared_ptr<void> segment;
+};
+
+class CacheStore {
+ public:
+  CacheStore();
+  ~CacheStore();
+
+/**
+ * Method: open
+ * ------------
+ * Opens (or creates) the store rooted in the supplied directory, which must
+ * already exist, and launches the maintenance thread (and, if the index has to be
+ * rebuilt, the threads that rebuild it).  If the store can't be opened, an
+ * HTTPCacheConfigException is thrown.
+ */
+  void open(const std::string& directory);
+
+/**
+ * Method: close
+ * -------------
+ * Stops the maintenance thread (and any rebuild underway) and releases the index and all
+ * segment descriptors.  Everything written so far remains on disk, and unless a rebuild
+ * was cut short, the index is marked clean so the next open can trust it.
+ */
+  void close();
+
+/**
+ * Method: setCapacity
+ * -------------------
+ * Sets the byte budget for live records, which is kDefaultCapacity to begin
+ * with.  Records too large to share the budget with many others aren't stored
+ * at all.  Thread safe.
+ */
+  void setCapacity(uint64_t capacity);
+  static const uint64_t kDefaultCapacity = uint64_t(1) << 30;
+
+/**
+ * Method: lookup
+ * --------------
+ * Populates response with the response most recently stored under key and returns true,
+ * or returns false if nothing (or nothing readable) is stored under key.  Payloads of at most
+ * maxInlinePayload bytes are read into response.payload.  Larger ones are left in place and
+ * described by payload instead.  Expired responses are returned like any other, so that the
+ * caller can apply its own policy.  Thread safe.
+ */
+  bool lookup(size_t key, CachedResponse& response, StoredPayload& payload, size_t maxInlinePayload);
+
+/**
+ * Method: insert
+ * --------------
+ * Appends a record holding the supplied response to the active segment and points key
+ * at it, replacing whatever was previously stored under key (and inheriting its use
+ * count).  Wakes the maintenance thread if the store is now over budget.  If payloadfd isn't -1, the
+ * first payloadLength bytes of the file it refers to (typically one returned by
+ * createSpoolFile) are stored after response.payload.  Throws an
+ * HTTPCacheAccessException if the record can't be written.  Thread safe.
+ */
+  void insert(size_t key, const CachedResponse& response, int payloadfd = -1, size_t payloadLength = 0);
+
+/**
+ * Method: update
+ * --------------
+ * Replaces the header and the create and expiration times of whatever is stored
+ * under key with response's, keeping its payload, as when the origin confirms that
+ * an expired response is still current.  response's payload is ignored.  Thread safe.
+ */
+  void update(size_t key, const CachedResponse& response);
+
+/**
+ * Method: createSpoolFile
+ * -----------------------
+ * Creates an anonymous file on the same file system as the store, suitable for
+ * accumulating a payload to be passed to insert without holding it in memory, and
+ * returns a descriptor for it (which the caller must close), or -1 if it couldn't be created.
+ */
+  int createSpoolFile();
+
+/**
+ * Constant: kStaleRetention
+ * -------------------------
+ * The number of seconds a record is kept after it expires, so that it can still be
+ * revalidated or served stale.  Records that have been expired for longer than this
+ * are swept away.
+ */
+  static const time_t kStaleRetention = 24 * 60 * 60;
+
+/**
+ * Method: remove
+ * --------------
+ * Forgets whatever is stored under key.  The space it occupies is reclaimed
+ * when its segment is compacted.  Thread safe.
+ */
+  void remove(size_t key);
+
+ private:
+  struct IndexHeader;
+  struct IndexSlot;
+  struct RecordHeader;
+
+  struct Segment {
+    int fd;
+    uint64_t size;
+    uint64_t liveBytes;
+    Segment(int fd, uint64_t size): fd(fd), size(size), liveBytes(0) {}
+    ~Segment();
+  };
+
+  std::string directory;
+  std::mutex m;
+  int indexfd;
+  IndexHeader *index;
+  size_t indexSize;
+  std::map<uint32_t, std::shared_ptr<Segment>> segments;
+  uint64_t capacity;
+  uint64_t liveBytes;      // across all segments
+  uint64_t generation;     // advanced by close, so that work begun while open (e.g. a rebuild) is abandoned
+  bool rebuilding;
+
+  bool running;
+  std::condition_variable maintenanceCV;
+  std::thread maintainer;
+  std::thread rebuilder;
+
+  std::string getIndexFileName() const;
+  std::string getSegmentFileName(uint32_t id) const;
+  IndexSlot *getSlots() const;
+  IndexSlot *findSlot(uint64_t key) const;
+  IndexSlot *findFreeSlot(uint64_t key) const;
+  void mapIndex(const std::string& filename, uint64_t numSlots, bool create);
+  void unmapIndex();
+  void resizeIndex(uint64_t numSlots);
+  void openSegments(bool rebuild);
+  void removeEmptySegments();
+  std::shared_ptr<Segment> openSegment(uint32_t id, bool create);
+  uint32_t getActiveSegment(size_t recordSize);
+  double getPriority(const IndexSlot& slot) const;
+  IndexSlot *claimSlot(uint64_t key);
+  void releaseSlot(IndexSlot *slot);
+  std::shared_ptr<Segment> reserveRecord(IndexSlot& slot);
+  static bool writeRecord(int fd, const IndexSlot& slot, const struct iovec *iov, int iovcnt,
+                          int payloadfd = -1, off_t payloadOffset = 0);
+  void abandonRecord(Segment& segment, const IndexSlot& slot);
+  void addSlot(const IndexSlot& slot);
+  void appendRecord(IndexSlot slot, const struct iovec *iov, int iovcnt, int payloadfd = -1);
+  void maintain();
+  void sweepExpiredRecords();
+  void evictRecords();
+  void compactSegments(std::unique_lock<std::mutex>& ul);
+  bool compactSegment(uint32_t id, std::unique_lock<std::mutex>& ul);
+  void rebuildIndex(uint64_t generation);
+  static void scanSegment(uint32_t id, int fd, uint64_t size, time_t now, std::vector<IndexSlot>& slots);
+  size_t addScannedSlots(const std::vector<IndexSlot>& slots);
+
+  CacheStore(const CacheStore& original) = delete;
+  void operator=(const CacheStore& rhs) = delete;
+};
+
+#endif
@@ -10,12 +10,27 @@
  *   The directory is hidden to emphasize the fact that it's a configuration
  *   directory for the proxy executable, similar to .emacs, .cvsroot, .gnome,
  *   .ssh, etc.
- *   + Each entry within .proxy-cache-<hostname> is also a directory, and each represents
- *     some HTTP response that was cached.  The name of the directory entry is the hashcode
- *     of the entire HTTP request, because that's easily produced from just the HTTPRequest
- *     before attempting to download the file.
- *     + Each hashcode directory contains a single file storing the full HTTPResponse that was
- *       cached.  The name of the file is structured as "created@<create-time>expires@<expiration-time>.
+ *   + .proxy-cache-<hostname> holds a CacheStore (see cache-store.h): a handful of large,
+ *     append-only segment files storing the serialized HTTPResponses that were cached, and an
+ *     index mapping the hashcode of each HTTP request (easily produced from just the
+ *     HTTPRequest before attempting to download the file) to its response's location
+ *     and its create and expiration times.
+ * + A request's hashcode covers only its method, server, port, and path (see
+ *   HTTPRequest::getCacheKey), plus the values of whichever request headers the
+ *   most recent response for that resource listed in its Vary header.  Which headers
+ *   those are is remembered in memory only, so after a restart, varying responses
+ *   are fetched afresh the first time they're requested.
+ * + Expired entries aren't discarded right away.  Those with validators (an ETag or
+ *   Last-Modified) are revalidated with conditional requests, and a 304 in reply
+ *   extends their lives (and updates their header fields with its own) without the
+ *   payload being transferred again.  Those whose
+ *   Cache-Control permits it are also served stale while being revalidated
+ *   (stale-while-revalidate) or when the origin can't be reached (stale-if-error).
+ * + In front of the store sits a MemoryCache holding recently used responses in their
+ *   serialized form.  Every cached response is written to both, so entries evicted from
+ *   memory remain on disk, and entries found on disk are promoted back into memory.
+ *   Responses too large for memory are served with their payloads sent directly from
+ *   the segment files to the client socket.
  */
 
 #include <fstream>
@@ -32,13 +47,35 @@
 #include "request.h"
 #include "response.h"
 #include "proxy-exception.h"
-#include "ostreamlock.h"
+#include "log.h"
 #include "string-utils.h"
+#include "fnv-hash.h"
+#include "metrics.h"
 using namespace std;
+using namespace std::chrono;
+
+// these describe the connection, or the payload a 304 doesn't have, so a 304 doesn't update them
+static const vector<string_view> kUnrefreshedFields = {
+  "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding", "upgrade", "content-length"
+};
+
+static const string kLookupsName = "proxy_cache_lookups_total";
+static const string kLookupsHelp = "Cache lookups for cacheable requests, by what they found.";
+static MetricCounter& memoryHits = MetricsRegistry::getInstance().addCounter(kLookupsName, kLookupsHelp, "result=\"memory\"");
+static MetricCounter& diskHits = MetricsRegistry::getInstance().addCounter(kLookupsName, kLookupsHelp, "result=\"disk\"");
+static MetricCounter& staleHits = MetricsRegistry::getInstance().addCounter(kLookupsName, kLookupsHelp, "result=\"stale\"");
+static MetricCounter& misses = MetricsRegistry::getInstance().addCounter(kLookupsName, kLookupsHelp, "result=\"miss\"");
+static MetricCounter& refreshes = MetricsRegistry::getInstance().addCounter(
+  "proxy_cache_refreshes_total", "Expired cache entries an origin server confirmed are still current.");
+static LatencyHistogram& readTimes = MetricsRegistry::getInstance().addHistogram(
+  "proxy_cache_read_seconds", "Time spent looking entries up in the on-disk cache.");
+static LatencyHistogram& writeTimes = MetricsRegistry::getInstance().addHistogram(
+  "proxy_cache_write_seconds", "Time spent adding entries to the cache.");
 
 HTTPCache::HTTPCache(): maxAge(-1) {
   cacheDirectory = getCacheDirectory();
   ensureDirectoryExists(cacheDirectory);
+  store.open(cacheDirectory);
 }
 
 static const string kCacheSubdirectoryPrefix = ".proxy-cache";
@@ -56,144 +93,203 @@ string HTTPCache::getCacheDirectory() const {
 }
 
 void HTTPCache::clear() {
-  cout << "Clearing the cache... wait for it.... " << flush;
-  sleep(2); // just for dramatic effect
-  ensureDirectoryExists(cacheDirectory, /* empty = */ true);
+  memory.clear();
+  {
+    lock_guard<shared_mutex> lg(variedHeadersLock);
+    variedHeaders.clear();
+  }
+  cout << "Clearing the cache... " << flush;
+  store.close();
+  ensureDirectoryExists(cacheDirectory, /* empty = */ true); // including entries the store doesn't know about
+  store.open(cacheDirectory);
   cout << "done!" << endl;
 }
 
+bool HTTPCache::mayCache(const HTTPRequest& request) const {
+  // entries are shared by every client, but the cache key leaves credentials out, so a
+  // response fetched with one client's credentials mustn't be served to anyone else
+  return maxAge != 0 && request.getMethod() == "GET" && !request.containsName("authorization");
+}
+
 bool HTTPCache::shouldCache(const HTTPRequest& request, const HTTPResponse& response) const {
-  return maxAge != 0 &&
-    request.getMethod() == "GET" && 
+  return mayCache(request) && 
     response.getResponseCode() == HTTPStatus::OK && 
-    response.permitsCaching();
+    response.permitsCaching() &&
+    response.getHeader().getValueAsString("vary").find('*') == string::npos; // varies on more than headers
 }
 
-bool HTTPCache::containsCacheEntry(const HTTPRequest& request, HTTPResponse& response) const {
-  if (maxAge == 0) return false; // maxAge of 0 means nothing is in the cache and we're not caching anything
-  if (request.getMethod() != "GET") return false;
-  string requestHash = hashRequestAsString(request);
-  bool exists = cacheEntryExists(requestHash);
-  if (!exists) return false;
-  string cachedFileName = getRequestHashCacheEntryName(requestHash);
-  if (cachedFileName.empty()) return false;
-  string fullCacheEntryName = cacheDirectory + "/" + requestHash + "/" + cachedFileName;
-  if (!cachedEntryIsValid(cachedFileName)) { // if it's not valid, then remove it
-    cout << oslock << "     [Cache entry with hash of " << requestHash << " has expired... removing...]" << endl << osunlock;
-    if (remove(fullCacheEntryName.c_str()) != 0) // remove calls unlink for regular files
-      throw HTTPCacheAccessException("Failed to remove the now-expired cache entry named \"" +
-                                     fullCacheEntryName + "\".");
-    string fullCacheDirectoryName = cacheDirectory + "/" + requestHash;
-    if (rmdir(fullCacheDirectoryName.c_str()) != 0) // rmdir succeeds provided the supplied directory is empty (remove would have works as well)
-      throw HTTPCacheAccessException("Failed to remove the now-expired cache entry directory named \"" +
-                                     fullCacheDirectoryName + "\".");
-    return false;
+bool HTTPCache::containsCacheEntry(const HTTPRequest& request, shared_ptr<const CachedResponse>& cached,
+                                   StoredPayload& stored) {
+  cached = nullptr;
+  stored = StoredPayload();
+  if (!mayCache(request)) return false; // e.g. maxAge of 0 means we are not caching anything
+  size_t requestHash = getEntryKey(request);
+  cached = memory.get(requestHash);
+  if (cached && cached->expires >= time(NULL)) {
+    LOG(Info) << "     [Using in-memory copy of previous request for " << request.getURL() << ".]";
+    memoryHits.add();
+    return true;
   }
 
-  ifstream instream(fullCacheEntryName.c_str(), ios::in | ios::binary);
-  if (!instream)
-    throw HTTPCacheAccessException("Unable to open the cache entry named \"" +
-                                   fullCacheEntryName + "\" for reading.");
-  try {
-    response.ingestResponseHeader(instream);
-    response.ingestPayload(instream);
-    cout << oslock << "     [Using cached copy of previous request for " << request.getURL() << ".]" << endl << osunlock;
+  if (!cached) {
+    auto response = make_shared<CachedResponse>();
+    steady_clock::time_point start = steady_clock::now();
+    bool found = store.lookup(requestHash, *response, stored, memory.getMaxEntrySize());
+    readTimes.record(duration_cast<microseconds>(steady_clock::now() - start));
+    if (!found) {
+      misses.add();
+      return false;
+    }
+    if (maxAge > 0) response->expires = min<long>(response->created + maxAge, response->expires);
+    cached = response;
+  }
+
+  if (cachedEntryIsValid(cached->created, cached->expires)) {
+    LOG(Info) << "     [Using cached copy of previous request for " << request.getURL() << ".]";
+    if (stored.fd == -1) memory.put(requestHash, cached);
+    diskHits.add();
     return true;
-  } catch (const HTTPProxyException& hpe) {
-    cerr << oslock << "     [Problem rehydrating previously cached response for " << request.getURL() << ".]" << endl;
-    cerr << "     [Operating as if cached entry doesn't exist and forwarding request to origin server.]" << endl << osunlock;
+  }
+
+  // an expired entry is kept for as long as it might be revalidated or served stale
+  if (isWorthKeeping(*cached, time(NULL))) {
+    LOG(Info) << "     [Cache entry with hash of " << requestHash << " has expired... revalidating...]";
+    staleHits.add();
     return false;
   }
+  LOG(Info) << "     [Cache entry with hash of " << requestHash << " has expired... removing...]";
+  misses.add();
+  memory.remove(requestHash);
+  store.remove(requestHash);
+  cached = nullptr;
+  stored = StoredPayload();
+  return false;
 }
 
-static string kCreateHeader = "created@";
-static string kExpirationHeader = "expires@";
-void HTTPCache::cacheEntry(const HTTPRequest& request, const HTTPResponse& response) {
-  string requestHash = hashRequestAsString(request);
-  int ttl = response.getTTL();
-  if (maxAge > 0) ttl = min<long>(maxAge, ttl);
-  string unit = ttl == 1 ? "second" : "seconds";
-  cout << oslock << "     [Okay to cache response, so caching response under hash of " 
-       << requestHash << " for " << ttl << " " << unit << ".]" << endl << osunlock;
-  ensureDirectoryExists(cacheDirectory + "/" + requestHash, /* empty = */ true);
-  string cacheEntryName = 
-    cacheDirectory + "/" + 
-    requestHash + "/" + 
-    kCreateHeader + getCurrentTime() + kExpirationHeader + getExpirationTime(response.getTTL());
-  ofstream outfile(cacheEntryName.c_str(), ios::out | ios::binary);
-  if (!outfile)
-    throw HTTPCacheAccessException("Unable to open the cache entry named \"" + cacheEntryName + "\" for writing.");
-  outfile << response;
-  outfile.flush();
+bool HTTPCache::mayServeWhileRevalidating(const CachedResponse& cached) const {
+  return time(NULL) <= cached.expires + parseCachedHeader(cached).getStaleWhileRevalidate();
 }
 
-size_t HTTPCache::hashRequest(const HTTPRequest& request) const {
-  hash<string> hasher;
-  return hasher(serializeRequest(request));  
+bool HTTPCache::mayServeOnError(const CachedResponse& cached) const {
+  return time(NULL) <= cached.expires + parseCachedHeader(cached).getStaleIfError();
 }
 
-string HTTPCache::hashRequestAsString(const HTTPRequest& request) const {
-  ostringstream oss;
-  oss << hashRequest(request);
-  return oss.str();
+bool HTTPCache::addValidators(const CachedResponse& cached, HTTPRequest& request) const {
+  if (request.containsName("if-none-match") || request.containsName("if-modified-since")) return false;
+  HTTPResponse response = parseCachedHeader(cached);
+  string etag = response.getHeader().getValueAsString("etag");
+  string lastModified = response.getHeader().getValueAsString("last-modified");
+  if (!etag.empty()) request.addHeader("if-none-match", etag);
+  if (!lastModified.empty()) request.addHeader("if-modified-since", lastModified);
+  return !etag.empty() || !lastModified.empty();
 }
 
-string HTTPCache::serializeRequest(const HTTPRequest& request) const {
-  ostringstream oss;
-  oss << request;
-  return oss.str();
+shared_ptr<const CachedResponse> HTTPCache::refreshEntry(const HTTPRequest& request, const CachedResponse& cached,
+                                                         const StoredPayload& stored, const HTTPResponse& notModified) {
+  // the 304's fields (its Cache-Control, Expires, ETag, Date, and so on) replace the entry's,
+  // so a 304 that says nothing about freshness leaves the entry's original lifetime in force
+  HTTPResponse merged = parseCachedHeader(cached);
+  merged.updateHeader(notModified.getHeader(), kUnrefreshedFields);
+  auto refreshed = make_shared<CachedResponse>(cached);
+  refreshed->header = merged.getHeaderString();
+  refreshed->created = time(NULL);
+  refreshed->expires = getExpirationTime(refreshed->created, merged.getTTL());
+  size_t requestHash = getEntryKey(request);
+  time_t extension = refreshed->expires - refreshed->created;
+  string unit = extension == 1 ? "second" : "seconds";
+  LOG(Info) << "     [Cache entry with hash of " << requestHash << " is still current, so keeping it for "
+            << extension << " more " << unit << ".]";
+  try {
+    store.update(requestHash, *refreshed);
+  } catch (const HTTPProxyException& pe) {
+    LOG(Error) << "Failed to update cached response: " << pe.what();
+  }
+  if (stored.fd == -1) memory.put(requestHash, refreshed);
+  refreshes.add();
+  return refreshed;
 }
 
-bool HTTPCache::cacheEntryExists(const string& requestHash) const {
-  string path = cacheDirectory + "/" + requestHash;
-  struct stat st;
-  if (stat(path.c_str(), &st) != 0) return false;
-  if (!S_ISDIR(st.st_mode)) return false;
-  
-  DIR *dir = opendir(path.c_str());
-  if (dir == NULL) 
-    throw HTTPCacheAccessException("Cache directory exists, but we don't "
-                                   "have permission to open it to decide if \"" + 
-                                   requestHash + "\" exists");
-
-  bool exists = false;
-  while (!exists) {
-    errno = 0;
-    struct dirent *entry = readdir(dir);
-    if (errno != 0) {
-      throw HTTPCacheAccessException("Failed to surface one of the cache directory entries.");
-    }
-    if (entry == NULL) break;
-    string dirEntry = entry->d_name;
-    exists = dirEntry != "." && dirEntry != "..";
+shared_ptr<CachedResponse> HTTPCache::makeCachedResponse(const HTTPResponse& response,
+                                                         time_t createTime, time_t expirationTime) const {
+  HTTPResponse copy = response;
+  copy.removeHeader("connection"); // supplied separately for each client
+  auto cached = make_shared<CachedResponse>();
+  cached->header = copy.getHeaderString();
+  const vector<char>& payload = copy.getPayload().getData();
+  cached->payload.assign(payload.begin(), payload.end());
+  cached->selfDelimiting = copy.hasSelfDelimitingPayload();
+  cached->created = createTime;
+  cached->expires = expirationTime;
+  return cached;
+}
+
+void HTTPCache::cacheEntry(const HTTPRequest& request, const HTTPResponse& response,
+                           int payloadfd, size_t payloadLength) {
+  steady_clock::time_point start = steady_clock::now();
+  recordVariedHeaders(request, response);
+  size_t requestHash = getEntryKey(request);
+  int ttl = response.getTTL();
+  if (maxAge > 0) ttl = min<long>(maxAge, ttl);
+  string unit = ttl == 1 ? "second" : "seconds";
+  LOG(Info) << "     [Okay to cache response, so caching response under hash of "
+            << requestHash << " for " << ttl << " " << unit << ".]";
+  time_t createTime = time(NULL);
+  time_t expirationTime = getExpirationTime(createTime, response.getTTL());
+  shared_ptr<CachedResponse> cached = makeCachedResponse(response, createTime, expirationTime);
+  if (payloadfd != -1 && cached->size() + payloadLength <= memory.getMaxEntrySize()) {
+    // small enough for memory anyway, so pull the spooled payload in
+    string payload(payloadLength, '\0');
+    if (pread(payloadfd, &payload[0], payloadLength, 0) != ssize_t(payloadLength))
+      throw HTTPCacheAccessException("Failed to read back a spooled response payload.");
+    cached->payload += payload;
+    payloadfd = -1;
   }
 
-  if (closedir(dir) != 0)
-    throw HTTPCacheAccessException("Failed to close the cache directory after clearing its contents.");
-  return exists;
+  store.insert(requestHash, *cached, payloadfd, payloadLength);
+  if (payloadfd == -1) memory.put(requestHash, cached);
+  writeTimes.record(duration_cast<microseconds>(steady_clock::now() - start));
 }
 
-string HTTPCache::getRequestHashCacheEntryName(const string& requestHash) const {
-  string requestHashDirectory = cacheDirectory + "/" + requestHash;
-  DIR *dir = opendir(requestHashDirectory.c_str());
-  if (dir == NULL) return ""; // just assume it doesn't exist
+size_t HTTPCache::hashRequest(const HTTPRequest& request) const {
+  return request.getCacheKey();
+}
 
-  string cachedEntryName;
-  while (true) {
-    errno = 0;
-    struct dirent *entry = readdir(dir);
-    if (errno != 0) {
-      throw HTTPCacheAccessException("Failed to surface one of the cache directory entries.");
-    }
-    if (entry == NULL) break;
-    cachedEntryName = entry->d_name;
-    if (cachedEntryName != "." && cachedEntryName != "..") break;
+/**
+ * Returns the key the response to the supplied request is stored under: its
+ * cache key, extended with the request's values for any headers its resource
+ * is known to vary on.
+ */
+size_t HTTPCache::getEntryKey(const HTTPRequest& request) const {
+  size_t key = request.getCacheKey();
+  shared_lock<shared_mutex> sl(variedHeadersLock);
+  auto found = variedHeaders.find(key);
+  if (found == variedHeaders.end()) return key;
+  FNVHash hash;
+  hash.add(uint64_t(key));
+  for (const string& name: found->second) hash.add(request.getHeader().getValueAsString(name));
+  return hash.value();
+}
+
+/**
+ * Remembers which request headers (if any) the supplied response says it varies on,
+ * so that later requests for the same resource look for the matching variant.
+ */
+void HTTPCache::recordVariedHeaders(const HTTPRequest& request, const HTTPResponse& response) {
+  vector<string> names;
+  istringstream iss(response.getHeader().getValueAsString("vary"));
+  string name;
+  while (getline(iss, name, ',')) {
+    name = toLowerCase(trim(name));
+    if (!name.empty()) names.push_back(name);
   }
 
-  if (closedir(dir) != 0)
-    throw HTTPCacheAccessException("Failed to close the cache directory after clearing its contents.");
-  if (cachedEntryName == ".." || cachedEntryName == ".") return "";
-  return cachedEntryName;
+  lock_guard<shared_mutex> lg(variedHeadersLock);
+  if (names.empty()) {
+    variedHeaders.erase(request.getCacheKey());
+    return;
+  }
+  if (variedHeaders.size() >= kMaxVariedResources) variedHeaders.clear(); // forgotten variants are just refetched
+  variedHeaders[request.getCacheKey()] = move(names);
 }
 
 static const int kDefaultPermissions = 0755;
@@ -240,49 +336,38 @@ void HTTPCache::ensureDirectoryExists(const string& directory, bool empty) const
     throw HTTPCacheAccessException("Failed to close some cache directory after clearing its contents.");
 }
 
-string HTTPCache::getCurrentTime() const { // not influences by maxAge at all
-  struct timeval tv;
-  gettimeofday(&tv, NULL); // no error possible when just getting the time
-  ostringstream oss;
-  oss << tv.tv_sec;
-  return oss.str();
+time_t HTTPCache::getExpirationTime(time_t createTime, int ttl) const {
+  if (maxAge >= 0) ttl = min<long>(maxAge, ttl);
+  return ttl >= 0 ? createTime + ttl : createTime;
 }
 
-string HTTPCache::getExpirationTime(int ttl) const {
-  if (maxAge >= 0) ttl = min<long>(maxAge, ttl);
+bool HTTPCache::cachedEntryIsValid(time_t createTime, time_t expirationTime) const {
+  LOG(Debug) << "     [Cache entry created at " << createTime << ", expires at " << expirationTime << ".]";
   struct timeval tv;
   gettimeofday(&tv, NULL); // no error possible when just getting the time
-  if (ttl >= 0) tv.tv_sec += ttl;
-  ostringstream oss;
-  oss << tv.tv_sec;
-  return oss.str();
+  return tv.tv_sec <= expirationTime;
 }
 
-bool HTTPCache::cacheEntryFileNameIsProperlyStructured(const string& cachedFileName) const {
-  size_t headers[] = { cachedFileName.find(kCreateHeader), cachedFileName.find(kExpirationHeader) };
-  return headers[0] == 0 && headers[1] != string::npos && headers[1] > headers[0];
-} // test could be tighter, but I'll let it function more as a sanitycheck until we can use regexes with g++-5.3
-
-void HTTPCache::extractCreateAndExpireTimes(const string& cachedFileName, time_t& createTime, time_t& expirationTime) const {
-  if (!cacheEntryFileNameIsProperlyStructured(cachedFileName)) {
-    throw HTTPCacheAccessException(cachedFileName + " doesn't confirm to the naming convention we expect... clear the cache.");
-  }
-  
-  size_t first = cachedFileName.find(kCreateHeader) + string(kCreateHeader).size();
-  size_t second = cachedFileName.find(kExpirationHeader) + string(kExpirationHeader).size();
-  createTime = stol(cachedFileName.substr(first, cachedFileName.find(kExpirationHeader) - first));
-  expirationTime = stol(cachedFileName.substr(second));
+/**
+ * Returns true if the supplied expired entry can still be of use, either because
+ * the origin can be asked to confirm it's current, or because it may yet be served stale.
+ */
+bool HTTPCache::isWorthKeeping(const CachedResponse& cached, time_t now) const {
+  if (now > cached.expires + CacheStore::kStaleRetention) return false;
+  HTTPResponse response = parseCachedHeader(cached);
+  if (response.getHeader().containsName("etag") || response.getHeader().containsName("last-modified")) return true;
+  return now <= cached.expires + max(response.getStaleWhileRevalidate(), response.getStaleIfError());
 }
 
-bool HTTPCache::cachedEntryIsValid(const string& cachedFileName) const {
-  time_t createTime;
-  time_t expirationTime;
-  extractCreateAndExpireTimes(cachedFileName, createTime, expirationTime);
-  if (maxAge > 0) expirationTime = min<long>(createTime + maxAge, expirationTime);
-  cout << oslock << "     [Cache entry created at " << createTime << ", expires at " << expirationTime << ".]" << endl << osunlock;  
-  struct timeval tv;
-  gettimeofday(&tv, NULL); // no error possible when just getting the time
-  return tv.tv_sec <= expirationTime;
+/**
+ * Reconstructs the header of a cached response, so its validators and
+ * Cache-Control directives can be consulted.
+ */
+HTTPResponse HTTPCache::parseCachedHeader(const CachedResponse& cached) {
+  istringstream iss(cached.header + "\r\n");
+  HTTPResponse response;
+  response.ingestResponseHeader(iss);
+  return response;
 }
 
 string HTTPCache::getHostname() const {
@@ -10,9 +10,15 @@
 #include <cstdlib>
 #include <string>
 #include <mutex>
+#include <shared_mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
 #include <sys/time.h>
 #include "request.h"
 #include "response.h"
+#include "memory-cache.h"
+#include "cache-store.h"
 
 class HTTPCache {
  public:
@@ -25,11 +31,59 @@ class HTTPCache {
 /**
  * The following three functions do what you'd expect, except that they 
  * aren't thread safe.  In a MT environment, you should acquire the lock
- * on the relevant request before calling.
+ * on the relevant request before calling, which containsCacheEntry can share with
+ * other lookups and cacheEntry must hold exclusively.  Entries are looked up in memory
+ * first, and entries found on disk are promoted into memory if they fit.  Entries
+ * too large for memory come back with an empty payload, and with stored
+ * describing where on disk the payload can be sent from.  containsCacheEntry
+ * returns true only for fresh entries, but when it returns false because the entry
+ * has expired, cached and stored still describe it if it's worth revalidating or
+ * serving stale (see below), and cached is left empty otherwise.
  */
-  bool containsCacheEntry(const HTTPRequest& request, HTTPResponse& response) const;
+  bool containsCacheEntry(const HTTPRequest& request, std::shared_ptr<const CachedResponse>& cached,
+                          StoredPayload& stored);
   bool shouldCache(const HTTPRequest& request, const HTTPResponse& response) const;
-  void cacheEntry(const HTTPRequest& request, const HTTPResponse& response);
+  void cacheEntry(const HTTPRequest& request, const HTTPResponse& response,
+                  int payloadfd = -1, size_t payloadLength = 0);
+
+/**
+ * Return true if and only if the supplied expired entry may still be served while
+ * it's revalidated, or in place of an error, respectively, as its stale-while-revalidate
+ * and stale-if-error directives permit.
+ */
+  bool mayServeWhileRevalidating(const CachedResponse& cached) const;
+  bool mayServeOnError(const CachedResponse& cached) const;
+
+/**
+ * Makes the supplied request conditional on the cached entry's validators (its
+ * ETag and Last-Modified values), so that the origin can confirm it's still current
+ * with a 304 instead of sending it again.  Returns true if it did so, and false if the
+ * entry has no validators or the request already carries conditions of its own.
+ */
+  bool addValidators(const CachedResponse& cached, HTTPRequest& request) const;
+
+/**
+ * Given the 304 response to a request made conditional by addValidators, extends
+ * the life of the cached entry it confirmed (as freshly as if it had just been fetched)
+ * and returns the entry as refreshed.  Not thread safe, as with cacheEntry.
+ */
+  std::shared_ptr<const CachedResponse> refreshEntry(const HTTPRequest& request, const CachedResponse& cached,
+                                                     const StoredPayload& stored, const HTTPResponse& notModified);
+
+/**
+ * Returns true unless the request's response couldn't possibly be cached,
+ * no matter what the response says, as is the case for all but GET requests
+ * and for requests that carry credentials.
+ */
+  bool mayCache(const HTTPRequest& request) const;
+
+/**
+ * Returns a descriptor for an anonymous file to which a response payload can be
+ * written as it streams by, so it can be passed to cacheEntry once it's complete
+ * (in which case it's appended to whatever payload the response already holds).
+ * The caller must close it.  Returns -1 if no such file can be created.
+ */
+  int createSpoolFile() { return store.createSpoolFile(); }
 
 /**
  * Clears the cache of all entries.
@@ -43,24 +97,45 @@ class HTTPCache {
  * a cacheable item is allowed to remain in the cache from the time it was placed there.
  */
   void setMaxAge(long maxAge) { this->maxAge = maxAge; }
+
+/**
+ * Sets the number of bytes of responses kept in memory and on disk.  Responses
+ * that don't fit are evicted: from memory, those that haven't been used lately, and
+ * from disk, those used least often for their size.
+ */
+  void setBudgets(size_t memoryBudget, uint64_t diskBudget) {
+    memory.setCapacity(memoryBudget);
+    store.setCapacity(diskBudget);
+  }
+
+/**
+ * Returns the request's normalized cache key (see HTTPRequest::getCacheKey), which
+ * is the same for all requests that could possibly share a cached response.
+ */
   size_t hashRequest(const HTTPRequest& request) const;
   
  private:
   std::string getCacheDirectory() const;  
-  std::string hashRequestAsString(const HTTPRequest& request) const;
-  std::string serializeRequest(const HTTPRequest& request) const;
-  bool cacheEntryExists(const std::string& requestHash) const;
-  std::string getRequestHashCacheEntryName(const std::string& requestHash) const;
+  size_t getEntryKey(const HTTPRequest& request) const;
+  void recordVariedHeaders(const HTTPRequest& request, const HTTPResponse& response);
   void ensureDirectoryExists(const std::string& directory, bool empty = false) const;
-  std::string getCurrentTime() const;
-  std::string getExpirationTime(int ttl) const;
-  bool cacheEntryFileNameIsProperlyStructured(const std::string& cachedFileName) const;
-  void extractCreateAndExpireTimes(const std::string& cachedFileName, time_t& createTime, time_t& expirationTime) const;
-  bool cachedEntryIsValid(const std::string& cachedFileName) const;
+  time_t getExpirationTime(time_t createTime, int ttl) const;
+  bool cachedEntryIsValid(time_t createTime, time_t expirationTime) const;
+  bool isWorthKeeping(const CachedResponse& cached, time_t now) const;
+  static HTTPResponse parseCachedHeader(const CachedResponse& cached);
+  std::shared_ptr<CachedResponse> makeCachedResponse(const HTTPResponse& response,
+                                                     time_t createTime, time_t expirationTime) const;
   std::string getHostname() const;
 
   long maxAge;
   std::string cacheDirectory;
+  MemoryCache memory;
+  CacheStore store;
+
+  // the request headers named by each resource's Vary header, keyed by cache key
+  static const size_t kMaxVariedResources = 1 << 16;
+  std::unordered_map<size_t, std::vector<std::string>> variedHeaders;
+  mutable std::shared_mutex variedHeadersLock;
 };
 
 #endif
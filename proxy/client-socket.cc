@@ -7,38 +7,105 @@
  */
 
 #include "client-socket.h"
-#include <netdb.h>                // for gethostbyname
-#include <sys/socket.h>           // for socket, AF_INET
+#include "dns-resolver.h"
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <poll.h>                 // for poll
+#include <fcntl.h>                // for fcntl
+#include <sys/socket.h>           // for socket, SOCK_STREAM
 #include <sys/types.h>            // for SOCK_STREAM
+#include <sys/time.h>             // for struct timeval
 #include <unistd.h>               // for close
-#include <cstring>                // for memset
 using namespace std;
+using namespace std::chrono;
 
-const size_t kDnsResultBufferSize = 1 << 16; // make it huge
-
-int createClientSocket(const string& host, unsigned short port) {
-  int error;
-  char buffer[kDnsResultBufferSize];
-  struct hostent entry;
-  struct hostent *he;
-  gethostbyname_r(host.c_str(), &entry, buffer, sizeof(buffer), &he, &error);
-  if (he == NULL) return kClientSocketError;
-  
-  int s = socket(AF_INET, SOCK_STREAM, 0);
-  if (s < 0) return kClientSocketError;
-  
-  struct sockaddr_in serverAddress;
-  memset(&serverAddress, 0, sizeof(serverAddress));
-  serverAddress.sin_family = AF_INET;
-  serverAddress.sin_port = htons(port);
-  serverAddress.sin_addr.s_addr = ((struct in_addr *)he->h_addr)->s_addr;
-  
-  if (connect(s, (struct sockaddr *) &serverAddress, 
-	      sizeof(serverAddress)) != 0) {
-    close(s);
-    return kClientSocketError;
+// RFC 8305 recommends waiting this long before giving up on a connection attempt's lead
+static const milliseconds kConnectionAttemptDelay(250);
+
+/**
+ * Starts a non-blocking connection to the supplied address, and returns its socket
+ * descriptor, or -1 if the connection couldn't even be started.  connected is set
+ * to true if the connection completed immediately.
+ */
+static int startConnecting(const ResolvedAddress& address, bool& connected) {
+  connected = false;
+  int s = socket(address.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (s < 0) return -1;
+  connected = connect(s, (const struct sockaddr *) &address.address, address.length) == 0;
+  if (connected || errno == EINPROGRESS) return s;
+  close(s);
+  return -1;
+}
+
+int createClientSocket(const string& host, unsigned short port,
+                       milliseconds timeout, ClientSocketTimings *timings) {
+  steady_clock::time_point start = steady_clock::now();
+  steady_clock::time_point deadline = start + timeout;
+  vector<ResolvedAddress> addresses = DNSResolver::getInstance().resolve(host, port, timeout);
+  steady_clock::time_point resolved = steady_clock::now();
+
+  vector<struct pollfd> attempts;
+  size_t next = 0;
+  steady_clock::time_point nextAttempt = resolved;
+  int s = kClientSocketError;
+  while (s == kClientSocketError) {
+    steady_clock::time_point now = steady_clock::now();
+    if (now >= deadline) break;
+    if (next < addresses.size() && now >= nextAttempt) {
+      bool connected;
+      int attempt = startConnecting(addresses[next++], connected);
+      nextAttempt = now + kConnectionAttemptDelay;
+      if (connected) {
+        s = attempt;
+      } else if (attempt != -1) {
+        attempts.push_back({attempt, POLLOUT, 0});
+      } else {
+        nextAttempt = now; // failed outright, so move on right away
+      }
+      continue;
+    }
+    if (attempts.empty()) {
+      if (next == addresses.size()) break;
+      continue;
+    }
+
+    steady_clock::time_point wakeup = next < addresses.size() ? min(deadline, nextAttempt) : deadline;
+    int wait = ceil<milliseconds>(wakeup - now).count();
+    if (poll(attempts.data(), attempts.size(), wait) < 0 && errno != EINTR) break;
+    for (size_t i = 0; i < attempts.size() && s == kClientSocketError;) {
+      if (attempts[i].revents == 0) {
+        i++;
+        continue;
+      }
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+        s = attempts[i].fd;
+      } else {
+        close(attempts[i].fd);
+        nextAttempt = steady_clock::now(); // this one's out of the race, so start the next
+      }
+      attempts.erase(attempts.begin() + i);
+    }
+  }
+
+  // the losers are abandoned mid-handshake
+  for (const struct pollfd& attempt: attempts) close(attempt.fd);
+  if (s != kClientSocketError) fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
+  if (timings != NULL) {
+    timings->resolve = duration_cast<microseconds>(resolved - start);
+    timings->connect = duration_cast<microseconds>(steady_clock::now() - resolved);
   }
-  
   return s;
 }
 
+void setSocketTimeouts(int s, milliseconds readTimeout, milliseconds writeTimeout) {
+  struct timeval tv;
+  tv.tv_sec = readTimeout.count() / 1000;
+  tv.tv_usec = (readTimeout.count() % 1000) * 1000;
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  tv.tv_sec = writeTimeout.count() / 1000;
+  tv.tv_usec = (writeTimeout.count() % 1000) * 1000;
+  setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
@@ -10,6 +10,7 @@
 #define _client_socket_
 
 #include <string>
+#include <chrono>
 
 /**
  * Constant: kClientSocketError
@@ -20,6 +21,35 @@
 
 const int kClientSocketError = -1;
 
+/**
+ * Constant: kDefaultConnectTimeout
+ * --------------------------------
+ * How long createClientSocket spends resolving and
+ * connecting, unless told otherwise.
+ */
+
+const std::chrono::milliseconds kDefaultConnectTimeout(5000);
+
+/**
+ * Constant: kDefaultIOTimeout
+ * ---------------------------
+ * How long a single read from or write to an origin
+ * server may block, unless told otherwise.
+ */
+
+const std::chrono::milliseconds kDefaultIOTimeout(30000);
+
+/**
+ * Struct: ClientSocketTimings
+ * ---------------------------
+ * Records how long each stage of createClientSocket took.
+ */
+
+struct ClientSocketTimings {
+  std::chrono::microseconds resolve{0};
+  std::chrono::microseconds connect{0};
+};
+
 /**
  * Function: createClientSocket
  * ----------------------------
@@ -27,11 +57,29 @@ const int kClientSocketError = -1;
  * on the specified port, and returns a bidirectional 
  * socket descriptor that can be used for two-way
  * communication with the service running on the
- * identified host's port.
+ * identified host's port.  The host is resolved through
+ * the process-wide DNSResolver, and connections to its
+ * addresses are attempted in parallel, each started a
+ * short while after the previous one (or as soon as it
+ * fails), until one succeeds; the rest are abandoned.
+ * If no connection is made within timeout, kClientSocketError
+ * is returned.  If timings isn't NULL, it's filled in.
  */
 
 int createClientSocket(const std::string& host, 
-                       unsigned short port);
+                       unsigned short port,
+                       std::chrono::milliseconds timeout = kDefaultConnectTimeout,
+                       ClientSocketTimings *timings = NULL);
 
-#endif
+/**
+ * Function: setSocketTimeouts
+ * ---------------------------
+ * Configures the supplied socket so that any single read
+ * or write that blocks for longer than the corresponding
+ * timeout fails instead.  Zero means no timeout.
+ */
 
+void setSocketTimeouts(int s, std::chrono::milliseconds readTimeout,
+                       std::chrono::milliseconds writeTimeout);
+
+#endif
@@ -0,0 +1,31 @@
+/**
+ * File: concurrency-limiter.cc
+ * ----------------------------
+ * Presents the implementation of the ConcurrencyLimiter class, as exported
+ * by concurrency-limiter.h.
+ */
+
+#include "concurrency-limiter.h"
+using namespace std;
+
+ConcurrencyLimiter::ConcurrencyLimiter(size_t limit): limit(limit) {}
+
+void ConcurrencyLimiter::setLimit(size_t limit) {
+  lock_guard<mutex> lg(m);
+  this->limit = limit;
+}
+
+bool ConcurrencyLimiter::tryAcquire(const string& key) {
+  lock_guard<mutex> lg(m);
+  size_t& count = counts[key];
+  if (limit > 0 && count >= limit) return false;
+  count++;
+  return true;
+}
+
+void ConcurrencyLimiter::release(const string& key) {
+  lock_guard<mutex> lg(m);
+  auto found = counts.find(key);
+  if (found == counts.end()) return;
+  if (--found->second == 0) counts.erase(found);
+}
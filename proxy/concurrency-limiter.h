@@ -0,0 +1,78 @@
+/**
+ * File: concurrency-limiter.h
+ * ---------------------------
+ * Defines the ConcurrencyLimiter class, which caps how many operations
+ * may be underway at once on behalf of any one key (a client address, say,
+ * or an origin server).  Callers that would exceed the cap are turned away
+ * rather than made to wait, so one busy key can't tie up everything else.
+ */
+
+#ifndef _concurrency_limiter_
+#define _concurrency_limiter_
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <cstddef>
+
+class ConcurrencyLimiter {
+ public:
+
+/**
+ * Constructor: ConcurrencyLimiter
+ * -------------------------------
+ * Constructs a limiter that admits at most limit concurrent operations per key.
+ * A limit of 0 admits everything.
+ */
+  ConcurrencyLimiter(size_t limit);
+
+/**
+ * Method: setLimit
+ * ----------------
+ * Changes the per-key limit.  Operations already admitted are unaffected.
+ */
+  void setLimit(size_t limit);
+
+/**
+ * Method: tryAcquire
+ * ------------------
+ * Returns true and counts one more operation against key if that keeps it within
+ * the limit, and otherwise returns false.  Every successful call must eventually
+ * be matched by a call to release(key).  Thread safe.
+ */
+  bool tryAcquire(const std::string& key);
+
+/**
+ * Method: release
+ * ---------------
+ * Marks one of key's operations as finished.  Thread safe.
+ */
+  void release(const std::string& key);
+
+/**
+ * Class: Permit
+ * -------------
+ * Holds a successfully acquired slot for key, and releases it on destruction.
+ */
+  class Permit {
+   public:
+    Permit(ConcurrencyLimiter& limiter, const std::string& key): limiter(limiter), key(key) {}
+    ~Permit() { limiter.release(key); }
+
+   private:
+    ConcurrencyLimiter& limiter;
+    std::string key;
+    Permit(const Permit& original) = delete;
+    void operator=(const Permit& rhs) = delete;
+  };
+
+ private:
+  size_t limit;
+  std::mutex m;
+  std::unordered_map<std::string, size_t> counts; // only keys with operations underway
+
+  ConcurrencyLimiter(const ConcurrencyLimiter& original) = delete;
+  void operator=(const ConcurrencyLimiter& rhs) = delete;
+};
+
+#endif
@@ -0,0 +1,179 @@
+/**
+ * File: dns-resolver.cc
+ * ---------------------
+ * Presents the implementation of the DNSResolver class, as exported
+ * by dns-resolver.h.
+ *
+ * getaddrinfo doesn't report record TTLs, so every answer is trusted for the
+ * same fixed period instead.
+ */
+
+#include "dns-resolver.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <cstring>
+using namespace std;
+
+DNSResolver::DNSResolver(size_t numThreads, time_t positiveTTL, time_t negativeTTL,
+                         time_t maxStale, size_t maxEntries):
+  positiveTTL(positiveTTL), negativeTTL(negativeTTL), maxStale(maxStale),
+  maxEntries(maxEntries), running(true) {
+  for (size_t i = 0; i < numThreads; i++) {
+    threads.push_back(thread([this] { resolveHosts(); }));
+  }
+}
+
+DNSResolver::~DNSResolver() {
+  {
+    lock_guard<mutex> lg(m);
+    running = false;
+  }
+  pendingCV.notify_all();
+  for (thread& t: threads) t.join();
+}
+
+DNSResolver& DNSResolver::getInstance() {
+  static DNSResolver resolver;
+  return resolver;
+}
+
+vector<ResolvedAddress> DNSResolver::resolve(const string& host, unsigned short port,
+                                             chrono::milliseconds timeout) {
+  vector<ResolvedAddress> addresses;
+  {
+    unique_lock<mutex> ul(m);
+    bool usable;
+    Entry& entry = findEntry(host, usable);
+    if (!usable) {
+      // nothing worth serving, so wait on the lookup just scheduled (or already underway)
+      resolvedCV.wait_for(ul, timeout, [&entry] { return !entry.resolving; });
+      if (entry.resolving) return addresses;
+    }
+    addresses = entry.addresses;
+  }
+
+  for (ResolvedAddress& address: addresses) {
+    if (address.address.ss_family == AF_INET6) {
+      reinterpret_cast<struct sockaddr_in6 *>(&address.address)->sin6_port = htons(port);
+    } else {
+      reinterpret_cast<struct sockaddr_in *>(&address.address)->sin_port = htons(port);
+    }
+  }
+  return addresses;
+}
+
+bool DNSResolver::resolveAsync(const string& host, const Completion& whenResolved) {
+  lock_guard<mutex> lg(m);
+  bool usable;
+  Entry& entry = findEntry(host, usable);
+  if (usable) return true;
+  entry.waiters.push_back(whenResolved);
+  return false;
+}
+
+/**
+ * Returns the entry for the supplied host, creating it if need be, and queues a lookup
+ * if its answer isn't fresh.  usable is set to whether the answer on hand is worth
+ * serving in the meantime.  Assumes the lock is held.
+ */
+DNSResolver::Entry& DNSResolver::findEntry(const string& host, bool& usable) {
+  time_t now = time(NULL);
+  if (!entries.contains(host)) evictEntries(now);
+  Entry& entry = entries[host];
+  bool fresh = entry.resolved && now < entry.expires;
+  usable = fresh || (entry.resolved && !entry.addresses.empty() && now < entry.expires + maxStale);
+  if (!fresh) schedule(host, entry);
+  return entry;
+}
+
+/**
+ * Queues a lookup of the supplied host, unless one is already queued
+ * or underway.  Assumes the lock is held.
+ */
+void DNSResolver::schedule(const string& host, Entry& entry) {
+  if (entry.resolving) return;
+  entry.resolving = true;
+  pending.push_back(host);
+  pendingCV.notify_one();
+}
+
+void DNSResolver::resolveHosts() {
+  while (true) {
+    string host;
+    {
+      unique_lock<mutex> ul(m);
+      pendingCV.wait(ul, [this] { return !running || !pending.empty(); });
+      if (!running) return;
+      host = pending.front();
+      pending.pop_front();
+    }
+
+    vector<ResolvedAddress> addresses = lookup(host);
+    vector<Completion> waiters;
+    {
+      lock_guard<mutex> lg(m);
+      Entry& entry = entries[host];
+      entry.resolving = false;
+      waiters.swap(entry.waiters);
+      if (addresses.empty() && entry.resolved && !entry.addresses.empty() &&
+          time(NULL) < entry.expires + maxStale) {
+        // a failed refresh keeps serving what we had until it's too stale
+      } else {
+        entry.resolved = true;
+        entry.addresses = addresses;
+        entry.expires = time(NULL) + (addresses.empty() ? negativeTTL : positiveTTL);
+      }
+    }
+    resolvedCV.notify_all();
+    for (const Completion& whenResolved: waiters) whenResolved();
+  }
+}
+
+/**
+ * Runs getaddrinfo on behalf of the supplied host, and returns the addresses
+ * it reports, reordered so that IPv6 and IPv4 addresses alternate.
+ */
+vector<ResolvedAddress> DNSResolver::lookup(const string& host) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  struct addrinfo *results;
+  if (getaddrinfo(host.c_str(), NULL, &hints, &results) != 0) return vector<ResolvedAddress>();
+
+  vector<ResolvedAddress> byFamily[2]; // whichever family getaddrinfo preferred goes first
+  int preferred = results->ai_family;
+  for (struct addrinfo *curr = results; curr != NULL; curr = curr->ai_next) {
+    if (curr->ai_family != AF_INET && curr->ai_family != AF_INET6) continue;
+    ResolvedAddress address;
+    memset(&address, 0, sizeof(address));
+    memcpy(&address.address, curr->ai_addr, curr->ai_addrlen);
+    address.length = curr->ai_addrlen;
+    byFamily[curr->ai_family == preferred ? 0 : 1].push_back(address);
+  }
+  freeaddrinfo(results);
+
+  vector<ResolvedAddress> addresses;
+  for (size_t i = 0; i < max(byFamily[0].size(), byFamily[1].size()); i++) {
+    if (i < byFamily[0].size()) addresses.push_back(byFamily[0][i]);
+    if (i < byFamily[1].size()) addresses.push_back(byFamily[1][i]);
+  }
+  return addresses;
+}
+
+/**
+ * Makes room for a new entry by forgetting every host that's too stale to serve
+ * and isn't being resolved, if the table is full.  Assumes the lock is held.
+ */
+void DNSResolver::evictEntries(time_t now) {
+  if (entries.size() < maxEntries) return;
+  for (auto curr = entries.begin(); curr != entries.end();) {
+    const Entry& entry = curr->second;
+    if (!entry.resolving && now >= entry.expires + maxStale) {
+      curr = entries.erase(curr);
+    } else {
+      ++curr;
+    }
+  }
+}
@@ -0,0 +1,116 @@
+/**
+ * File: dns-resolver.h
+ * --------------------
+ * Defines the DNSResolver class, which resolves host names to IPv4 and
+ * IPv6 addresses on a handful of dedicated threads and caches the results,
+ * failures included.  Callers never run a lookup themselves: a cached answer
+ * is returned immediately (even a slightly stale one, which is refreshed in
+ * the background), and callers who arrive while a host is being resolved
+ * wait on that one lookup instead of starting their own, and only for so long.
+ * Callers who can't afford to wait at all can instead ask to be called back
+ * once a host's lookup is done (see resolveAsync).
+ */
+
+#ifndef _dns_resolver_
+#define _dns_resolver_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <ctime>
+#include <sys/socket.h>
+
+/**
+ * Struct: ResolvedAddress
+ * -----------------------
+ * A socket address suitable for passing straight to connect.
+ */
+struct ResolvedAddress {
+  struct sockaddr_storage address;
+  socklen_t length;
+};
+
+class DNSResolver {
+ public:
+  typedef std::function<void()> Completion;
+
+/**
+ * Constructor: DNSResolver
+ * ------------------------
+ * Launches numThreads resolver threads.  Successful lookups are cached for positiveTTL
+ * seconds, after which they're still served for up to maxStale more seconds while being
+ * refreshed.  Failed lookups are cached for negativeTTL seconds.  Once maxEntries
+ * hosts are remembered, those too stale to serve are forgotten to make room.
+ */
+  DNSResolver(size_t numThreads = 4, time_t positiveTTL = 60, time_t negativeTTL = 10,
+              time_t maxStale = 300, size_t maxEntries = 4096);
+  ~DNSResolver();
+
+/**
+ * Method: resolve
+ * ---------------
+ * Returns the addresses host resolves to, with port filled in and ordered so that
+ * address families alternate, starting with the one listed first (RFC 8305).  Returns
+ * an empty vector if host can't be resolved, or if it isn't resolved within timeout.
+ * Thread safe.
+ */
+  std::vector<ResolvedAddress> resolve(const std::string& host, unsigned short port,
+                                       std::chrono::milliseconds timeout = std::chrono::seconds(5));
+
+/**
+ * Method: resolveAsync
+ * --------------------
+ * Sees to it that host is resolved without waiting on it.  Returns true if an answer
+ * (even one that host can't be resolved) is already on hand, so that a call to resolve
+ * would return right away.  Otherwise returns false, and whenResolved is invoked on one
+ * of the resolver's threads once the lookup finishes, however it turns out (but never if
+ * the resolver is destroyed first).  whenResolved shouldn't block.  Thread safe.
+ */
+  bool resolveAsync(const std::string& host, const Completion& whenResolved);
+
+/**
+ * Method: getInstance
+ * -------------------
+ * Returns the resolver shared by the entire process.
+ */
+  static DNSResolver& getInstance();
+
+ private:
+  struct Entry {
+    bool resolved = false;  // addresses and expires are meaningful
+    bool resolving = false; // a lookup is queued or underway
+    std::vector<ResolvedAddress> addresses; // empty if the last lookup failed
+    time_t expires = 0;
+    std::vector<Completion> waiters; // to be called back once the lookup underway finishes
+  };
+
+  time_t positiveTTL;
+  time_t negativeTTL;
+  time_t maxStale;
+  size_t maxEntries;
+
+  std::mutex m;
+  std::condition_variable resolvedCV;
+  std::condition_variable pendingCV;
+  std::unordered_map<std::string, Entry> entries;
+  std::deque<std::string> pending;
+  bool running;
+  std::vector<std::thread> threads;
+
+  Entry& findEntry(const std::string& host, bool& usable);
+  void schedule(const std::string& host, Entry& entry);
+  void resolveHosts();
+  static std::vector<ResolvedAddress> lookup(const std::string& host);
+  void evictEntries(time_t now);
+
+  DNSResolver(const DNSResolver& original) = delete;
+  void operator=(const DNSResolver& rhs) = delete;
+};
+
+#endif
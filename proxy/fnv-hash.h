@@ -0,0 +1,57 @@
+/**
+ * File: fnv-hash.h
+ * ----------------
+ * Defines the FNVHash class, which computes the 64-bit FNV-1a hash of
+ * everything fed to it.  FNV-1a is no good against an adversary, but it's
+ * fast on the short strings we hash, spreads them well, and (unlike std::hash)
+ * is the same in every build, so hashes can be written to disk.
+ */
+
+#ifndef _fnv_hash_
+#define _fnv_hash_
+
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+class FNVHash {
+ public:
+  static const uint64_t kOffsetBasis = 14695981039346656037ULL;
+  static const uint64_t kPrime = 1099511628211ULL;
+
+/**
+ * Method: add
+ * -----------
+ * Folds the supplied bytes into the hash, lowercasing any ASCII letters
+ * first if foldCase is true.  Each string is followed by a separator,
+ * so that adding "ab" and "c" differs from adding "a" and "bc".
+ */
+  void add(std::string_view bytes, bool foldCase = false) {
+    for (char ch: bytes) {
+      if (foldCase && ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+      addByte(static_cast<unsigned char>(ch));
+    }
+    addByte(0xff); // never appears in a header or a URL
+  }
+
+/**
+ * Method: add
+ * -----------
+ * Folds the supplied number into the hash.
+ */
+  void add(uint64_t number) {
+    for (size_t i = 0; i < sizeof(number); i++) addByte((number >> (8 * i)) & 0xff);
+  }
+
+  uint64_t value() const { return state; }
+
+ private:
+  uint64_t state = kOffsetBasis;
+
+  void addByte(unsigned char byte) {
+    state ^= byte;
+    state *= kPrime;
+  }
+};
+
+#endif
@@ -8,80 +8,139 @@
 #include "header.h"
 
 #include <sstream>
-#include "string-utils.h"
+#include <cstdlib>
+#include <algorithm>
 
 using namespace std;
 
 /** public methods and functions **/
 
 void HTTPHeader::ingestHeader(std::istream& instream) {
-  string name;
-  while (true) {
-    string line;
-    getline(instream, line);
-    line = rtrim(line);
-    if (line.empty()) break;
-    if (line[0] == ' ') {
-      line = trim(line);
-      extendHeader(name, line);
-    } else {
-      istringstream iss(line);
-      getline(iss, name, ':');
-      name = trim(name);
-      string value;
-      getline(iss, value);
-      value = trim(value);
-      addHeader(name, value);
+  // gather the lines into one buffer so the same parser handles every header
+  string buffer, line;
+  while (getline(instream, line)) {
+    buffer += line;
+    buffer += '\n';
+    if (line.empty() || (line.size() == 1 && line[0] == '\r')) break;
+  }
+  if (!instream) buffer += '\n';
+
+  // a header too large or cut short still contributes whatever fields it had
+  HTTPHeaderTable fields;
+  size_t length;
+  parseHeader(buffer, fields, length);
+  ingestHeader(fields);
+}
+
+void HTTPHeader::ingestHeader(const HTTPHeaderTable& fields) {
+  headers.reserve(headers.size() + fields.size());
+  for (const HTTPHeaderField& field: fields) {
+    if (field.name.empty()) continue;
+    if (!field.folded) {
+      headers.emplace_back(field.name, field.value);
+      continue;
+    }
+
+    // the value spans several lines, each line break (and the indentation around it) becomes a space
+    string value;
+    for (size_t i = 0; i < field.value.size(); i++) {
+      char ch = field.value[i];
+      if (ch != '\r' && ch != '\n') {
+        value += ch;
+        continue;
+      }
+      while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.pop_back();
+      while (i + 1 < field.value.size() && string_view(" \t\r\n").find(field.value[i + 1]) != string_view::npos) i++;
+      value += ' ';
     }
+    headers.emplace_back(field.name, value);
   }
 }
 
-void HTTPHeader::addHeader(const string& name, int value) {
-  ostringstream oss;
-  oss << value;
-  addHeader(name, oss.str());
+void HTTPHeader::addHeader(string_view name, int value) {
+  addHeader(name, to_string(value));
 }
 
-void HTTPHeader::addHeader(const string& name, const string& value) {
-  string normalizedName = toLowerCase(name);
-  headers[normalizedName] = value;
+void HTTPHeader::addHeader(string_view name, string_view value) {
+  auto found = find(name);
+  if (found == headers.end()) {
+    headers.emplace_back(name, value);
+    return;
+  }
+
+  // any later duplicates would otherwise contradict the new value
+  found->second = value;
+  headers.erase(remove_if(found + 1, headers.end(), [name](const pair<string, string>& p) {
+    return equalsIgnoreCase(p.first, name);
+  }), headers.end());
 }
 
-void HTTPHeader::removeHeader(const string& name) {
-  headers.erase(toLowerCase(name));
+void HTTPHeader::removeHeader(string_view name) {
+  headers.erase(remove_if(headers.begin(), headers.end(), [name](const pair<string, string>& p) {
+    return equalsIgnoreCase(p.first, name);
+  }), headers.end());
 }
 
-bool HTTPHeader::containsName(const string& name) const {
-  string normalizedName = toLowerCase(name);
-  return headers.find(normalizedName) != headers.end();
+void HTTPHeader::update(const HTTPHeader& other, const vector<string_view>& excluded) {
+  auto isExcluded = [&excluded](const string& name) {
+    return any_of(excluded.begin(), excluded.end(), [&name](string_view e) { return equalsIgnoreCase(name, e); });
+  };
+  for (const pair<string, string>& p: other.headers) {
+    if (!isExcluded(p.first)) removeHeader(p.first);
+  }
+  for (const pair<string, string>& p: other.headers) {
+    if (!isExcluded(p.first)) headers.push_back(p);
+  }
+}
+
+bool HTTPHeader::containsName(string_view name) const {
+  return find(name) != headers.end();
 }
 
 static const string kEmptyString;
-const string& HTTPHeader::getValueAsString(const string& name) const {
-  string normalizedName = toLowerCase(name);
-  auto found = headers.find(normalizedName);
+const string& HTTPHeader::getValueAsString(string_view name) const {
+  auto found = find(name);
   return found == headers.end() ? kEmptyString : found->second;
 }
 
-long HTTPHeader::getValueAsNumber(const string& name) const {
-  string value = getValueAsString(name);
+long HTTPHeader::getValueAsNumber(string_view name) const {
+  const string& value = getValueAsString(name);
   if (value.empty()) return 0L;
   char *endptr;
   long number = strtol(value.c_str(), &endptr, 0);
   return *endptr == '\0' ? number : 0L;
 }
 
-std::ostream& operator<<(std::ostream& os, const HTTPHeader& hh) {
-  for (const pair<const string, string>& p: hh.headers) {
-    os << p.first << ": " << p.second << "\r\n";
+void HTTPHeader::appendTo(string& out) const {
+  size_t length = 0;
+  for (const pair<string, string>& p: headers) length += p.first.size() + p.second.size() + 4;
+  out.reserve(out.size() + length);
+  for (const pair<string, string>& p: headers) {
+    out += p.first;
+    out += ": ";
+    out += p.second;
+    out += "\r\n";
   }
+}
 
-  return os;
+std::ostream& operator<<(std::ostream& os, const HTTPHeader& hh) {
+  string lines;
+  hh.appendTo(lines);
+  return os << lines;
 }
 
 /** Private methods **/
 
-void HTTPHeader::extendHeader(const string& name, const string& value) {
-  string normalizedName = toLowerCase(name);
-  headers[normalizedName] += ' ' + value;
+vector<pair<string, string>>::iterator HTTPHeader::find(string_view name) {
+  for (auto curr = headers.begin(); curr != headers.end(); ++curr) {
+    if (equalsIgnoreCase(curr->first, name)) return curr;
+  }
+  return headers.end();
+}
+
+vector<pair<string, string>>::const_iterator HTTPHeader::find(string_view name) const {
+  for (auto curr = headers.begin(); curr != headers.end(); ++curr) {
+    if (equalsIgnoreCase(curr->first, name)) return curr;
+  }
+  return headers.end();
 }
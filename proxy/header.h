@@ -10,7 +10,11 @@
 #define _http_header_
 
 #include <string>
-#include <map>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <iostream>
+#include "http-parser.h"
 
 class HTTPHeader {
 
@@ -29,13 +33,19 @@ class HTTPHeader {
  */
   void ingestHeader(std::istream& instream);
 
+/**
+ * Ingests the fields of a header already parsed by parseHeader
+ * (see http-parser.h), in the order they appeared.
+ */
+  void ingestHeader(const HTTPHeaderTable& fields);
+
 /**
  * Adds (or updates) the provided name so that it's associated
  * with the string form of the supplied integer.  Note that the name comparison is
  * case-insensitive, so that "Expires" and "EXPIRES" are the considered
  * the same.
  */
-  void addHeader(const std::string& name, int value);
+  void addHeader(std::string_view name, int value);
   
 /**
  * Adds (or updates) the provided name so that it's associated
@@ -43,12 +53,20 @@ class HTTPHeader {
  * case-insensitive, so that "Expires" and "EXPIRES" are the considered
  * the same.
  */
-  void addHeader(const std::string& name, const std::string& value);
+  void addHeader(std::string_view name, std::string_view value);
 
 /**
  * Removes the provided name from the request header.
  */
-  void removeHeader(const std::string& name);
+  void removeHeader(std::string_view name);
+
+/**
+ * Replaces every field this header has in common with the supplied one with
+ * the supplied one's (all of them, for names that repeat), and adds the rest,
+ * skipping any whose names appear in excluded.  Names are compared without
+ * regard to case, as above.
+ */
+  void update(const HTTPHeader& other, const std::vector<std::string_view>& excluded);
 
 /**
  * Returns true if and only if the collection of name-value pairs
@@ -56,7 +74,7 @@ class HTTPHeader {
  * case-insensitive, so that "Expires" and "EXPIRES" are the considered
  * the same.
  */
-  bool containsName(const std::string& name) const;
+  bool containsName(std::string_view name) const;
 
 /**
  * Returns the string form of the value associated with the provided
@@ -64,7 +82,7 @@ class HTTPHeader {
  * so that "Expires" and "EXPIRES" are the considered the same.  If the
  * key isn't present, then the empty string is returned.
  */
-  const std::string& getValueAsString(const std::string& name) const;
+  const std::string& getValueAsString(std::string_view name) const;
 
 /**
  * Returns the number (as a long) associated with the provided name.
@@ -73,11 +91,20 @@ class HTTPHeader {
  * key isn't present, or if the associated value isn't purely numeric,
  * then 0 is returned.
  */
-  long getValueAsNumber(const std::string& name) const;
+  long getValueAsNumber(std::string_view name) const;
+
+/**
+ * Appends every header line, each terminated by "\r\n", to the
+ * supplied string, exactly as operator<< would print them.
+ */
+  void appendTo(std::string& out) const;
   
  private:
-  std::map<std::string, std::string> headers;
-  void extendHeader(const std::string& name, const std::string& value);
+  // a flat list in arrival order, since headers are few and mostly looked up by
+  // name; names keep their original case and are compared without regard to it
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::vector<std::pair<std::string, std::string>>::iterator find(std::string_view name);
+  std::vector<std::pair<std::string, std::string>>::const_iterator find(std::string_view name) const;
 };
 
 #endif
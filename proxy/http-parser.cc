@@ -0,0 +1,117 @@
+/**
+ * File: http-parser.cc
+ * --------------------
+ * Presents the implementation of the HTTP parsing routines
+ * exported by http-parser.h.
+ */
+
+#include "http-parser.h"
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+using namespace std;
+
+static const char *const kWhiteSpace = " \t\r";
+
+static string_view trim(string_view s) {
+  size_t start = s.find_first_not_of(kWhiteSpace);
+  if (start == string_view::npos) return string_view();
+  return s.substr(start, s.find_last_not_of(kWhiteSpace) - start + 1);
+}
+
+static bool isWhiteSpace(char ch) {
+  return ch == ' ' || ch == '\t';
+}
+
+static char toLower(char ch) {
+  return ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+}
+
+HTTPHeaderField *HTTPHeaderTable::add(const HTTPHeaderField& field) {
+  if (count == kMaxFields) return NULL;
+  fields[count] = field;
+  return &fields[count++];
+}
+
+const HTTPHeaderField *HTTPHeaderTable::find(string_view name) const {
+  for (const HTTPHeaderField& field: *this) {
+    if (equalsIgnoreCase(field.name, name)) return &field;
+  }
+  return NULL;
+}
+
+const char *findLineEnd(const char *begin, const char *end) {
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  while (end - begin >= 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+    int matches = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    if (matches != 0) return begin + __builtin_ctz(matches);
+    begin += 16;
+  }
+#endif
+  const void *found = memchr(begin, '\n', end - begin);
+  return found == NULL ? end : static_cast<const char *>(found);
+}
+
+bool equalsIgnoreCase(string_view one, string_view two) {
+  if (one.size() != two.size()) return false;
+  for (size_t i = 0; i < one.size(); i++) {
+    if (one[i] != two[i] && toLower(one[i]) != toLower(two[i])) return false;
+  }
+  return true;
+}
+
+HTTPParseResult parseStartLine(string_view buffer, string_view parts[3], size_t& length) {
+  const char *lineEnd = findLineEnd(buffer.data(), buffer.data() + buffer.size());
+  if (lineEnd == buffer.data() + buffer.size()) return HTTPParseResult::Incomplete;
+  string_view line = trim(buffer.substr(0, lineEnd - buffer.data()));
+  for (size_t i = 0; i < 3; i++) {
+    size_t start = 0;
+    while (start < line.size() && isWhiteSpace(line[start])) start++;
+    line.remove_prefix(start);
+    size_t end = i == 2 ? line.size() : 0;
+    while (end < line.size() && !isWhiteSpace(line[end])) end++;
+    parts[i] = line.substr(0, end);
+    line.remove_prefix(end);
+  }
+  if (parts[0].empty() || parts[1].empty()) return HTTPParseResult::Invalid;
+  length = lineEnd - buffer.data() + 1;
+  return HTTPParseResult::Complete;
+}
+
+HTTPParseResult parseHeader(string_view buffer, HTTPHeaderTable& fields, size_t& length) {
+  const char *begin = buffer.data();
+  const char *end = begin + buffer.size();
+  const char *curr = begin;
+  HTTPHeaderField *field = NULL; // the one a continuation line extends
+  while (true) {
+    const char *lineEnd = findLineEnd(curr, end);
+    if (lineEnd == end) return HTTPParseResult::Incomplete;
+    string_view line(curr, lineEnd - curr);
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    const char *next = lineEnd + 1;
+    if (line.empty()) {
+      length = next - begin;
+      return HTTPParseResult::Complete;
+    }
+
+    if (isWhiteSpace(line[0]) && field != NULL) {
+      string_view continuation = trim(line);
+      if (!continuation.empty()) {
+        // values are contiguous in the buffer, so the extended value runs through the new line's end
+        const char *valueStart = field->value.empty() ? continuation.data() : field->value.data();
+        field->value = string_view(valueStart, continuation.data() + continuation.size() - valueStart);
+        field->folded = true;
+      }
+    } else {
+      size_t colon = line.find(':');
+      HTTPHeaderField parsed = {trim(line.substr(0, colon)), 
+                                colon == string_view::npos ? string_view() : trim(line.substr(colon + 1)), false};
+      field = fields.add(parsed);
+      if (field == NULL) return HTTPParseResult::Invalid;
+    }
+    curr = next;
+  }
+}
@@ -0,0 +1,118 @@
+/**
+ * File: http-parser.h
+ * -------------------
+ * Presents a single-pass parser for the start line and header of an HTTP
+ * message held in a contiguous buffer.  Nothing is copied: everything the
+ * parser reports is a string_view into the buffer, and header fields are
+ * collected in a fixed-size table rather than anything that allocates.
+ * Lines may end in either "\r\n" or a bare "\n".
+ */
+
+#ifndef _http_parser_
+#define _http_parser_
+
+#include <string_view>
+#include <array>
+#include <cstddef>
+
+/**
+ * Struct: HTTPHeaderField
+ * -----------------------
+ * One name-value pair, both trimmed of surrounding whitespace.  A value that
+ * was continued onto subsequent lines (by starting them with whitespace) spans
+ * the line breaks between them, and is marked as folded.
+ */
+
+struct HTTPHeaderField {
+  std::string_view name;
+  std::string_view value;
+  bool folded;
+};
+
+/**
+ * Class: HTTPHeaderTable
+ * ----------------------
+ * A flat, fixed-capacity table of header fields, in the order they appeared.
+ */
+
+class HTTPHeaderTable {
+ public:
+  static const size_t kMaxFields = 128;
+
+/**
+ * Method: add
+ * -----------
+ * Appends the supplied field and returns where it was placed, or returns
+ * NULL if the table is already full.
+ */
+  HTTPHeaderField *add(const HTTPHeaderField& field);
+
+/**
+ * Method: find
+ * ------------
+ * Returns the first field whose name matches the supplied one, ignoring case,
+ * or NULL if there isn't one.
+ */
+  const HTTPHeaderField *find(std::string_view name) const;
+
+  size_t size() const { return count; }
+  const HTTPHeaderField *begin() const { return fields.data(); }
+  const HTTPHeaderField *end() const { return fields.data() + count; }
+
+ private:
+  std::array<HTTPHeaderField, kMaxFields> fields;
+  size_t count = 0;
+};
+
+/**
+ * Enum: HTTPParseResult
+ * ---------------------
+ * Complete means the parse succeeded, Incomplete means the buffer ends before
+ * whatever was being parsed does, and Invalid means it can never succeed (because
+ * the start line is malformed, or because there are too many header fields).
+ */
+
+enum class HTTPParseResult { Complete, Incomplete, Invalid };
+
+/**
+ * Function: findLineEnd
+ * ---------------------
+ * Returns a pointer to the first '\n' in [begin, end), or end if there isn't one.
+ * Sixteen bytes are examined at a time wherever SSE2 is available.
+ */
+
+const char *findLineEnd(const char *begin, const char *end);
+
+/**
+ * Function: equalsIgnoreCase
+ * --------------------------
+ * Returns true if and only if the two strings are the same, ignoring
+ * the case of any ASCII letters.
+ */
+
+bool equalsIgnoreCase(std::string_view one, std::string_view two);
+
+/**
+ * Function: parseStartLine
+ * ------------------------
+ * Splits the first line of buffer into its three whitespace-separated parts,
+ * which for a request are the method, URL, and protocol, and for a response
+ * are the protocol, status code, and reason phrase (which alone may contain
+ * spaces).  On success, length is set to the number of bytes the line occupies,
+ * line ending included.
+ */
+
+HTTPParseResult parseStartLine(std::string_view buffer, std::string_view parts[3], size_t& length);
+
+/**
+ * Function: parseHeader
+ * ---------------------
+ * Parses the header fields at the front of buffer, up through the blank line that
+ * ends them, into fields.  On success, length is set to the number of bytes the
+ * header occupies, blank line included.  Lines without a colon are taken to be
+ * names without values.
+ */
+
+HTTPParseResult parseHeader(std::string_view buffer, HTTPHeaderTable& fields, size_t& length);
+
+#endif
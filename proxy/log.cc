@@ -0,0 +1,243 @@
+/**
+ * File: log.cc
+ * ------------
+ * Presents the implementation of the Logger and LogLine classes, as exported
+ * by log.h.
+ *
+ * Log files begin with the four bytes "PLOG" and a 32-bit version number, and
+ * hold nothing but records after that, each a 15-byte header (the timestamp, thread,
+ * level, and length fields of the LogRecord, packed, in host byte order) followed
+ * by its text.
+ */
+
+#include "log.h"
+#include "proxy-exception.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <charconv>
+#include <cstring>
+#include <cstddef>
+#include <ctime>
+using namespace std;
+
+static const char kLogFileMagic[4] = {'P', 'L', 'O', 'G'};
+static const uint32_t kLogFileVersion = 1;
+static const size_t kPackedHeaderSize = sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t);
+static const chrono::milliseconds kDrainInterval(10);
+static const char *const kLevelNames[] = {"ERROR", "WARNING", "INFO", "DEBUG"};
+
+Logger& Logger::getInstance() {
+  static Logger logger;
+  return logger;
+}
+
+Logger::Logger(): level(LogLevel::Info), nextThread(0), logFile(NULL), numPasses(0), running(true) {
+  writer = thread([this] { write(); });
+}
+
+Logger::~Logger() {
+  {
+    lock_guard<mutex> lg(m);
+    running = false;
+  }
+  wakeCV.notify_all();
+  writer.join(); // after one last pass
+  if (logFile != NULL) fclose(logFile);
+}
+
+void Logger::setLogFile(const string& filename) {
+  FILE *file = fopen(filename.c_str(), "ae");
+  if (file == NULL) throw HTTPProxyException("Failed to open log file \"" + filename + "\".");
+  if (ftell(file) == 0) {
+    fwrite(kLogFileMagic, sizeof(kLogFileMagic), 1, file);
+    fwrite(&kLogFileVersion, sizeof(kLogFileVersion), 1, file);
+  }
+
+  lock_guard<mutex> lg(m);
+  if (logFile != NULL) fclose(logFile);
+  logFile = file;
+}
+
+void Logger::submit(LogRecord& record) {
+  Ring& ring = getRing();
+  record.thread = ring.thread;
+  uint64_t head = ring.head.load(memory_order_relaxed);
+  if (head - ring.tail.load(memory_order_acquire) == kRingSize) {
+    ring.dropped.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+  memcpy(&ring.records[head % kRingSize], &record, offsetof(LogRecord, text) + record.length);
+  ring.head.store(head + 1, memory_order_release);
+}
+
+void Logger::flush() {
+  unique_lock<mutex> ul(m);
+  // the pass underway may have started before the call, so wait for the one after it
+  uint64_t target = numPasses + 2;
+  wakeCV.notify_all();
+  writtenCV.wait(ul, [this, target] { return numPasses >= target || !running; });
+}
+
+/**
+ * Returns the calling thread's ring, creating and registering it the
+ * first time the thread logs anything.
+ */
+Logger::Ring& Logger::getRing() {
+  thread_local shared_ptr<Ring> ring;
+  if (!ring) {
+    ring = make_shared<Ring>();
+    lock_guard<mutex> lg(m);
+    ring->thread = nextThread++;
+    rings.push_back(ring);
+  }
+  return *ring;
+}
+
+void Logger::write() {
+  vector<LogRecord> records;
+  unique_lock<mutex> ul(m);
+  while (true) {
+    bool stopping = !running;
+    records.clear();
+    drain(records);
+    writeRecords(records);
+    numPasses++;
+    writtenCV.notify_all();
+    if (stopping) return;
+    wakeCV.wait_for(ul, kDrainInterval);
+  }
+}
+
+/**
+ * Moves everything in every ring into records, in timestamp order, and forgets
+ * the rings of threads that have exited.  Assumes the lock is held.
+ */
+void Logger::drain(vector<LogRecord>& records) {
+  for (size_t i = 0; i < rings.size();) {
+    Ring& ring = *rings[i];
+    bool orphaned = rings[i].use_count() == 1; // so nothing more can be added
+    uint64_t tail = ring.tail.load(memory_order_relaxed);
+    uint64_t head = ring.head.load(memory_order_acquire);
+    for (; tail < head; tail++) records.push_back(ring.records[tail % kRingSize]);
+    ring.tail.store(tail, memory_order_release);
+
+    uint64_t dropped = ring.dropped.exchange(0, memory_order_relaxed);
+    if (dropped > 0) {
+      LogRecord record;
+      record.timestamp = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+      record.thread = ring.thread;
+      record.level = LogLevel::Warning;
+      string text = "[" + to_string(dropped) + " lines dropped because the log couldn't keep up]";
+      record.length = min(text.size(), LogRecord::kMaxTextLength);
+      memcpy(record.text, text.data(), record.length);
+      records.push_back(record);
+    }
+
+    if (orphaned) {
+      rings.erase(rings.begin() + i);
+    } else {
+      i++;
+    }
+  }
+
+  stable_sort(records.begin(), records.end(), [](const LogRecord& one, const LogRecord& two) {
+    return one.timestamp < two.timestamp;
+  });
+}
+
+/**
+ * Writes the supplied records to the log file if there is one, and to the
+ * console otherwise.  Assumes the lock is held.
+ */
+void Logger::writeRecords(const vector<LogRecord>& records) {
+  if (records.empty()) return;
+  if (logFile == NULL) {
+    for (const LogRecord& record: records) {
+      ostream& console = record.level <= LogLevel::Warning ? cerr : cout;
+      console.write(record.text, record.length).put('\n');
+    }
+    cout.flush();
+    return;
+  }
+
+  string buffer;
+  for (const LogRecord& record: records) {
+    char header[kPackedHeaderSize];
+    memcpy(header, &record.timestamp, sizeof(uint64_t));
+    memcpy(header + 8, &record.thread, sizeof(uint32_t));
+    memcpy(header + 12, &record.level, sizeof(uint8_t));
+    memcpy(header + 13, &record.length, sizeof(uint16_t));
+    buffer.append(header, sizeof(header));
+    buffer.append(record.text, record.length);
+  }
+  fwrite(buffer.data(), buffer.size(), 1, logFile);
+  fflush(logFile);
+}
+
+bool Logger::parseLogFile(istream& infile, ostream& outfile) {
+  char magic[sizeof(kLogFileMagic)];
+  uint32_t version;
+  infile.read(magic, sizeof(magic));
+  infile.read(reinterpret_cast<char *>(&version), sizeof(version));
+  if (!infile || memcmp(magic, kLogFileMagic, sizeof(magic)) != 0 || version != kLogFileVersion) return false;
+
+  while (true) {
+    char header[kPackedHeaderSize];
+    if (!infile.read(header, sizeof(header))) break;
+    LogRecord record;
+    memcpy(&record.timestamp, header, sizeof(uint64_t));
+    memcpy(&record.thread, header + 8, sizeof(uint32_t));
+    memcpy(&record.level, header + 12, sizeof(uint8_t));
+    memcpy(&record.length, header + 13, sizeof(uint16_t));
+    if (record.length > LogRecord::kMaxTextLength || !infile.read(record.text, record.length)) break;
+    printRecord(record, outfile);
+  }
+  return true;
+}
+
+void Logger::printRecord(const LogRecord& record, ostream& outfile) {
+  time_t seconds = record.timestamp / 1000000000;
+  struct tm local;
+  localtime_r(&seconds, &local);
+  char when[64];
+  size_t length = strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+  snprintf(when + length, sizeof(when) - length, ".%06llu",
+           static_cast<unsigned long long>(record.timestamp / 1000 % 1000000));
+  size_t level = static_cast<size_t>(record.level);
+  outfile << when << " [" << record.thread << "] "
+          << (level < sizeof(kLevelNames) / sizeof(kLevelNames[0]) ? kLevelNames[level] : "?") << " ";
+  outfile.write(record.text, record.length) << endl;
+}
+
+LogLine::LogLine(LogLevel level) {
+  record.timestamp = chrono::duration_cast<chrono::nanoseconds>(
+    chrono::system_clock::now().time_since_epoch()).count();
+  record.level = level;
+  record.reserved = 0;
+  record.length = 0;
+}
+
+LogLine& LogLine::operator<<(string_view text) {
+  size_t length = min(text.size(), LogRecord::kMaxTextLength - record.length);
+  memcpy(record.text + record.length, text.data(), length);
+  record.length += length;
+  return *this;
+}
+
+LogLine& LogLine::operator<<(double value) {
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "%g", value);
+  return *this << string_view(buffer, max(0, length));
+}
+
+LogLine& LogLine::appendInteger(long long value) {
+  char buffer[24];
+  return *this << string_view(buffer, to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer);
+}
+
+LogLine& LogLine::appendInteger(unsigned long long value) {
+  char buffer[24];
+  return *this << string_view(buffer, to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer);
+}
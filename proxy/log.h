@@ -0,0 +1,187 @@
+/**
+ * File: log.h
+ * -----------
+ * Defines the Logger class, through which every part of the proxy logs, and
+ * the LOG macro that feeds it.  Logging a line never takes a lock or touches a
+ * stream: the line is formatted into a fixed-size record on the caller's stack and
+ * copied into a ring buffer owned by the calling thread, and a background thread
+ * drains every ring, writing the records either as text to the console or, in a
+ * compact binary form, to a log file (which proxy-log prints).  A line below the
+ * current level costs a single relaxed load, and a line that finds its ring full
+ * is dropped (and counted) rather than waited on.
+ *
+ * Usage:
+ *
+ *   LOG(Info) << "Handling " << request.getMethod() << " request";
+ */
+
+#ifndef _log_
+#define _log_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <istream>
+#include <ostream>
+#include <cstdio>
+#include <cstdint>
+#include <type_traits>
+
+enum class LogLevel : uint8_t { Error, Warning, Info, Debug };
+
+/**
+ * Struct: LogRecord
+ * -----------------
+ * A single line of the log, as it's held in the ring buffers.  Text longer
+ * than kMaxTextLength is truncated, and isn't null terminated.
+ */
+struct LogRecord {
+  static const size_t kMaxTextLength = 232;
+  uint64_t timestamp; // nanoseconds since the epoch
+  uint32_t thread;    // small integer identifying the logging thread
+  LogLevel level;
+  uint8_t reserved;
+  uint16_t length;
+  char text[kMaxTextLength];
+};
+
+class Logger {
+ public:
+
+/**
+ * Method: getInstance
+ * -------------------
+ * Returns the logger shared by the entire process, launching its writer thread
+ * the first time it's called.
+ */
+  static Logger& getInstance();
+
+/**
+ * Methods: setLevel, getLevel, isEnabled
+ * --------------------------------------
+ * Lines logged at levels above the current one (Info, to begin with) are
+ * discarded before they're even formatted.  Thread safe.
+ */
+  void setLevel(LogLevel level) { this->level.store(level, std::memory_order_relaxed); }
+  LogLevel getLevel() const { return level.load(std::memory_order_relaxed); }
+  bool isEnabled(LogLevel level) const { return level <= getLevel(); }
+
+/**
+ * Method: setLogFile
+ * ------------------
+ * Directs all subsequent records to the named file, in binary form, instead of the
+ * console.  The file is appended to if it already exists.  Throws an HTTPProxyException
+ * if the file can't be opened.
+ */
+  void setLogFile(const std::string& filename);
+
+/**
+ * Method: submit
+ * --------------
+ * Copies the supplied record into the calling thread's ring buffer, filling in
+ * its thread, or counts it as dropped if the ring is full.  Never blocks.
+ */
+  void submit(LogRecord& record);
+
+/**
+ * Method: flush
+ * -------------
+ * Blocks until everything logged before the call has been written.  Thread safe.
+ */
+  void flush();
+
+/**
+ * Method: parseLogFile
+ * --------------------
+ * Reads the binary records written to a log file from infile, and prints them as
+ * text to outfile, one line apiece.  Returns false if infile doesn't hold a log.
+ */
+  static bool parseLogFile(std::istream& infile, std::ostream& outfile);
+
+  ~Logger();
+
+ private:
+  static const size_t kRingSize = 512; // records
+
+  // written only by its own thread (head) and by the writer (tail)
+  struct Ring {
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    uint32_t thread;
+    LogRecord records[kRingSize];
+  };
+
+  std::atomic<LogLevel> level;
+  std::mutex m;                               // guards everything below
+  std::vector<std::shared_ptr<Ring>> rings;
+  uint32_t nextThread;
+  FILE *logFile;
+  uint64_t numPasses;                         // over the rings by the writer, so flush knows when it's caught up
+  bool running;
+  std::condition_variable wakeCV;
+  std::condition_variable writtenCV;
+  std::thread writer;
+
+  Logger();
+  Ring& getRing();
+  void write();
+  void drain(std::vector<LogRecord>& records);
+  void writeRecords(const std::vector<LogRecord>& records);
+  static void printRecord(const LogRecord& record, std::ostream& outfile);
+
+  Logger(const Logger& original) = delete;
+  void operator=(const Logger& rhs) = delete;
+};
+
+/**
+ * Class: LogLine
+ * --------------
+ * Accumulates a line of text into a LogRecord, and submits it to the Logger
+ * when destroyed.  Only strings, characters, numbers, and booleans can be
+ * inserted, and nothing is ever allocated.  Meant to be used through LOG.
+ */
+class LogLine {
+ public:
+  explicit LogLine(LogLevel level);
+  ~LogLine() { Logger::getInstance().submit(record); }
+
+  LogLine& operator<<(std::string_view text);
+  LogLine& operator<<(const char *text) { return *this << std::string_view(text); }
+  LogLine& operator<<(const std::string& text) { return *this << std::string_view(text); }
+  LogLine& operator<<(char ch) { return *this << std::string_view(&ch, 1); }
+  LogLine& operator<<(bool value) { return *this << (value ? "true" : "false"); }
+  LogLine& operator<<(double value);
+
+  template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+  LogLine& operator<<(T value) {
+    if constexpr (std::is_signed_v<T>) return appendInteger(static_cast<long long>(value));
+    else return appendInteger(static_cast<unsigned long long>(value));
+  }
+
+ private:
+  LogRecord record;
+
+  LogLine& appendInteger(long long value);
+  LogLine& appendInteger(unsigned long long value);
+
+  LogLine(const LogLine& original) = delete;
+  void operator=(const LogLine& rhs) = delete;
+};
+
+/**
+ * Macro: LOG
+ * ----------
+ * Begins a line of the log at the named level (Error, Warning, Info, or Debug),
+ * to which text is appended with <<.  Nothing to the right of LOG(level) is
+ * evaluated unless the level is enabled.
+ */
+#define LOG(level)                                                      \
+  if (!Logger::getInstance().isEnabled(LogLevel::level)) {} else LogLine(LogLevel::level)
+
+#endif
@@ -10,7 +10,7 @@
 
 #include "proxy.h"
 #include "proxy-exception.h"
-#include "ostreamlock.h"
+#include "log.h"
 
 using namespace std;
 
@@ -22,8 +22,24 @@ using namespace std;
  * otherwise allow execution to continue.
  */
 static void alertOfBrokenPipe() {
-  cerr << oslock << "Client closed socket.... aborting response."
-       << endl << osunlock;
+  LOG(Warning) << "Client closed socket.... aborting response.";
+}
+
+/**
+ * Function: toggleDebugLogging
+ * ----------------------------
+ * Switches to logging everything, or back to whatever level was in
+ * effect before, so a running proxy can be looked into without a restart.
+ */
+static void toggleDebugLogging() {
+  static LogLevel previous = LogLevel::Info;
+  Logger& logger = Logger::getInstance();
+  if (logger.getLevel() == LogLevel::Debug) {
+    logger.setLevel(previous);
+  } else {
+    previous = logger.getLevel();
+    logger.setLevel(LogLevel::Debug);
+  }
 }
 
 static sigset_t getSignals() {
@@ -32,6 +48,8 @@ static sigset_t getSignals() {
   sigaddset(&signals, SIGINT);
   sigaddset(&signals, SIGTSTP);
   sigaddset(&signals, SIGPIPE);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGUSR1);
   return signals;
 }
 
@@ -43,10 +61,11 @@ static void blockSignals() {
 /**
  * Function: handleSignals
  * -----------------------
- * Configures the entire system to quit on ctrl-c and ctrl-z, and to handle
- * broken pipes
+ * Configures the entire system to quit on ctrl-c and ctrl-z, to reload
+ * its configuration on SIGHUP, to toggle debug logging on SIGUSR1, and to
+ * handle broken pipes
  */
-static void handleSignals(function<void()> shutdownServer) {
+static void handleSignals(function<void()> shutdownServer, function<void()> reloadServer) {
   thread([=]{
     sigset_t signals = getSignals();
     while (true) {
@@ -54,6 +73,10 @@ static void handleSignals(function<void()> shutdownServer) {
       sigwait(&signals, &received);
       if (received == SIGINT || received == SIGTSTP) {
         shutdownServer();
+      } else if (received == SIGHUP) {
+        reloadServer();
+      } else if (received == SIGUSR1) {
+        toggleDebugLogging();
       } else if (received == SIGPIPE) {
         alertOfBrokenPipe();
       }
@@ -74,6 +97,8 @@ int main(int argc, char *argv[]) {
   HTTPProxy proxy(argc, argv);
   handleSignals([&proxy]{
     proxy.stopServer();
+  }, [&proxy]{
+    proxy.reloadBlockedDomains();
   });
   try {
     cout << "Listening for all incoming traffic on port " << proxy.getPortNumber() << "." << endl;
@@ -83,6 +108,7 @@ int main(int argc, char *argv[]) {
     }
     proxy.runServer();
   } catch (const HTTPProxyException& hpe) {
+    Logger::getInstance().flush(); // so whatever led up to the error comes first
     cerr << "Fatal Error: " << hpe.what() << endl;
     cerr << "Exiting..... " << endl;
     return kFatalHTTPProxyError;
@@ -0,0 +1,84 @@
+/**
+ * File: memory-cache.cc
+ * ---------------------
+ * Presents the implementation of the MemoryCache class, as exported
+ * by memory-cache.h.
+ */
+
+#include "memory-cache.h"
+using namespace std;
+
+MemoryCache::MemoryCache(size_t capacity, size_t numShards):
+  shardCapacity(capacity / numShards), shards(numShards) {}
+
+shared_ptr<const CachedResponse> MemoryCache::get(size_t key) {
+  Shard& shard = getShard(key);
+  shared_lock<shared_mutex> sl(shard.m);
+  auto found = shard.index.find(key);
+  if (found == shard.index.end()) return nullptr;
+  Entry& entry = *found->second;
+  // a hot entry is already marked, so leave its cache line alone
+  if (!entry.referenced.load(memory_order_relaxed)) entry.referenced.store(true, memory_order_relaxed);
+  return entry.response;
+}
+
+void MemoryCache::put(size_t key, const shared_ptr<const CachedResponse>& response) {
+  Shard& shard = getShard(key);
+  lock_guard<shared_mutex> lg(shard.m);
+  auto found = shard.index.find(key);
+  if (found != shard.index.end()) removeEntry(shard, found->second);
+  size_t capacity = shardCapacity; // read once, since setCapacity may change it at any time
+  if (response->size() > capacity / kMaxShardFractionPerEntry) return;
+
+  while (shard.size + response->size() > capacity) evictEntry(shard);
+  shard.index[key] = shard.entries.emplace(shard.hand, key, response);
+  shard.size += response->size();
+}
+
+void MemoryCache::setCapacity(size_t capacity) {
+  shardCapacity = capacity / shards.size();
+  for (Shard& shard: shards) {
+    lock_guard<shared_mutex> lg(shard.m);
+    while (shard.size > shardCapacity) evictEntry(shard);
+  }
+}
+
+void MemoryCache::remove(size_t key) {
+  Shard& shard = getShard(key);
+  lock_guard<shared_mutex> lg(shard.m);
+  auto found = shard.index.find(key);
+  if (found != shard.index.end()) removeEntry(shard, found->second);
+}
+
+void MemoryCache::clear() {
+  for (Shard& shard: shards) {
+    lock_guard<shared_mutex> lg(shard.m);
+    shard.entries.clear();
+    shard.hand = shard.entries.end();
+    shard.index.clear();
+    shard.size = 0;
+  }
+}
+
+/**
+ * Sweeps the clock hand around the shard, giving each referenced entry it passes
+ * a second chance, and evicts the first entry that hasn't been referenced since
+ * the hand last passed it.  Assumes the shard is locked exclusively and not empty.
+ */
+void MemoryCache::evictEntry(Shard& shard) {
+  while (true) {
+    if (shard.hand == shard.entries.end()) shard.hand = shard.entries.begin();
+    if (!shard.hand->referenced.exchange(false, memory_order_relaxed)) {
+      removeEntry(shard, shard.hand);
+      return;
+    }
+    ++shard.hand;
+  }
+}
+
+void MemoryCache::removeEntry(Shard& shard, list<Entry>::iterator entry) {
+  if (entry == shard.hand) ++shard.hand;
+  shard.size -= entry->response->size();
+  shard.index.erase(entry->key);
+  shard.entries.erase(entry);
+}
@@ -0,0 +1,134 @@
+/**
+ * File: memory-cache.h
+ * --------------------
+ * Defines the MemoryCache class, which keeps the most recently used
+ * cached responses in memory, already serialized, so that hits can
+ * be written straight to the client without touching the file system or
+ * re-parsing anything.  The cache is split into independently locked shards,
+ * and each shard evicts entries that haven't been used lately to stay within
+ * its share of an overall byte budget.  Eviction follows the CLOCK algorithm, so
+ * a hit only has to mark its entry as referenced, and lookups in the same shard
+ * (even of the same entry) proceed in parallel under a shared lock.
+ */
+
+#ifndef _memory_cache_
+#define _memory_cache_
+
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <utility>
+#include <ctime>
+
+/**
+ * Struct: CachedResponse
+ * ----------------------
+ * A cached response in the form it's sent in.  The header string holds the status
+ * line and every header line except Connection (which depends on the client), each
+ * terminated by "\r\n", but not the blank line that ends the header.  CachedResponses are
+ * shared across threads and never modified once they've been placed in a cache.
+ */
+struct CachedResponse {
+  std::string header;
+  std::string payload;
+  bool selfDelimiting;
+  time_t created;
+  time_t expires;
+  size_t size() const { return header.size() + payload.size(); }
+};
+
+class MemoryCache {
+ public:
+
+/**
+ * Constructor: MemoryCache
+ * ------------------------
+ * Constructs an empty cache that holds at most capacity bytes of serialized
+ * responses, split evenly across numShards shards.
+ */
+  static const size_t kDefaultCapacity = 64 << 20;
+  MemoryCache(size_t capacity = kDefaultCapacity, size_t numShards = 16);
+
+/**
+ * Method: setCapacity
+ * -------------------
+ * Changes the number of bytes the cache holds at most, evicting as needed to
+ * fit within the new capacity.  Thread safe.
+ */
+  void setCapacity(size_t capacity);
+
+/**
+ * Method: get
+ * -----------
+ * Returns the response cached under the supplied key, or nullptr if there isn't
+ * one.  Expired responses are returned like any other, so that the caller can
+ * decide whether they're still of use.  Thread safe, and never waits on other gets.
+ */
+  std::shared_ptr<const CachedResponse> get(size_t key);
+
+/**
+ * Method: put
+ * -----------
+ * Caches the supplied response under the supplied key, replacing any previous
+ * response and evicting ones that haven't been used lately as needed.  Responses too large
+ * to share a shard with others aren't admitted at all.  Thread safe.
+ */
+  void put(size_t key, const std::shared_ptr<const CachedResponse>& response);
+
+/**
+ * Method: remove
+ * --------------
+ * Removes whatever response is cached under the supplied key.  Thread safe.
+ */
+  void remove(size_t key);
+
+/**
+ * Method: clear
+ * -------------
+ * Removes every response from the cache.  Thread safe.
+ */
+  void clear();
+
+/**
+ * Method: getMaxEntrySize
+ * -----------------------
+ * Returns the size of the largest response put will admit.
+ */
+  size_t getMaxEntrySize() const { return shardCapacity.load(std::memory_order_relaxed) / kMaxShardFractionPerEntry; }
+
+ private:
+  // an object larger than this fraction of a shard would push out most of its neighbors
+  static const size_t kMaxShardFractionPerEntry = 8;
+
+  struct Entry {
+    size_t key;
+    std::shared_ptr<const CachedResponse> response;
+    std::atomic<bool> referenced; // set by hits, and cleared as the clock hand passes
+    Entry(size_t key, const std::shared_ptr<const CachedResponse>& response):
+      key(key), response(response), referenced(false) {}
+  };
+  struct Shard {
+    std::shared_mutex m;
+    std::list<Entry> entries; // the clock, with the most recently added just behind the hand
+    std::list<Entry>::iterator hand = entries.end(); // the next candidate for eviction
+    std::unordered_map<size_t, std::list<Entry>::iterator> index;
+    size_t size = 0;
+  };
+
+  std::atomic<size_t> shardCapacity;
+  std::vector<Shard> shards;
+
+  Shard& getShard(size_t key) { return shards[key % shards.size()]; }
+  static void evictEntry(Shard& shard);
+  static void removeEntry(Shard& shard, std::list<Entry>::iterator entry);
+
+  MemoryCache(const MemoryCache& original) = delete;
+  void operator=(const MemoryCache& rhs) = delete;
+};
+
+#endif
@@ -0,0 +1,205 @@
+/**
+ * File: metrics.cc
+ * ----------------
+ * Presents the implementation of the metric classes and the MetricsRegistry,
+ * as exported by metrics.h.
+ */
+
+#include "metrics.h"
+#include <cstdio>
+#include <cmath>
+using namespace std;
+using namespace std::chrono;
+
+static const size_t kMaxExportedPowerOfFour = 14; // 4^14 microseconds is about 4.5 minutes
+static const double kExportedPercentiles[] = {50, 90, 99, 99.9};
+
+// each thread sticks to one shard, and threads are dealt out across the shards in turn
+static size_t getShard() {
+  static atomic<size_t> nextShard{0};
+  thread_local size_t shard = nextShard++ % kNumMetricShards;
+  return shard;
+}
+
+void MetricCounter::add(uint64_t amount) {
+  shards[getShard()].value.fetch_add(amount, memory_order_relaxed);
+}
+
+uint64_t MetricCounter::getValue() const {
+  uint64_t value = 0;
+  for (const Shard& shard: shards) value += shard.value.load(memory_order_relaxed);
+  return value;
+}
+
+LatencyHistogram::LatencyHistogram(): shards(new Shard[kNumMetricShards]) {
+  for (size_t i = 0; i < kNumMetricShards; i++) {
+    for (atomic<uint64_t>& count: shards[i].counts) count.store(0, memory_order_relaxed);
+    shards[i].sum.store(0, memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::record(microseconds latency) {
+  uint64_t micros = max<int64_t>(latency.count(), 0);
+  Shard& shard = shards[getShard()];
+  shard.counts[getBucket(micros)].fetch_add(1, memory_order_relaxed);
+  shard.sum.fetch_add(micros, memory_order_relaxed);
+}
+
+void LatencyHistogram::getSnapshot(Snapshot& snapshot) const {
+  snapshot = Snapshot();
+  for (size_t i = 0; i < kNumMetricShards; i++) {
+    for (size_t bucket = 0; bucket < kNumBuckets; bucket++) {
+      uint64_t count = shards[i].counts[bucket].load(memory_order_relaxed);
+      snapshot.counts[bucket] += count;
+      snapshot.count += count;
+    }
+    snapshot.sum += shards[i].sum.load(memory_order_relaxed);
+  }
+}
+
+microseconds LatencyHistogram::Snapshot::getPercentile(double fraction) const {
+  if (count == 0) return microseconds(0);
+  uint64_t rank = max<uint64_t>(ceil(fraction * count), 1);
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < kNumBuckets; bucket++) {
+    seen += counts[bucket];
+    if (seen >= rank) return microseconds(getBucketLimit(bucket) - 1);
+  }
+  return microseconds(getBucketLimit(kNumBuckets - 1) - 1);
+}
+
+/**
+ * Values below kNumSubBuckets get a bucket apiece.  Beyond that, the values between
+ * each power of two 2^k and the next are split across kNumSubBuckets buckets, which
+ * are told apart by the kSubBucketBits bits following the leading one.
+ */
+size_t LatencyHistogram::getBucket(uint64_t micros) {
+  if (micros < kNumSubBuckets) return micros;
+  size_t exponent = 63 - __builtin_clzll(micros);
+  if (exponent > kMaxExponent) return kNumBuckets - 1;
+  size_t subBucket = (micros >> (exponent - kSubBucketBits)) & (kNumSubBuckets - 1);
+  return (exponent - kSubBucketBits + 1) * kNumSubBuckets + subBucket;
+}
+
+uint64_t LatencyHistogram::getBucketLimit(size_t bucket) {
+  if (bucket < kNumSubBuckets) return bucket + 1;
+  size_t exponent = bucket / kNumSubBuckets + kSubBucketBits - 1;
+  uint64_t width = uint64_t(1) << (exponent - kSubBucketBits);
+  return (kNumSubBuckets + bucket % kNumSubBuckets + 1) * width;
+}
+
+MetricsRegistry& MetricsRegistry::getInstance() {
+  static MetricsRegistry registry;
+  return registry;
+}
+
+MetricCounter& MetricsRegistry::addCounter(const string& name, const string& help, const string& labels) {
+  lock_guard<mutex> lg(m);
+  unique_ptr<MetricCounter>& counter = getFamily(name, help, "counter").counters[labels];
+  if (!counter) counter = make_unique<MetricCounter>();
+  return *counter;
+}
+
+MetricGauge& MetricsRegistry::addGauge(const string& name, const string& help, const string& labels) {
+  lock_guard<mutex> lg(m);
+  unique_ptr<MetricGauge>& gauge = getFamily(name, help, "gauge").gauges[labels];
+  if (!gauge) gauge = make_unique<MetricGauge>();
+  return *gauge;
+}
+
+LatencyHistogram& MetricsRegistry::addHistogram(const string& name, const string& help, const string& labels) {
+  lock_guard<mutex> lg(m);
+  unique_ptr<LatencyHistogram>& histogram = getFamily(name, help, "histogram").histograms[labels];
+  if (!histogram) histogram = make_unique<LatencyHistogram>();
+  return *histogram;
+}
+
+void MetricsRegistry::addGaugeFunction(const string& name, const string& help, const function<double()>& read) {
+  lock_guard<mutex> lg(m);
+  getFamily(name, help, "gauge").read = read;
+}
+
+void MetricsRegistry::removeGaugeFunction(const string& name) {
+  lock_guard<mutex> lg(m);
+  families.erase(name);
+}
+
+/**
+ * Returns the family with the supplied name, creating it if need be.  Assumes
+ * the lock is held.
+ */
+MetricsRegistry::Family& MetricsRegistry::getFamily(const string& name, const string& help, const string& type) {
+  Family& family = families[name];
+  if (family.type.empty()) {
+    family.help = help;
+    family.type = type;
+  }
+  return family;
+}
+
+// renders a value the way Prometheus expects floating point numbers
+static string formatValue(double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.9g", value);
+  return buffer;
+}
+
+static string formatLabels(const string& labels, const string& extra = "") {
+  if (labels.empty() && extra.empty()) return "";
+  if (labels.empty() || extra.empty()) return "{" + labels + extra + "}";
+  return "{" + labels + "," + extra + "}";
+}
+
+string MetricsRegistry::render() const {
+  lock_guard<mutex> lg(m);
+  string text;
+  for (const auto& [name, family]: families) {
+    text += "# HELP " + name + " " + family.help + "\n";
+    text += "# TYPE " + name + " " + family.type + "\n";
+    for (const auto& [labels, counter]: family.counters) {
+      text += name + formatLabels(labels) + " " + to_string(counter->getValue()) + "\n";
+    }
+    for (const auto& [labels, gauge]: family.gauges) {
+      text += name + formatLabels(labels) + " " + to_string(gauge->getValue()) + "\n";
+    }
+    if (family.read) text += name + " " + formatValue(family.read()) + "\n";
+    for (const auto& [labels, histogram]: family.histograms) {
+      renderHistogram(text, name, labels, *histogram);
+    }
+  }
+  return text;
+}
+
+/**
+ * Appends the supplied histogram to text: its buckets (cumulatively, in seconds,
+ * as Prometheus histograms are), sum, and count, followed by a family of its
+ * percentiles, which the buckets are too coarse to reproduce.
+ */
+void MetricsRegistry::renderHistogram(string& text, const string& name, const string& labels,
+                                      const LatencyHistogram& histogram) {
+  unique_ptr<LatencyHistogram::Snapshot> snapshot = make_unique<LatencyHistogram::Snapshot>();
+  histogram.getSnapshot(*snapshot);
+
+  uint64_t cumulative = 0;
+  size_t bucket = 0;
+  for (size_t power = 0; power <= kMaxExportedPowerOfFour; power++) {
+    uint64_t limit = uint64_t(1) << (2 * power);
+    for (; bucket < LatencyHistogram::kNumBuckets && LatencyHistogram::getBucketLimit(bucket) <= limit; bucket++) {
+      cumulative += snapshot->counts[bucket];
+    }
+    string le = "le=\"" + formatValue(limit / 1e6) + "\"";
+    text += name + "_bucket" + formatLabels(labels, le) + " " + to_string(cumulative) + "\n";
+  }
+  text += name + "_bucket" + formatLabels(labels, "le=\"+Inf\"") + " " + to_string(snapshot->count) + "\n";
+  text += name + "_sum" + formatLabels(labels) + " " + formatValue(snapshot->sum / 1e6) + "\n";
+  text += name + "_count" + formatLabels(labels) + " " + to_string(snapshot->count) + "\n";
+
+  string percentiles = name + "_percentile";
+  text += "# HELP " + percentiles + " Percentiles of " + name + ", to within 12.5%.\n";
+  text += "# TYPE " + percentiles + " gauge\n";
+  for (double percentile: kExportedPercentiles) {
+    string label = "percentile=\"" + formatValue(percentile) + "\"";
+    double seconds = snapshot->getPercentile(percentile / 100).count() / 1e6;
+    text += percentiles + formatLabels(labels, label) + " " + formatValue(seconds) + "\n";
+  }
+}
@@ -0,0 +1,178 @@
+/**
+ * File: metrics.h
+ * ---------------
+ * Defines the counters, gauges, and latency histograms the proxy keeps on
+ * itself, and the MetricsRegistry that names them and renders them in the
+ * Prometheus text format.  Updating a metric never takes a lock: counters and
+ * histograms are split into cache-line-aligned shards, each thread updates the
+ * shard it was assigned with relaxed atomic adds, and the shards are only summed
+ * when the metrics are rendered.
+ *
+ * Histograms are HDR-style: each power of two is split into eight equal
+ * buckets, so any recorded latency (from a microsecond to days) is placed
+ * to within 12.5%, in a fixed 312 buckets.
+ */
+
+#ifndef _metrics_
+#define _metrics_
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+static const size_t kNumMetricShards = 16;
+
+/**
+ * Class: MetricCounter
+ * --------------------
+ * A count that only ever goes up.  Thread safe.
+ */
+class MetricCounter {
+ public:
+  void add(uint64_t amount = 1);
+  uint64_t getValue() const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value{0};
+  };
+  Shard shards[kNumMetricShards];
+};
+
+/**
+ * Class: MetricGauge
+ * ------------------
+ * A value that can go up and down, such as the number of things currently
+ * open.  Meant for values that change far less often than counters.  Thread safe.
+ */
+class MetricGauge {
+ public:
+  void add(int64_t amount) { value.fetch_add(amount, std::memory_order_relaxed); }
+  void set(int64_t value) { this->value.store(value, std::memory_order_relaxed); }
+  int64_t getValue() const { return value.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> value{0};
+};
+
+/**
+ * Class: LatencyHistogram
+ * -----------------------
+ * Records how long something took, in microseconds, so the distribution
+ * (and not just the average) can be reported.  Thread safe.
+ */
+class LatencyHistogram {
+ public:
+  static const size_t kSubBucketBits = 3;
+  static const size_t kNumSubBuckets = 1 << kSubBucketBits;
+  static const size_t kMaxExponent = 40; // 2^40 microseconds is about 12 days
+  static const size_t kNumBuckets = (kMaxExponent - kSubBucketBits + 2) * kNumSubBuckets;
+
+  LatencyHistogram();
+  void record(std::chrono::microseconds latency);
+
+/**
+ * Struct: Snapshot
+ * ----------------
+ * The histogram's buckets summed across all shards at some moment,
+ * along with the number of latencies recorded and their sum.
+ */
+  struct Snapshot {
+    uint64_t counts[kNumBuckets];
+    uint64_t count;
+    uint64_t sum; // microseconds
+
+    // returns the latency below which the supplied fraction of those recorded fall
+    std::chrono::microseconds getPercentile(double fraction) const;
+  };
+  void getSnapshot(Snapshot& snapshot) const;
+
+/**
+ * Methods: getBucket, getBucketLimit
+ * ----------------------------------
+ * Return the bucket the supplied number of microseconds falls into, and
+ * the smallest number of microseconds too large for the supplied bucket.
+ */
+  static size_t getBucket(uint64_t micros);
+  static uint64_t getBucketLimit(size_t bucket);
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> counts[kNumBuckets];
+    std::atomic<uint64_t> sum;
+  };
+  std::unique_ptr<Shard[]> shards;
+};
+
+class MetricsRegistry {
+ public:
+
+/**
+ * Method: getInstance
+ * -------------------
+ * Returns the registry shared by the entire process.
+ */
+  static MetricsRegistry& getInstance();
+
+/**
+ * Methods: addCounter, addGauge, addHistogram
+ * -------------------------------------------
+ * Return the metric registered under the supplied name and labels (rendered
+ * as is between braces, e.g. result="hit"), registering it first if need be.
+ * Metrics live as long as the registry, so callers typically hold on to the
+ * returned reference in a static.  Thread safe.
+ */
+  MetricCounter& addCounter(const std::string& name, const std::string& help, const std::string& labels = "");
+  MetricGauge& addGauge(const std::string& name, const std::string& help, const std::string& labels = "");
+  LatencyHistogram& addHistogram(const std::string& name, const std::string& help, const std::string& labels = "");
+
+/**
+ * Methods: addGaugeFunction, removeGaugeFunction
+ * ----------------------------------------------
+ * Registers a gauge whose value is read by calling the supplied function whenever
+ * the metrics are rendered, and unregisters it, which must be done before anything
+ * the function uses goes away.  Thread safe.
+ */
+  void addGaugeFunction(const std::string& name, const std::string& help, const std::function<double()>& read);
+  void removeGaugeFunction(const std::string& name);
+
+/**
+ * Method: render
+ * --------------
+ * Returns every registered metric in the Prometheus text exposition format
+ * (version 0.0.4).  Latencies are reported in seconds, with histogram buckets
+ * at every power of four microseconds and a companion family of percentiles.
+ * Thread safe.
+ */
+  std::string render() const;
+
+ private:
+  struct Family {
+    std::string help;
+    std::string type;
+    // each keyed by labels
+    std::map<std::string, std::unique_ptr<MetricCounter>> counters;
+    std::map<std::string, std::unique_ptr<MetricGauge>> gauges;
+    std::map<std::string, std::unique_ptr<LatencyHistogram>> histograms;
+    std::function<double()> read;
+  };
+
+  mutable std::mutex m;
+  std::map<std::string, Family> families;
+
+  MetricsRegistry() = default;
+  Family& getFamily(const std::string& name, const std::string& help, const std::string& type);
+  static void renderHistogram(std::string& text, const std::string& name, const std::string& labels,
+                              const LatencyHistogram& histogram);
+
+  MetricsRegistry(const MetricsRegistry& original) = delete;
+  void operator=(const MetricsRegistry& rhs) = delete;
+};
+
+#endif
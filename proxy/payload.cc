@@ -11,6 +11,7 @@
 #include <iostream>
 #include <vector>
 #include <iterator>
+#include <algorithm>
 #include "string-utils.h"
 
 using namespace std;
@@ -26,6 +27,12 @@ void HTTPPayload::ingestPayload(const HTTPHeader& header, istream& instream) {
   }
 }
 
+bool HTTPPayload::streamPayload(const HTTPHeader& header, istream& instream, const Sink& sink) {
+  if (isChunkedPayload(header)) return streamChunkedPayload(instream, sink);
+  bool untilEOF = !header.containsName("Content-Length");
+  return streamPayloadBytes(instream, header.getValueAsNumber("Content-Length"), untilEOF, sink);
+}
+
 void HTTPPayload::setPayload(HTTPHeader& header, const string& payload) {
   this->payload.clear();
   appendData(payload);
@@ -39,7 +46,7 @@ ostream& operator<<(ostream& os, const HTTPPayload& hp) {
 
 /** Private methods **/
 
-bool HTTPPayload::isChunkedPayload(const HTTPHeader& header) const {
+bool HTTPPayload::isChunkedPayload(const HTTPHeader& header) {
   return header.getValueAsString("Transfer-Encoding") == "chunked";
 }
 
@@ -61,6 +68,48 @@ void HTTPPayload::ingestChunkedPayload(istream& instream) {
   appendData("\r\n");
 }
 
+bool HTTPPayload::streamChunkedPayload(istream& instream, const Sink& sink) {
+  while (true) {
+    string chunkSizeStr;
+    getline(instream, chunkSizeStr);
+    if (instream.fail()) return false;
+    chunkSizeStr = trim(chunkSizeStr);
+    if (!sink(chunkSizeStr.data(), chunkSizeStr.size()) || !sink("\r\n", 2)) return false;
+    chunkSizeStr.insert(0, "0x");
+    unsigned long chunkSize = strtoul(chunkSizeStr.c_str(), NULL, kHexBase);
+    if (chunkSize == 0) break;
+    if (!streamPayloadBytes(instream, chunkSize + 2, /* untilEOF = */ false, sink)) return false; // includes \r\n
+  }
+
+  // forward any trailers, up through the blank line that ends the payload
+  while (true) {
+    string line;
+    getline(instream, line);
+    if (instream.fail()) return false;
+    line = rtrim(line);
+    line.append("\r\n");
+    if (!sink(line.data(), line.size())) return false;
+    if (line.size() == 2) return true;
+  }
+}
+
+/**
+ * Forwards the next length bytes (or, if untilEOF is true, everything up to EOF),
+ * handing over whatever has arrived as soon as any of it has, rather than waiting
+ * for a full buffer.
+ */
+bool HTTPPayload::streamPayloadBytes(istream& instream, size_t length, bool untilEOF, const Sink& sink) {
+  char buffer[kStreamBufferSize];
+  while (untilEOF || length > 0) {
+    if (instream.peek() == EOF) return untilEOF && instream.eof(); // blocks until something arrives
+    size_t count = instream.readsome(buffer, untilEOF ? sizeof(buffer) : min(length, sizeof(buffer)));
+    if (count == 0) return false;
+    if (!sink(buffer, count)) return false;
+    if (!untilEOF) length -= count;
+  }
+  return true;
+}
+
 void HTTPPayload::ingestCompletePayload(istream& instream, size_t contentLength) {
   vector<char> content(contentLength);
   instream.read(&*content.begin(), contentLength);
@@ -13,6 +13,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <functional>
 
 class HTTPPayload {
 
@@ -32,15 +33,39 @@ class HTTPPayload {
  */
   void ingestPayload(const HTTPHeader& header, std::istream& instream);
 
+/**
+ * Receives each piece of a streamed payload, and returns false if the
+ * rest of the payload is no longer wanted.
+ */
+  typedef std::function<bool(const char *data, size_t length)> Sink;
+
+/**
+ * Reads the payload described by the supplied HTTPHeader from the provided
+ * istream without retaining any of it, handing each piece to sink as soon as
+ * it arrives, framed exactly as ingestPayload would have stored it.  Pieces are
+ * never larger than kStreamBufferSize bytes.  Payloads that are neither chunked
+ * nor of known length run until the istream reaches EOF.  Returns true if and
+ * only if the entire payload was read and accepted by sink.
+ */
+  static bool streamPayload(const HTTPHeader& header, std::istream& instream, const Sink& sink);
+  static const size_t kStreamBufferSize = 1 << 16;
+
 /**
  * Sets the payload to be equal to the stream of characters contained
  * in the payload string.
  */
   void setPayload(HTTPHeader& header, const std::string& payload);
 
+/**
+ * Returns a reference to the raw payload bytes.
+ */
+  const std::vector<char>& getData() const { return payload; }
+
  private:
   std::vector<char> payload;
-  bool isChunkedPayload(const HTTPHeader& header) const;
+  static bool isChunkedPayload(const HTTPHeader& header);
+  static bool streamChunkedPayload(std::istream& instream, const Sink& sink);
+  static bool streamPayloadBytes(std::istream& instream, size_t length, bool untilEOF, const Sink& sink);
   void ingestChunkedPayload(std::istream& instream);
   void ingestCompletePayload(std::istream& instream, size_t contentLength);
   void appendData(const std::string& data);
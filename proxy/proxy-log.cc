@@ -0,0 +1,34 @@
+/**
+ * File: proxy-log.cc
+ * ------------------
+ * Prints the binary log files written by proxy --log-file as text, one
+ * line per record, with the time each was logged, the (small) number of the
+ * thread that logged it, and its level.
+ *
+ * Usage: proxy-log <log-file> ...
+ */
+
+#include <iostream>
+#include <fstream>
+#include "log.h"
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " <log-file> ..." << endl;
+    return 1;
+  }
+
+  int status = 0;
+  for (int i = 1; i < argc; i++) {
+    ifstream infile(argv[i], ios::binary);
+    if (!infile) {
+      cerr << argv[0] << ": Failed to open \"" << argv[i] << "\"." << endl;
+      status = 1;
+    } else if (!Logger::parseLogFile(infile, cout)) {
+      cerr << argv[0] << ": \"" << argv[i] << "\" isn't a proxy log." << endl;
+      status = 1;
+    }
+  }
+  return status;
+}
@@ -12,6 +12,7 @@
 #include <sstream>         // for ostringstream
 #include <unistd.h>        // for getuid
 #include <pwd.h>           // for getpwuid
+#include <strings.h>       // for strcasecmp
 using namespace std;
 
 /**
@@ -104,3 +105,16 @@ long extractLongInRange(const char *str, long min, long max, const char *flags)
 
   return l;
 }
+
+LogLevel extractLogLevel(const char *str, const char *flags) {
+  static const pair<const char *, LogLevel> kLevels[] = {
+    {"error", LogLevel::Error}, {"warning", LogLevel::Warning}, {"info", LogLevel::Info}, {"debug", LogLevel::Debug},
+  };
+  for (const auto& level: kLevels) {
+    if (str != NULL && strcasecmp(str, level.first) == 0) return level.second;
+  }
+
+  ostringstream oss;
+  oss << "The argument accompanying " << flags << " must be one of error, warning, info, or debug.";
+  throw HTTPProxyException(oss.str());
+}
@@ -21,10 +21,13 @@
  *                              a preexisting cache entry is found, we ignore the true expiration
  *                              time if current-time + max-cache-time is smaller, in which case we
  *                              go with that
+ *  --log-level <level>: logs only lines at or above the named level (error, warning, info, or debug)
+ *  --log-file <file>: writes the log to the named file, in binary form, instead of the console
  */
 
 #pragma once
 #include "proxy-exception.h"
+#include "log.h"
 #include <string>
 
 /**
@@ -64,3 +67,12 @@ std::string extractProxyServer(const char *proxyArgument);
  * fit in a long, string isn't purely numeric), then an HTTPProxyException is thrown.
  */
 long extractLongInRange(const char *str, long min, long max, const char *flags);
+
+/**
+ * Function: extractLogLevel
+ * -------------------------
+ * Converts the name of a log level ("error", "warning", "info", or "debug",
+ * in any case) into the LogLevel it names.  If it names none of them, an
+ * HTTPProxyException is thrown.
+ */
+LogLevel extractLogLevel(const char *str, const char *flags);
@@ -18,10 +18,18 @@
 #include <netdb.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <exception>
 #include "proxy-options.h"
+#include "client-socket.h"
 #include "proxy-exception.h"
-#include "ostreamlock.h"
+#include "log.h"
 using namespace std;
+using namespace std::chrono;
 
 /** Public constructor and methods **/
 
@@ -33,19 +41,15 @@ using namespace std;
  * to the specified port number), then an HTTPProxyException
  * is thrown.
  */
-static const int kUnitializedSocket = -1;
 HTTPProxy::HTTPProxy(int argc, char *argv[]):
   portNumber(computeDefaultPortForUser()), usingProxy(false),
   usingSpecificProxyPortNumber(false), proxyPortNumber(computeDefaultPortForUser()), 
-  listenfd(kUnitializedSocket) {
+  numListeners(1), backlog(SOMAXCONN) {
   try {
     configureFromArgumentList(argc, argv);
-    createServerSocket();
-    configureServerSocket();
+    createServerSockets();
   } catch (const HTTPProxyException& hpe) {
-    if (listenfd != kUnitializedSocket) {
-      close(listenfd);
-    }
+    closeServerSockets();
     throw;
   }
 }
@@ -55,43 +59,146 @@ HTTPProxy::HTTPProxy(int argc, char *argv[]):
  * -----------------
  * General umbrella method that blocks until a request is detected.  When a
  * request is detected, the IP address of the requesting host is extracted, and
- * the request is proxied on to the origin server.
+ * the request is proxied on to the origin server.  Each listening socket beyond
+ * the first is serviced by a thread of its own, and a failure on any one of
+ * them stops them all and is rethrown here.
  */
 void HTTPProxy::runServer() {
+  exception_ptr failure;
+  mutex failureLock;
+  auto acceptUntilStopped = [this, &failure, &failureLock](size_t listener) {
+    try {
+      acceptConnections(listener);
+    } catch (...) {
+      lock_guard<mutex> lg(failureLock);
+      if (!failure) failure = current_exception();
+      isRunning = false;
+      for (int listenfd: listenfds) shutdown(listenfd, SHUT_RDWR);
+    }
+  };
+
+  vector<thread> acceptors;
+  for (size_t i = 1; i < listenfds.size(); i++) acceptors.push_back(thread(acceptUntilStopped, i));
+  acceptUntilStopped(0);
+  for (thread& acceptor: acceptors) acceptor.join();
+  if (failure) rethrow_exception(failure);
+}
+
+void HTTPProxy::stopServer() {
+  LOG(Info) << "Shutting down proxy.";
+  isRunning = false;
+  for (int listenfd: listenfds) shutdown(listenfd, SHUT_RDWR);
+}
+
+/** Private methods **/
+
+/**
+ * Method: acceptConnections
+ * -------------------------
+ * Accepts connections on the specified listening socket until the server is
+ * stopped, passing each one to the scheduler, which parks it with one of the
+ * reactors set aside for that listener.
+ */
+void HTTPProxy::acceptConnections(size_t listener) {
   while (true) {
     struct sockaddr_in clientAddr;
     socklen_t clientAddrSize = sizeof(clientAddr);
     memset(&clientAddr, 0, clientAddrSize);
-    int connectionfd = accept(listenfd, (struct sockaddr *) &clientAddr, &clientAddrSize);
-    if (!isRunning) return;
+    // the reactors want non-blocking descriptors, and accept4 hands them over that way
+    int connectionfd = accept4(listenfds[listener], (struct sockaddr *) &clientAddr, &clientAddrSize,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (!isRunning) {
+      if (connectionfd >= 0) close(connectionfd);
+      return;
+    }
     if (connectionfd < 0) {
       // connectionfd isn't open, so we're not orphaning any resources
-      throw HTTPProxyException
-        ("Call to accept failed to return a valid client socket.");
+      if (!recoverFromAcceptFailure(listener, errno)) {
+        throw HTTPProxyException
+          ("Call to accept failed to return a valid client socket.");
+      }
+      continue;
     }
     
     char buffer[INET_ADDRSTRLEN];
     const char *clientIPAddress = inet_ntop(AF_INET, &clientAddr.sin_addr, buffer, sizeof(buffer));
-    if (clientIPAddress == NULL) throw HTTPProxyException("Failed to extract an IP address from the client connection.");
+    if (clientIPAddress == NULL) {
+      LOG(Warning) << "Failed to extract an IP address from a client connection, so it's being closed.";
+      close(connectionfd);
+      continue;
+    }
     try {
-      scheduler.scheduleRequest(connectionfd, clientIPAddress);
+      scheduler.scheduleRequest(connectionfd, clientIPAddress, listener, listenfds.size());
     } catch (...) {
-      cerr << "General failure while in communication with " << clientIPAddress << "." << endl;
-      cerr << "But it's just one connection, so we're ignoring..." << endl;
+      LOG(Warning) << "General failure while in communication with " << clientIPAddress << ".";
+      LOG(Warning) << "But it's just one connection, so we're ignoring...";
     }
   }
 }
 
-void HTTPProxy::stopServer() {
-  cout << oslock << endl << "Shutting down proxy." << endl << osunlock;
-  isRunning = false;
-  shutdown(listenfd, SHUT_RDWR);
-}
+static const milliseconds kAcceptBackoff(100);
 
-/** Private methods **/
+/**
+ * Method: recoverFromAcceptFailure
+ * --------------------------------
+ * Decides what to do about a call to accept that failed with the supplied error,
+ * returning true if the listener should carry on accepting, and false if the listening
+ * socket itself is unusable.  Errors that belong to a single connection (one aborted
+ * or botched before it could be accepted, say) are simply passed over.  Running out of
+ * descriptors is survived by shedding load: the listener's spare descriptor is given up
+ * so the connection at the front of the queue can be accepted and closed right away,
+ * rather than left there to make every subsequent accept fail just the same.  Whenever
+ * that isn't possible, the listener backs off for a moment before trying again.
+ */
+bool HTTPProxy::recoverFromAcceptFailure(size_t listener, int error) {
+  switch (error) {
+  case EINTR:
+  case EAGAIN:
+  case ECONNABORTED:
+  case EPROTO:
+  case ENETDOWN:
+  case ENETUNREACH:
+  case EHOSTDOWN:
+  case EHOSTUNREACH:
+  case ENONET:
+  case ENOPROTOOPT:
+  case EOPNOTSUPP:
+    LOG(Debug) << "A connection was lost before it could be accepted: " << strerror(error) << ".";
+    return true;
+  case EMFILE:
+  case ENFILE:
+    LOG(Warning) << "Out of descriptors, so a pending connection is being turned away.";
+    if (sparefds[listener] >= 0) {
+      close(sparefds[listener]);
+      int connectionfd = accept4(listenfds[listener], NULL, NULL, SOCK_CLOEXEC);
+      if (connectionfd >= 0) close(connectionfd);
+      sparefds[listener] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      if (connectionfd >= 0) return true;
+    }
+    this_thread::sleep_for(kAcceptBackoff);
+    return true;
+  case ENOBUFS:
+  case ENOMEM:
+  case EPERM:
+    LOG(Warning) << "Call to accept failed (" << strerror(error) << "), so backing off before trying again.";
+    this_thread::sleep_for(kAcceptBackoff);
+    return true;
+  default:
+    LOG(Error) << "Call to accept failed: " << strerror(error) << ".";
+    return false;
+  }
+}
 
+static const long kMaxNumWorkers = 4096;
+static const long kMaxBacklog = 65535;
+static const long kMaxNumListeners = 256;
+static const long kMaxCacheMegabytes = 1L << 30;
 static const string kUsageString = 
-   "Usage: proxy [--port <port-number>] [--proxy-server <proxy-server> [--proxy-port <port-number>]] [--clear-cache] [--max-age <max-cache-time>]";
+   "Usage: proxy [--port <port-number>] [--proxy-server <proxy-server> [--proxy-port <port-number>]] [--clear-cache] [--max-age <max-cache-time>] "
+   "[--connect-timeout <ms>] [--read-timeout <ms>] [--write-timeout <ms>] [--workers <count>] [--pin-workers] "
+   "[--backlog <count>] [--max-client-requests <count>] [--max-origin-requests <count>] [--max-queued <count>] "
+   "[--listeners <count>] [--log-level <error|warning|info|debug>] [--log-file <file>] "
+   "[--cache-memory <megabytes>] [--cache-disk <megabytes>]";
 void HTTPProxy::configureFromArgumentList(int argc, char *argv[]) {
   struct option options[] = {
     {"port", required_argument, NULL, 'p'},
@@ -99,13 +206,36 @@ void HTTPProxy::configureFromArgumentList(int argc, char *argv[]) {
     {"proxy-server", required_argument, NULL, 's'},
     {"clear-cache", no_argument, NULL, 'c'},
     {"max-age", required_argument, NULL, 'm'},
+    {"connect-timeout", required_argument, NULL, 'C'},
+    {"read-timeout", required_argument, NULL, 'R'},
+    {"write-timeout", required_argument, NULL, 'W'},
+    {"workers", required_argument, NULL, 'w'},
+    {"pin-workers", no_argument, NULL, 'P'},
+    {"backlog", required_argument, NULL, 'b'},
+    {"max-client-requests", required_argument, NULL, 'l'},
+    {"max-origin-requests", required_argument, NULL, 'o'},
+    {"max-queued", required_argument, NULL, 'q'},
+    {"listeners", required_argument, NULL, 'L'},
+    {"log-level", required_argument, NULL, 'v'},
+    {"log-file", required_argument, NULL, 'f'},
+    {"cache-memory", required_argument, NULL, 'M'},
+    {"cache-disk", required_argument, NULL, 'D'},
     {NULL, 0, NULL, 0},
   };
 
   ostringstream oss;
   pair<string, unsigned short> proxy;
+  milliseconds connectTimeout = kDefaultConnectTimeout;
+  milliseconds readTimeout = kDefaultIOTimeout, writeTimeout = kDefaultIOTimeout;
+  size_t numWorkers = HTTPProxyScheduler::kDefaultNumWorkers;
+  bool pinWorkers = false;
+  size_t maxPerClient = HTTPProxyScheduler::kDefaultMaxRequestsPerClient;
+  size_t maxPerOrigin = HTTPRequestHandler::kDefaultMaxRequestsPerOrigin;
+  size_t maxQueued = HTTPProxyScheduler::kDefaultMaxQueuedRequests;
+  size_t memoryBudget = MemoryCache::kDefaultCapacity;
+  uint64_t diskBudget = CacheStore::kDefaultCapacity;
   while (true) {
-    int ch = getopt_long(argc, argv, "p:r:s:cm:", options, NULL);
+    int ch = getopt_long(argc, argv, "p:r:s:cm:C:R:W:w:Pb:l:o:q:L:v:f:M:D:", options, NULL);
     if (ch == -1) break;
     switch (ch) {
     case 'p':
@@ -125,6 +255,48 @@ void HTTPProxy::configureFromArgumentList(int argc, char *argv[]) {
     case 'm':
       scheduler.setCacheMaxAge(extractLongInRange(optarg, -1, LONG_MAX, "--max-age/-m"));
       break;
+    case 'C':
+      connectTimeout = milliseconds(extractLongInRange(optarg, 1, LONG_MAX, "--connect-timeout/-C"));
+      break;
+    case 'R':
+      readTimeout = milliseconds(extractLongInRange(optarg, 0, LONG_MAX, "--read-timeout/-R"));
+      break;
+    case 'W':
+      writeTimeout = milliseconds(extractLongInRange(optarg, 0, LONG_MAX, "--write-timeout/-W"));
+      break;
+    case 'w':
+      numWorkers = extractLongInRange(optarg, 1, kMaxNumWorkers, "--workers/-w");
+      break;
+    case 'P':
+      pinWorkers = true;
+      break;
+    case 'b':
+      backlog = extractLongInRange(optarg, 1, kMaxBacklog, "--backlog/-b");
+      break;
+    case 'l':
+      maxPerClient = extractLongInRange(optarg, 0, LONG_MAX, "--max-client-requests/-l");
+      break;
+    case 'o':
+      maxPerOrigin = extractLongInRange(optarg, 0, LONG_MAX, "--max-origin-requests/-o");
+      break;
+    case 'q':
+      maxQueued = extractLongInRange(optarg, 0, LONG_MAX, "--max-queued/-q");
+      break;
+    case 'L':
+      numListeners = extractLongInRange(optarg, 1, kMaxNumListeners, "--listeners/-L");
+      break;
+    case 'v':
+      Logger::getInstance().setLevel(extractLogLevel(optarg, "--log-level/-v"));
+      break;
+    case 'f':
+      Logger::getInstance().setLogFile(optarg);
+      break;
+    case 'M':
+      memoryBudget = size_t(extractLongInRange(optarg, 0, kMaxCacheMegabytes, "--cache-memory/-M")) << 20;
+      break;
+    case 'D':
+      diskBudget = uint64_t(extractLongInRange(optarg, 1, kMaxCacheMegabytes, "--cache-disk/-D")) << 20;
+      break;
     default:
       oss << "Unrecognized or improperly supplied flag passed to proxy." << endl;
       oss << kUsageString;
@@ -148,39 +320,68 @@ void HTTPProxy::configureFromArgumentList(int argc, char *argv[]) {
   if (!usingSpecificProxyPortNumber) {
     proxyPortNumber = portNumber;
   }
+  scheduler.setUpstreamTimeouts(connectTimeout, readTimeout, writeTimeout);
+  if (numWorkers != HTTPProxyScheduler::kDefaultNumWorkers || pinWorkers) {
+    scheduler.configureWorkers(numWorkers, pinWorkers);
+  }
+  scheduler.setAdmissionLimits(maxPerClient, maxPerOrigin, maxQueued);
+  scheduler.setCacheBudgets(memoryBudget, diskBudget);
 }
 
 /**
- * Creates a server socket and configures it to
+ * Creates the server sockets, one per listener, and configures each to
  * be closed more or less immediately if the surrounding
- * application dies or is killed.
+ * application dies or is killed.  When there are several, SO_REUSEPORT
+ * lets them all bind to the same port, and has the kernel spread incoming
+ * connections across them, so no one accept loop has to keep up with all of them.
  */
-void HTTPProxy::createServerSocket() {
-  listenfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (listenfd < 0) {
-    throw HTTPProxyException
-      ("Failed to open a primary socket to poll for connections.");
-  }
+void HTTPProxy::createServerSockets() {
+  for (size_t i = 0; i < numListeners; i++) {
+    int listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) {
+      throw HTTPProxyException
+        ("Failed to open a primary socket to poll for connections.");
+    }
+    listenfds.push_back(listenfd);
   
-  // the following configures the socket to be auto-closed within a
-  // second if the surrounding process dies.  Otherwise, the socket might
-  // not be available for up to a minute, and that makes iterative development
-  // more difficult to manage if the easier way to kill the proxy server is
-  // to just type Ctrl-C.
-  const int optval = 1;
-  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval , sizeof(int));
+    // the following configures the socket to be auto-closed within a
+    // second if the surrounding process dies.  Otherwise, the socket might
+    // not be available for up to a minute, and that makes iterative development
+    // more difficult to manage if the easier way to kill the proxy server is
+    // to just type Ctrl-C.
+    const int optval = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval , sizeof(int));
+    if (numListeners > 1 && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) < 0) {
+      throw HTTPProxyException
+        ("Failed to allow several listening sockets to share a port.");
+    }
+    configureServerSocket(listenfd);
+
+    // held in reserve, to be given up whenever the proxy runs out of descriptors
+    sparefds.push_back(open("/dev/null", O_RDONLY | O_CLOEXEC));
+  }
 }
 
 /**
- * Further configures the server socket created via
- * createServerSocket so that it listens for activity from
+ * Closes whichever server sockets have been created so far.
+ */
+void HTTPProxy::closeServerSockets() {
+  for (int listenfd: listenfds) close(listenfd);
+  listenfds.clear();
+  for (int sparefd: sparefds) if (sparefd >= 0) close(sparefd);
+  sparefds.clear();
+}
+
+/**
+ * Further configures a server socket created via
+ * createServerSockets so that it listens for activity from
  * any host whatsoever on the port number passed in to the
  * HTTPProxy constructor.  ::bind actually ties the socket
  * to the provided port number, and listen clarifies how many
  * pending connections can be queued up before the proxy starts
  * refusing connections.
  */
-void HTTPProxy::configureServerSocket() const {
+void HTTPProxy::configureServerSocket(int listenfd) const {
   struct sockaddr_in serverAddr;
   memset(&serverAddr, 0, sizeof(serverAddr));
   serverAddr.sin_family = AF_INET;
@@ -195,9 +396,9 @@ void HTTPProxy::configureServerSocket() const {
     oss << "Failed to associate listening socket with port " << portNumber << ".";
     throw HTTPProxyException(oss.str());
   }
-  
-  const size_t kMaxQueuedRequests = 128; // 128 is the largest allowed value
-  if (listen(listenfd, kMaxQueuedRequests) < 0) {
+
+  // the kernel quietly caps the backlog at net.core.somaxconn
+  if (listen(listenfd, backlog) < 0) {
     throw HTTPProxyException
       ("Failed to set listening socket to accept connection requests");
   }
@@ -14,6 +14,8 @@
 #include "proxy-exception.h"
 #include <string>
 #include <utility>
+#include <vector>
+#include <cstddef>
 
 class HTTPProxy {
  public:
@@ -56,14 +58,21 @@ class HTTPProxy {
 
 /**
  * In an infinite loop, waits for an HTTP request to come in, and does whatever
- * it takes to handle it.
+ * it takes to handle it.  If the proxy was configured with several listening
+ * sockets, each gets an accept loop (and a thread) of its own.
  */
   void runServer();
 
 /**
- * Stop handling requests; break out of runServer
+ * Stop handling requests; break out of runServer.  Thread safe.
  */
   void stopServer();
+
+/**
+ * Rereads the list of blocked domains, without interrupting any requests
+ * being serviced.  If the list can't be read, the current one stays in effect.
+ */
+  void reloadBlockedDomains() { scheduler.reloadBlockedDomains(); }
   
  private:
   std::atomic<bool> isRunning = true;
@@ -72,13 +81,19 @@ class HTTPProxy {
   bool usingSpecificProxyPortNumber;
   std::string proxyServer;
   unsigned short proxyPortNumber;
-  int listenfd;
+  size_t numListeners;
+  std::vector<int> listenfds;
+  std::vector<int> sparefds; // one per listener, given up to shed load when out of descriptors
+  int backlog;
   HTTPProxyScheduler scheduler;
   
   /* private methods */
   void configureFromArgumentList(int argc, char *argv[]);
-  void createServerSocket();
-  void configureServerSocket() const;
+  void createServerSockets();
+  void configureServerSocket(int listenfd) const;
+  void acceptConnections(size_t listener);
+  bool recoverFromAcceptFailure(size_t listener, int error);
+  void closeServerSockets();
 };
 
 #endif
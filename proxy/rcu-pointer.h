@@ -0,0 +1,89 @@
+/**
+ * File: rcu-pointer.h
+ * -------------------
+ * Defines the RCUPointer class template, which owns a single, read-mostly
+ * object that can be replaced wholesale while other threads are reading it.
+ * Readers never block or take a lock: they announce themselves by bumping one
+ * of two counters (whichever the current generation selects), and publishing a
+ * replacement advances the generation and then waits for the counter belonging
+ * to the previous one to drain before deleting the object it replaced.
+ */
+
+#ifndef _rcu_pointer_
+#define _rcu_pointer_
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+template <typename T>
+class RCUPointer {
+ public:
+
+/**
+ * Constructor: RCUPointer
+ * -----------------------
+ * Takes ownership of the supplied object, which becomes the one readers see.
+ */
+  explicit RCUPointer(T *initial): current(initial), generation(0), readers{0, 0} {}
+  ~RCUPointer() { delete current.load(); }
+
+/**
+ * Class: Reader
+ * -------------
+ * Provides access to the current object for as long as the Reader exists,
+ * even if a replacement is published in the meantime.  Readers are meant
+ * to be short lived, since publish waits for them.
+ */
+  class Reader {
+   public:
+    explicit Reader(const RCUPointer& rcu): rcu(rcu) {
+      while (true) {
+        generation = rcu.generation.load();
+        rcu.readers[generation & 1]++;
+        if (rcu.generation.load() == generation) break;
+        rcu.readers[generation & 1]--; // a replacement was published as we arrived, so start over
+      }
+      object = rcu.current.load();
+    }
+    ~Reader() { rcu.readers[generation & 1]--; }
+    const T& operator*() const { return *object; }
+    const T *operator->() const { return object; }
+
+   private:
+    const RCUPointer& rcu;
+    uint64_t generation;
+    const T *object;
+    Reader(const Reader& original) = delete;
+    void operator=(const Reader& rhs) = delete;
+  };
+
+/**
+ * Method: publish
+ * ---------------
+ * Takes ownership of replacement and makes it the object all subsequent Readers see,
+ * then waits for all earlier Readers to finish before deleting the object it replaced.
+ */
+  void publish(T *replacement) {
+    std::lock_guard<std::mutex> lg(publishLock);
+    T *replaced = current.exchange(replacement);
+    uint64_t previous = generation++;
+    while (readers[previous & 1].load() != 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    delete replaced;
+  }
+
+ private:
+  std::atomic<T *> current;
+  std::atomic<uint64_t> generation;
+  mutable std::atomic<uint64_t> readers[2];
+  std::mutex publishLock;
+
+  RCUPointer(const RCUPointer& original) = delete;
+  void operator=(const RCUPointer& rhs) = delete;
+};
+
+#endif
@@ -0,0 +1,263 @@
+/**
+ * File: reactor.cc
+ * ----------------
+ * Presents the implementation of the ProxyReactor class, as exported
+ * by reactor.h.
+ */
+
+#include "reactor.h"
+#include "http-parser.h"
+#include "response.h"
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <cstdlib>
+#include <charconv>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+using namespace std;
+
+static const size_t kReactorTimeout = 1;            // seconds between idle sweeps
+static const time_t kIdleConnectionTimeout = 30;    // seconds a client has to deliver its next request
+static const time_t kRequestDeadline = 60;          // seconds a client has to deliver all of a request it's begun
+static const size_t kMaxRequestHeaderSize = 1 << 16;
+static const size_t kMaxRequestPayloadSize = 16 << 20;
+static const size_t kRequestTooLarge = string::npos;
+static const size_t kReadBufferSize = 1 << 14;
+
+/**
+ * Returns the number of bytes occupied by the chunked payload beginning
+ * at offset start, or 0 if the terminating zero-length chunk hasn't yet
+ * arrived in full.
+ */
+static size_t measureChunkedPayload(const string& buffer, size_t start) {
+  size_t pos = start;
+  while (true) {
+    size_t eol = buffer.find('\n', pos);
+    if (eol == string::npos) return 0;
+    unsigned long chunkSize = strtoul(buffer.c_str() + pos, NULL, 16);
+    pos = eol + 1;
+    if (chunkSize == 0) {
+      // trailers (normally none) are terminated by a blank line
+      while (true) {
+        eol = buffer.find('\n', pos);
+        if (eol == string::npos) return 0;
+        bool blank = eol == pos || (eol == pos + 1 && buffer[pos] == '\r');
+        pos = eol + 1;
+        if (blank) return pos - start;
+      }
+    }
+    pos += chunkSize;
+    eol = buffer.find('\n', pos);
+    if (eol == string::npos) return 0;
+    pos = eol + 1;
+  }
+}
+
+/**
+ * Returns the length of the complete request at the front of the buffer,
+ * or 0 if more bytes are needed before the request can be serviced.  Requests
+ * whose header alone exceeds kMaxRequestHeaderSize are reported as complete
+ * so they're handed off (and rejected) rather than buffered forever, while those
+ * whose payload is declared to exceed (or has grown beyond) kMaxRequestPayloadSize
+ * are reported as kRequestTooLarge, to be turned away without being read in full.
+ */
+static size_t measureCompleteRequest(const string& buffer) {
+  // parsed in place, so a request that's still arriving costs nothing to check again
+  string_view parts[3];
+  size_t lineLength, headerLength;
+  HTTPHeaderTable fields;
+  HTTPParseResult result = parseStartLine(buffer, parts, lineLength);
+  if (result == HTTPParseResult::Complete) {
+    result = parseHeader(string_view(buffer).substr(lineLength), fields, headerLength);
+  }
+  if (result == HTTPParseResult::Incomplete) return buffer.size() > kMaxRequestHeaderSize ? buffer.size() : 0;
+  if (result == HTTPParseResult::Invalid) return buffer.size();
+
+  // whatever follows a CONNECT's header (e.g. a TLS ClientHello sent without waiting
+  // for the tunnel to be established) belongs to the tunnel, so it goes along with it
+  if (parts[0] == "CONNECT") return buffer.size();
+
+  size_t headerEnd = lineLength + headerLength;
+  const HTTPHeaderField *field = fields.find("transfer-encoding");
+  if (field != NULL && equalsIgnoreCase(field->value, "chunked")) {
+    size_t payloadLength = measureChunkedPayload(buffer, headerEnd);
+    if (payloadLength > 0) return headerEnd + payloadLength;
+    // chunk sizes and framing aside, this is about as much payload as has arrived
+    return buffer.size() - headerEnd > kMaxRequestPayloadSize ? kRequestTooLarge : 0;
+  }
+
+  size_t contentLength = 0;
+  field = fields.find("content-length");
+  if (field != NULL) from_chars(field->value.data(), field->value.data() + field->value.size(), contentLength);
+  if (contentLength > kMaxRequestPayloadSize) return kRequestTooLarge;
+  return buffer.size() >= headerEnd + contentLength ? headerEnd + contentLength : 0;
+}
+
+/**
+ * Sends the client a response with the supplied status and no payload, without waiting
+ * on the client: it's sent only if it fits in the socket buffer right away (which it all
+ * but always does), since the connection is about to be closed either way.
+ */
+static void sendErrorResponse(int clientfd, HTTPStatus code) {
+  HTTPResponse response;
+  response.setProtocol("HTTP/1.1");
+  response.setResponseCode(code);
+  response.addHeader("content-length", "0");
+  response.addHeader("connection", "close");
+  string text = response.getHeaderString() + "\r\n";
+  send(clientfd, text.data(), text.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+ProxyReactor::ProxyReactor(const RequestDispatcher& dispatcher):
+  dispatcher(dispatcher), watchset(kReactorTimeout, /* edgeTriggered = */ true), running(true) {
+  loop = thread([this] { run(); });
+}
+
+ProxyReactor::~ProxyReactor() {
+  stop();
+  lock_guard<mutex> lg(m);
+  for (const pair<const int, Connection>& p: connections) {
+    if (!p.second.busy) watchset.remove(p.first);
+    close(p.first);
+  }
+}
+
+void ProxyReactor::stop() {
+  running = false;
+  if (loop.joinable()) loop.join();
+}
+
+void ProxyReactor::add(int clientfd, const string& clientIPAddr) {
+  {
+    lock_guard<mutex> lg(m);
+    time_t now = time(NULL);
+    connections[clientfd] = {clientIPAddr, "", now, now, false, false};
+  }
+
+  // the descriptor may already have bytes waiting, but the edge-triggered
+  // watchset still reports them because they're present when it's added
+  watchset.add(clientfd);
+}
+
+void ProxyReactor::resume(int clientfd, bool keepAlive) {
+  unique_lock<mutex> ul(m);
+  if (!keepAlive || !running) {
+    connections.erase(clientfd);
+    close(clientfd);
+    return;
+  }
+
+  Connection& connection = connections[clientfd];
+  connection.busy = false;
+  connection.lastActivity = connection.requestStart = time(NULL);
+  fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+  size_t requestLength = measureCompleteRequest(connection.buffer);
+  if (requestLength == kRequestTooLarge) {
+    sendErrorResponse(clientfd, HTTPStatus::PayloadTooLarge);
+    connections.erase(clientfd);
+    close(clientfd);
+    return;
+  }
+  ul.unlock();
+  if (requestLength > 0) {
+    dispatch(clientfd, requestLength); // pipelined request was already read
+  } else {
+    watchset.add(clientfd);
+  }
+}
+
+void ProxyReactor::run() {
+  vector<int> ready;
+  while (running) {
+    ready.clear();
+    watchset.waitAll(ready);
+    for (int clientfd: ready) readFrom(clientfd);
+    closeIdleConnections();
+  }
+}
+
+void ProxyReactor::readFrom(int clientfd) {
+  unique_lock<mutex> ul(m);
+  auto found = connections.find(clientfd);
+  if (found == connections.end() || found->second.busy) return;
+  Connection& connection = found->second;
+
+  // reading stops once there's more than any one request may hold, so a client can't
+  // make the buffer grow without bound between checks; the rest is read once it's resumed
+  char buffer[kReadBufferSize];
+  while (connection.buffer.size() <= kMaxRequestHeaderSize + kMaxRequestPayloadSize) {
+    ssize_t count = read(clientfd, buffer, sizeof(buffer));
+    if (count > 0) {
+      if (connection.buffer.empty()) connection.requestStart = time(NULL);
+      connection.buffer.append(buffer, count);
+      connection.lastActivity = time(NULL);
+      continue;
+    }
+    if (count < 0 && errno == EINTR) continue;
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (count == 0) {
+      // the client may have only shut down its write side, in which case the
+      // requests it sent beforehand are still answered
+      connection.hungUp = true;
+      break;
+    }
+    closeConnection(clientfd);
+    return;
+  }
+
+  size_t requestLength = measureCompleteRequest(connection.buffer);
+  if (requestLength == kRequestTooLarge) {
+    sendErrorResponse(clientfd, HTTPStatus::PayloadTooLarge);
+    closeConnection(clientfd);
+    return;
+  }
+  if (requestLength == 0) {
+    if (connection.hungUp) closeConnection(clientfd); // hung up before sending a full request
+    return;
+  }
+  watchset.remove(clientfd);
+  ul.unlock();
+  dispatch(clientfd, requestLength);
+}
+
+void ProxyReactor::dispatch(int clientfd, size_t requestLength) {
+  string clientIPAddr, request;
+  bool hungUp;
+  {
+    lock_guard<mutex> lg(m);
+    Connection& connection = connections[clientfd];
+    clientIPAddr = connection.clientIPAddr;
+    hungUp = connection.hungUp;
+    request = connection.buffer.substr(0, requestLength);
+    connection.buffer.erase(0, requestLength);
+    connection.busy = true;
+  }
+
+  fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) & ~O_NONBLOCK);
+  dispatcher(clientfd, clientIPAddr, move(request), hungUp);
+}
+
+void ProxyReactor::closeConnection(int clientfd) {
+  watchset.remove(clientfd);
+  connections.erase(clientfd);
+  close(clientfd);
+}
+
+void ProxyReactor::closeIdleConnections() {
+  lock_guard<mutex> lg(m);
+  time_t now = time(NULL);
+  for (auto curr = connections.begin(); curr != connections.end();) {
+    int clientfd = curr->first;
+    const Connection& connection = curr->second;
+    bool idle = !connection.busy && now - connection.lastActivity > kIdleConnectionTimeout;
+    // a request trickling in a byte at a time is never idle, but it's still cut off
+    bool overdue = !connection.busy && !connection.buffer.empty() && now - connection.requestStart > kRequestDeadline;
+    ++curr;
+    if (overdue) sendErrorResponse(clientfd, HTTPStatus::RequestTimeout);
+    if (idle || overdue) closeConnection(clientfd);
+  }
+}
@@ -0,0 +1,116 @@
+/**
+ * File: reactor.h
+ * ---------------
+ * Defines the ProxyReactor class, which owns a single event loop thread that
+ * watches a collection of non-blocking client connections (via an edge-triggered
+ * ProxyWatchset) and incrementally accumulates each connection's request bytes.
+ * Only once a complete request has arrived is the connection handed off to
+ * the supplied dispatcher (typically one that schedules it on a thread pool), so
+ * slow clients tie up a descriptor and a buffer instead of an entire worker thread.
+ * That buffer is bounded: requests with payloads too large to buffer are turned away
+ * with a 413, and those not received in full within a deadline with a 408.
+ * Persistent connections are handed back to the reactor via resume once each
+ * response has been sent, and pipelined requests are dispatched one at a time,
+ * in the order they arrived.
+ */
+
+#ifndef _proxy_reactor_
+#define _proxy_reactor_
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <ctime>
+#include "watchset.h"
+
+class ProxyReactor {
+ public:
+
+/**
+ * Type: RequestDispatcher
+ * -----------------------
+ * Invoked once a complete request has been read.  The descriptor has been restored
+ * to blocking mode and is no longer watched by the reactor until it's passed to
+ * resume.  The request string holds exactly one request, beginning with its request
+ * line; any bytes that follow it (e.g. pipelined requests) are retained by the reactor.
+ * hungUp is true if the client has already shut down its side of the connection, in
+ * which case the response shouldn't offer to keep it open.
+ */
+  typedef std::function<void(int clientfd, const std::string& clientIPAddr,
+                             std::string&& request, bool hungUp)> RequestDispatcher;
+
+/**
+ * Constructor: ProxyReactor
+ * -------------------------
+ * Constructs the reactor and launches its event loop thread.
+ */
+  ProxyReactor(const RequestDispatcher& dispatcher);
+
+/**
+ * Destructor: ~ProxyReactor
+ * -------------------------
+ * Stops the event loop if it hasn't already been stopped, and closes all
+ * connections the reactor still owns.
+ */
+  ~ProxyReactor();
+
+/**
+ * Method: stop
+ * ------------
+ * Stops the event loop and waits for its thread to exit.  No further requests are
+ * dispatched, though resume may still be called for requests already in flight.
+ */
+  void stop();
+
+/**
+ * Method: add
+ * -----------
+ * Transfers ownership of the supplied, freshly accepted client connection to
+ * the reactor.  The descriptor must already be in non-blocking mode (as accept4
+ * with SOCK_NONBLOCK leaves it), and is watched until a full request arrives,
+ * the client disconnects, or the connection idles out.
+ * Thread safe.
+ */
+  void add(int clientfd, const std::string& clientIPAddr);
+
+/**
+ * Method: resume
+ * --------------
+ * Called once the request most recently dispatched for clientfd has been serviced.
+ * If keepAlive is true, the reactor resumes watching the connection for its next
+ * request (dispatching right away if a pipelined one is already buffered).  Otherwise
+ * the connection is closed.  Thread safe.
+ */
+  void resume(int clientfd, bool keepAlive);
+
+ private:
+  struct Connection {
+    std::string clientIPAddr;
+    std::string buffer;
+    time_t lastActivity;
+    time_t requestStart;  // when the first byte of the request at the front of the buffer arrived
+    bool busy;
+    bool hungUp;  // the client has shut down its side, so no more requests will arrive
+  };
+
+  RequestDispatcher dispatcher;
+  ProxyWatchset watchset;
+  std::mutex m;
+  std::map<int, Connection> connections;
+  std::atomic<bool> running;
+  std::thread loop;
+
+  void run();
+  void readFrom(int clientfd);
+  void dispatch(int clientfd, size_t requestLength);
+  void closeConnection(int clientfd);
+  void closeIdleConnections();
+
+  ProxyReactor(const ProxyReactor& original) = delete;
+  void operator=(const ProxyReactor& rhs) = delete;
+};
+
+#endif
@@ -0,0 +1,40 @@
+/**
+ * File: request-coalescer.cc
+ * --------------------------
+ * Presents the implementation of the RequestCoalescer class, as exported
+ * by request-coalescer.h.
+ */
+
+#include "request-coalescer.h"
+using namespace std;
+
+struct RequestCoalescer::Flight {
+  bool landed = false;
+  condition_variable cv;
+};
+
+bool RequestCoalescer::join(size_t key, shared_ptr<Flight>& flight) {
+  lock_guard<mutex> lg(m);
+  auto found = flights.find(key);
+  if (found != flights.end()) {
+    flight = found->second;
+    return false;
+  }
+
+  flights[key] = make_shared<Flight>();
+  return true;
+}
+
+void RequestCoalescer::land(size_t key) {
+  lock_guard<mutex> lg(m);
+  auto found = flights.find(key);
+  if (found == flights.end()) return;
+  found->second->landed = true;
+  found->second->cv.notify_all();
+  flights.erase(found);
+}
+
+void RequestCoalescer::wait(const shared_ptr<Flight>& flight, chrono::seconds timeout) {
+  unique_lock<mutex> ul(m);
+  flight->cv.wait_for(ul, timeout, [&flight] { return flight->landed; });
+}
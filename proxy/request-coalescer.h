@@ -0,0 +1,54 @@
+/**
+ * File: request-coalescer.h
+ * -------------------------
+ * Defines the RequestCoalescer class, which tracks which cacheable requests
+ * are currently being fetched from their origin servers, so that identical
+ * requests arriving in the meantime can wait for that one fetch to land in
+ * the cache instead of each going to the origin themselves.
+ */
+
+#ifndef _request_coalescer_
+#define _request_coalescer_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+class RequestCoalescer {
+ public:
+  struct Flight;
+
+/**
+ * Method: join
+ * ------------
+ * Returns true if no request for key is in flight, in which case the caller is
+ * now the one fetching it and must call land(key) once it has (or has failed to).
+ * Otherwise returns false and sets flight to the one already underway, which the
+ * caller should pass to wait.  Thread safe.
+ */
+  bool join(size_t key, std::shared_ptr<Flight>& flight);
+
+/**
+ * Method: land
+ * ------------
+ * Marks the request for key as no longer in flight and wakes everyone waiting on it.
+ * Thread safe.
+ */
+  void land(size_t key);
+
+/**
+ * Method: wait
+ * ------------
+ * Blocks until the supplied flight has landed, or until timeout has passed,
+ * whichever comes first.  Thread safe.
+ */
+  void wait(const std::shared_ptr<Flight>& flight, std::chrono::seconds timeout);
+
+ private:
+  std::mutex m;
+  std::map<size_t, std::shared_ptr<Flight>> flights;
+};
+
+#endif
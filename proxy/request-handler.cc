@@ -6,24 +6,74 @@
 
 #include "request-handler.h"
 #include "response.h"
+#include <sstream>
 #include <socket++/sockstream.h> // for sockbuf, iosockstream
-#include "ostreamlock.h"
+#include "log.h"
+#include "metrics.h"
 #include "client-socket.h"
-#include "watchset.h"
+#include "socket-writer.h"
+#include <unistd.h>
+#include <cerrno>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 
 using namespace std;
+using namespace std::chrono;
 
-static const int mnum = 997;
+static const size_t kNumCacheLockStripes = 997;
 static const string kDefaultProtocol = "HTTP/1.0";
 static const string comma = ", ";
 static const string ff = "x-forwarded-for";
+static const seconds kMaxCoalescedWait(30);
+static const string kBlockedDomainsFile = "blocked-domains.txt";
+static const seconds kRetryAfter(1);
+static const string kMetricsPath = "/metrics";
+
+static MetricsRegistry& metrics = MetricsRegistry::getInstance();
+static LatencyHistogram& parseTimes = metrics.addHistogram(
+    "proxy_parse_seconds", "Time spent parsing requests read off the client connection.");
+static LatencyHistogram& resolveTimes = metrics.addHistogram(
+    "proxy_upstream_resolve_seconds", "Time spent resolving origin server names, for new connections.");
+static LatencyHistogram& connectTimes = metrics.addHistogram(
+    "proxy_upstream_connect_seconds", "Time spent connecting to origin servers, for new connections.");
+static LatencyHistogram& firstByteTimes = metrics.addHistogram(
+    "proxy_upstream_first_byte_seconds", "Time from sending a request to an origin server to its response header arriving.");
+static LatencyHistogram& transferTimes = metrics.addHistogram(
+    "proxy_upstream_transfer_seconds", "Time spent relaying response payloads from origin servers.");
+static MetricCounter& newConnections = metrics.addCounter(
+    "proxy_upstream_connections_total", "Connections used to reach origin servers.", "reused=\"false\"");
+static MetricCounter& reusedConnections = metrics.addCounter(
+    "proxy_upstream_connections_total", "Connections used to reach origin servers.", "reused=\"true\"");
+static MetricCounter& staleResponses = metrics.addCounter(
+    "proxy_stale_responses_total", "Expired cached responses served while revalidating or in place of an error.");
+static MetricCounter& originLimitRejections = metrics.addCounter(
+    "proxy_origin_limit_rejections_total", "Requests turned away because too many were in flight to their origin.");
+
+//builds a blocklist from its file, throwing if the file can't be read
+static StrikeSet *loadBlockedDomains() {
+    unique_ptr<StrikeSet> blocked(new StrikeSet);
+    blocked->addFrom(kBlockedDomainsFile);
+    return blocked.release();
+}
 
-HTTPRequestHandler::HTTPRequestHandler(): mutexes(mnum) {
+HTTPRequestHandler::HTTPRequestHandler(): strikeSet(loadBlockedDomains()), cacheLocks(kNumCacheLockStripes),
+  origins(kDefaultMaxRequestsPerOrigin), connectTimeout(kDefaultConnectTimeout), readTimeout(kDefaultIOTimeout), writeTimeout(kDefaultIOTimeout),
+  revalidations(kNumRevalidators) {
   handlers["GET"] = &HTTPRequestHandler::handleRequest;
   handlers["POST"] = &HTTPRequestHandler::handleRequest;
   handlers["HEAD"] = &HTTPRequestHandler::handleRequest;
   handlers["CONNECT"] = &HTTPRequestHandler::handleConnectRequest;
-  strikeSet.addFrom("blocked-domains.txt");
+}
+
+void HTTPRequestHandler::reloadBlockedDomains() {
+    //build the replacement off to the side, so a bad file leaves the current list in place
+    try {
+        strikeSet.publish(loadBlockedDomains());
+    } catch (const exception& e) {
+        LOG(Error) << "Failed to reload blocked domains, keeping the current list: " << e.what();
+        return;
+    }
+    LOG(Info) << "Reloaded blocked domains from " << kBlockedDomainsFile << ".";
 }
 
 bool HTTPRequestHandler::containsLoop(HTTPRequest& request) {
@@ -42,37 +92,79 @@ bool HTTPRequestHandler::containsLoop(HTTPRequest& request) {
     return false;
 }
 
-void HTTPRequestHandler::serviceRequest(const pair<int, string>& connection) noexcept {
-    sockbuf sb(connection.first);
+bool HTTPRequestHandler::serviceRequest(const pair<int, string>& connection, const string& bufferedRequest,
+                                        bool clientHungUp) noexcept {
+    //the reactor hands the client over blocking, so without a deadline a client that stops
+    //reading its response would hold this worker in a send for as long as it cared to
+    setSocketTimeouts(connection.first, readTimeout, writeTimeout);
+
+    //the sockbuf closes its descriptor, but a persistent connection outlives this request
+    sockbuf sb(dup(connection.first));
     iosockstream ss(&sb);
     
     try {
+        //the reactor has already read the complete request off the socket
+        steady_clock::time_point start = steady_clock::now();
         HTTPRequest request;
-        request.ingestRequestLine(ss);
-        request.ingestHeader(ss, connection.second);
-        request.ingestPayload(ss);
+        request.ingestRequest(bufferedRequest, connection.second);
+        parseTimes.record(duration_cast<microseconds>(steady_clock::now() - start));
+
+        //a client that has shut down its side can't send another request, so its
+        //connection is closed once this one is answered (see addHeaders for the origin's)
+        if (clientHungUp) request.addHeader("connection", "close");
+
+        //a request without a server is addressed to the proxy itself
+        if (request.getServer().empty() && request.getPath() == kMetricsPath)
+            return handleMetricsRequest(request, ss);
 
         //check if the server is blocked
-        if (strikeSet.contains(request.getServer())) {
+        if (RCUPointer<StrikeSet>::Reader(strikeSet)->contains(request.getServer())) {
             handleError(ss, kDefaultProtocol, HTTPStatus::Forbidden, "Forbidden Content");
-            return;
+            return false;
         }
         
         //check if there is a proxy loop
         if (containsLoop(request)) {
             handleError(ss, kDefaultProtocol, HTTPStatus::BadRequest, "Loop Detected");
-            return;
+            return false;
         }
     
         auto found = handlers.find(request.getMethod());
         if (found == handlers.cend())
             throw UnsupportedMethodExeption(request.getMethod());
-        (this->*(found->second))(request, ss);
+        return (this->*(found->second))(request, ss);
     } catch (const HTTPBadRequestException &bre) {
         handleBadRequestError(ss, bre.what());
     } catch (const UnsupportedMethodExeption& ume) {
         handleUnsupportedMethodError(ss, ume.what());
     } catch (...) {}
+    return false;
+}
+
+//writes an entire response to the client, header and payload together, without a trip through the stream
+static bool sendResponse(iosockstream& ss, const HTTPResponse& response) {
+    string header = response.getHeaderString();
+    header += "\r\n";
+    const vector<char>& payload = response.getPayload().getData();
+    struct iovec iov[] = {{header.data(), header.size()}, {const_cast<char *>(payload.data()), payload.size()}};
+    ss.flush(); //whatever the stream already holds has to go out first
+    return sendFully(ss.rdbuf()->sd(), iov, 2);
+}
+
+//writes an entire request to an origin server, header and payload together
+static bool sendRequest(int fd, const HTTPRequest& request) {
+    string header = request.getHeaderString();
+    header += "\r\n";
+    const vector<char>& payload = request.getPayload().getData();
+    struct iovec iov[] = {{header.data(), header.size()}, {const_cast<char *>(payload.data()), payload.size()}};
+    return sendFully(fd, iov, 2);
+}
+
+//tells the client whether its connection stays open once the response is sent
+static bool setConnectionHeader(HTTPResponse& response, bool keepAlive) {
+    keepAlive = keepAlive && response.hasSelfDelimitingPayload();
+    response.addHeader("connection", keepAlive ? "keep-alive" : "close");
+    return keepAlive;
 }
 
 void HTTPRequestHandler::addHeaders(HTTPRequest& request) {
@@ -87,140 +179,403 @@ void HTTPRequestHandler::addHeaders(HTTPRequest& request) {
     } else {
         request.addHeader(ff, request.getip());
     }
+
+    //connections to origin servers are pooled, whatever the client asked for its own
+    request.removeHeader("proxy-connection");
+    request.addHeader("connection", "keep-alive");
 }
 
 int HTTPRequestHandler::configClientSocket(const HTTPRequest& request) const {
-    cout << oslock << "Creating client socket" << endl << osunlock;
-    int client = createClientSocket(request.getServer(), request.getPort());
+    LOG(Debug) << "Creating client socket";
+    int client = createClientSocket(request.getServer(), request.getPort(), connectTimeout);
+    if (client == kClientSocketError)
+        throw HTTPRequestException("Failed to connect to " + request.getServer() + ".");
     return client;
 } 
 
-void HTTPRequestHandler::forwardRequest(HTTPRequest& request, HTTPResponse& response) const {
-    //create client socket
-    sockbuf sb(configClientSocket(request));
-    iosockstream ss(&sb);
+//time spent on each stage of fetching a response from an origin server
+struct UpstreamTimings {
+    ClientSocketTimings socket; //zero for reused connections
+    microseconds acquire{0};    //all it took to get a connection, reused or otherwise
+    microseconds send{0};
+    microseconds wait{0};       //for the response header
+    microseconds transfer{0};   //of the payload to the client
+};
+
+//reports where the time went when fetching from an origin server, in milliseconds,
+//and records it in the upstream metrics
+static void logUpstreamTimings(const string& server, bool reused, const UpstreamTimings& timings) {
+    if (reused) {
+        reusedConnections.add();
+    } else {
+        newConnections.add();
+        resolveTimes.record(timings.socket.resolve);
+        connectTimes.record(timings.socket.connect);
+    }
+    firstByteTimes.record(timings.wait);
+    transferTimes.record(timings.transfer);
+
+    auto ms = [](microseconds us) { return us.count() / 1000.0; };
+    LOG(Debug) << "Upstream timings for " << server << (reused ? " (reused connection)" : "")
+               << ": resolve " << ms(timings.socket.resolve) << ", connect " << ms(timings.socket.connect)
+               << ", acquire " << ms(timings.acquire) << ", send " << ms(timings.send)
+               << ", first byte " << ms(timings.wait) << ", transfer " << ms(timings.transfer);
+}
+
+bool HTTPRequestHandler::fetchResponse(const HTTPRequest& request, const ResponseHandler& handleResponse) {
+    //an idle connection can be closed by the origin just as we reuse it, so
+    //idempotent requests get one more try over a fresh connection
+    bool idempotent = request.getMethod() == "GET" || request.getMethod() == "HEAD";
+    while (true) {
+        bool reused;
+        UpstreamTimings timings;
+        steady_clock::time_point start = steady_clock::now();
+        int fd = upstream.acquire(request.getServer(), request.getPort(), reused, connectTimeout, &timings.socket);
+        if (fd == kClientSocketError)
+            throw HTTPRequestException("Failed to connect to " + request.getServer() + ".");
+        if (reused) {
+            LOG(Debug) << "Reusing idle connection to " << request.getServer();
+        }
+        if (!reused) setSocketTimeouts(fd, readTimeout, writeTimeout);
+
+        HTTPResponse response;
+        bool consumed;
+        {
+            //the sockbuf closes its descriptor, so give it a duplicate and keep fd for the pool
+            sockbuf sb(dup(fd));
+            iosockstream ss(&sb);
+            steady_clock::time_point connected = steady_clock::now();
+            bool delivered = sendRequest(fd, request);
+            steady_clock::time_point sent = steady_clock::now();
+
+            //ingest response header
+            if (delivered) response.ingestResponseHeader(ss);
+            if (!delivered || ss.fail()) {
+                //an origin that's merely slow to answer won't be any faster the second time
+                close(fd);
+                bool timedOut = readTimeout.count() > 0 && steady_clock::now() - sent >= readTimeout;
+                if (reused && idempotent && !timedOut) continue;
+                throw HTTPRequestException("No response from " + request.getServer() + ".");
+            }
+            steady_clock::time_point answered = steady_clock::now();
+
+            //nothing's been sent to the client until now, so it's too late to retry from here on
+            consumed = handleResponse(response, ss);
+            timings.acquire = duration_cast<microseconds>(connected - start);
+            timings.send = duration_cast<microseconds>(sent - connected);
+            timings.wait = duration_cast<microseconds>(answered - sent);
+            timings.transfer = duration_cast<microseconds>(steady_clock::now() - answered);
+        }
+
+        if (consumed && response.permitsConnectionReuse()) {
+            upstream.release(request.getServer(), request.getPort(), fd);
+        } else {
+            close(fd);
+        }
+        logUpstreamTimings(request.getServer(), reused, timings);
+        return consumed;
+    }
+}
+
+//true for the responses stale-if-error lets a stale cached response stand in for
+static bool isServerError(const HTTPResponse& response) {
+    HTTPStatus code = response.getResponseCode();
+    return code == HTTPStatus::InternalServerError || code == HTTPStatus::BadGateway ||
+        code == HTTPStatus::ServiceUnavailable || code == HTTPStatus::GatewayTimeout;
+}
+
+bool HTTPRequestHandler::forwardRequest(const HTTPRequest& originalRequest, iosockstream& client, bool keepAlive,
+                                        const StaleResponse *stale, bool *leading) {
+    //add request headers to a copy, leaving the request as the client sent it
+    HTTPRequest request = originalRequest;
+    addHeaders(request);
+    bool revalidating = stale != nullptr && cache.addValidators(*stale->cached, request);
+
+    bool reusable = false;
+    fetchResponse(request, [&](HTTPResponse& response, iosockstream& server) {
+        //the origin confirmed our copy is current, so the client gets that (and a 304 has no payload)
+        if (revalidating && response.getResponseCode() == HTTPStatus::NotModified) {
+            LOG(Info) << "Reading revalidated response from cache";
+            shared_ptr<const CachedResponse> refreshed = refreshCachedResponse(originalRequest, *stale, response);
+            landFlight(originalRequest, leading);
+            reusable = sendCachedResponse(client, *refreshed, stale->stored, keepAlive);
+            return true;
+        }
 
-    //add request header
+        //the error's payload is left unread, so the connection to the origin isn't reused
+        if (stale != nullptr && isServerError(response) && cache.mayServeOnError(*stale->cached)) {
+            LOG(Info) << "Reading stale response from cache in place of an error";
+            staleResponses.add();
+            landFlight(originalRequest, leading);
+            reusable = sendCachedResponse(client, *stale->cached, stale->stored, keepAlive);
+            return false;
+        }
+
+        bool relayed = relayResponse(originalRequest, response, server, client, keepAlive, leading);
+        reusable = relayed && keepAlive;
+        return relayed;
+    });
+    return reusable;
+}
+
+void HTTPRequestHandler::revalidate(const HTTPRequest& originalRequest, const StaleResponse& stale) {
+    HTTPRequest request = originalRequest;
     addHeaders(request);
-    ss << request << flush;
+    bool revalidating = cache.addValidators(*stale.cached, request);
+    fetchResponse(request, [&](HTTPResponse& response, iosockstream& server) {
+        if (revalidating && response.getResponseCode() == HTTPStatus::NotModified) {
+            refreshCachedResponse(originalRequest, stale, response);
+            return true;
+        }
 
-    //ingest response header
-    response.ingestResponseHeader(ss);
+        //there's no client waiting, so a response that can't be cached isn't worth reading
+        if (!cache.shouldCache(originalRequest, response)) return false;
+        return cachePayload(originalRequest, response, server, [](const char *, size_t) { return true; });
+    });
+}
 
-    //ingest response payload
-    if (request.getMethod() != "HEAD") response.ingestPayload(ss);
-}    
+shared_ptr<const CachedResponse> HTTPRequestHandler::refreshCachedResponse(const HTTPRequest& request,
+                                                                           const StaleResponse& stale,
+                                                                           const HTTPResponse& notModified) {
+    std::lock_guard<std::shared_mutex> lg(cacheLocks[cache.hashRequest(request) % cacheLocks.size()]);
+    return cache.refreshEntry(request, *stale.cached, stale.stored, notModified);
+}
 
-void HTTPRequestHandler::handleRequest(HTTPRequest& request, class iosockstream& ss) {
-    cout << oslock << "Handling " << request.getMethod() << " request" << endl << osunlock;
-    HTTPResponse response;
+//writes all of the supplied bytes to fd, returning false if that isn't possible
+static bool writeFully(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t count = write(fd, data, length);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        data += count;
+        length -= count;
+    }
+    return true;
+}
 
-    //acquire a mutex
-    size_t index = cache.hashRequest(request) % mutexes.size();
-    std::unique_lock<std::mutex> ul(mutexes[index]);
+bool HTTPRequestHandler::relayResponse(const HTTPRequest& request, HTTPResponse& response,
+                                       iosockstream& server, iosockstream& client, bool& keepAlive,
+                                       bool *leading) {
+    //keep-alive is negotiated separately on each hop
+    response.removeHeader("keep-alive");
+    keepAlive = setConnectionHeader(response, keepAlive);
+
+    //send the header right away, since the payload may take a while
+    LOG(Debug) << "Sending response to client";
+    if (!sendResponse(client, response)) return false;
+    if (request.getMethod() == "HEAD") return true;
+
+    int clientfd = client.rdbuf()->sd();
+    return cachePayload(request, response, server, [clientfd](const char *data, size_t length) {
+        struct iovec iov = {const_cast<char *>(data), length};
+        return sendFully(clientfd, &iov, 1);
+    }, leading);
+}
 
-    //read from cache if possible
-    if (cache.containsCacheEntry(request, response)) {
-        cout << oslock << "Reading from cache" << endl << osunlock;
+bool HTTPRequestHandler::cachePayload(const HTTPRequest& request, const HTTPResponse& response,
+                                      iosockstream& server, const HTTPPayload::Sink& forward, bool *leading) {
+    //cacheable payloads are spooled to disk as they go by, so memory use doesn't grow with their size
+    int spoolfd = cache.shouldCache(request, response) ? cache.createSpoolFile() : -1;
+
+    //a response that won't land in the cache is nothing to wait on, so those waiting
+    //go fetch it themselves now rather than once the whole payload has been relayed
+    if (spoolfd == -1) landFlight(request, leading);
+    size_t spooled = 0;
+    bool streamed = response.streamPayload(server, [&](const char *data, size_t length) {
+        if (spoolfd != -1 && !writeFully(spoolfd, data, length)) {
+            close(spoolfd);
+            spoolfd = -1;
+        }
+        spooled += length;
+        return forward(data, length);
+    });
+    if (spoolfd == -1) return streamed;
+
+    //add to cache if the entire payload made it
+    if (streamed) {
+        size_t index = cache.hashRequest(request) % cacheLocks.size();
+        std::lock_guard<std::shared_mutex> lg(cacheLocks[index]);
         try {
-            ss << response << flush;
-            return;
-        } catch(const HTTPResponseException& rpe) {
-            handleError(ss, kDefaultProtocol, HTTPStatus::GeneralProxyFailure, rpe.what());
-        }        
-    }  
-    ul.unlock();
+            cache.cacheEntry(request, response, spoolfd, spooled);
+        } catch (const HTTPProxyException& pe) {
+            LOG(Error) << "Failed to cache response: " << pe.what();
+        }
+    }
+    close(spoolfd);
+    return streamed;
+}
 
-    try {
-        //forward request if possible
-        forwardRequest(request, response);
-    } catch(const HTTPRequestException& rqe) {
-        handleError(ss, kDefaultProtocol, HTTPStatus::GeneralProxyFailure, rqe.what());
+void HTTPRequestHandler::landFlight(const HTTPRequest& request, bool *leading) {
+    if (leading == nullptr || !*leading) return;
+    coalescer.land(cache.hashRequest(request));
+    *leading = false;
+}
+
+bool HTTPRequestHandler::handleRequest(HTTPRequest& request, class iosockstream& ss) {
+    LOG(Info) << "Handling " << request.getMethod() << " request";
+    bool keepAlive = request.requestsPersistentConnection();
+
+    //read from cache if possible, otherwise either fetch the response or wait on whoever already is
+    size_t requestHash = cache.hashRequest(request);
+    bool leader = false;
+    bool serveStale = false;
+    StaleResponse stale;
+    for (bool waited = false; true; waited = true) {
+        shared_ptr<const CachedResponse> cached;
+        StoredPayload stored;
+        shared_ptr<RequestCoalescer::Flight> flight;
+        {
+            //hits on the same response proceed in parallel, and an expired entry is only removed
+            //(by whoever finds it not worth keeping) while nobody can be adding its replacement
+            std::shared_lock<std::shared_mutex> sl(cacheLocks[requestHash % cacheLocks.size()]);
+            if (!cache.containsCacheEntry(request, cached, stored)) {
+                //an expired response may still be of use, whether or not it's served right away
+                stale = {cached, stored};
+                cached = nullptr;
+                serveStale = stale.cached && cache.mayServeWhileRevalidating(*stale.cached);
+                if (serveStale) break;
+                //an uncacheable response won't land in the cache, so don't wait on one twice
+                if (waited || !cache.mayCache(request)) break;
+                leader = coalescer.join(requestHash, flight);
+                if (leader) break;
+            }
+        }
+
+        if (cached) {
+            LOG(Info) << "Reading from cache";
+            return sendCachedResponse(ss, *cached, stored, keepAlive);
+        }
+        LOG(Info) << "Waiting on in-flight request for " << request.getURL();
+        coalescer.wait(flight, kMaxCoalescedWait);
+    }
+
+    //the client gets the stale response right away, and whoever finds it first has it revalidated
+    if (serveStale) {
+        shared_ptr<RequestCoalescer::Flight> flight;
+        if (coalescer.join(requestHash, flight)) scheduleRevalidation(request, stale);
+        LOG(Info) << "Reading stale response from cache while it's revalidated";
+        staleResponses.add();
+        return sendCachedResponse(ss, *stale.cached, stale.stored, keepAlive);
     }
 
-    //add to cache if possible
-    ul.lock();
-    if (cache.shouldCache(request, response)) cache.cacheEntry(request, response);
-    ul.unlock();
+    //an origin that already has its share of the workers waiting on it gets no more,
+    //so one slow server can't stall requests bound for every other
+    if (!origins.tryAcquire(request.getServer())) {
+        if (leader) coalescer.land(requestHash);
+        originLimitRejections.add();
+        if (stale.cached && cache.mayServeOnError(*stale.cached)) {
+            staleResponses.add();
+            return sendCachedResponse(ss, *stale.cached, stale.stored, keepAlive);
+        }
+        handleServiceUnavailableError(ss, "Too many requests in flight to " + request.getServer() + ".");
+        return false;
+    }
+    ConcurrencyLimiter::Permit permit(origins, request.getServer());
 
-    //send response
-    cout << oslock << "Sending response to client" << endl << osunlock;
     try {
-        ss << response << flush;
-    } catch (const HTTPResponseException& rpe) {
-        handleError(ss, kDefaultProtocol, HTTPStatus::GeneralProxyFailure, rpe.what());
+        //forward request, relaying the response to the client as it arrives
+        keepAlive = forwardRequest(request, ss, keepAlive, stale.cached ? &stale : nullptr, &leader);
+    } catch (const HTTPRequestException& rqe) {
+        if (stale.cached && cache.mayServeOnError(*stale.cached)) {
+            LOG(Info) << "Reading stale response from cache in place of an error";
+            staleResponses.add();
+            keepAlive = sendCachedResponse(ss, *stale.cached, stale.stored, keepAlive);
+        } else {
+            handleError(ss, kDefaultProtocol, HTTPStatus::GeneralProxyFailure, rqe.what());
+            keepAlive = false;
+        }
+    } catch (...) {
+        if (leader) coalescer.land(requestHash);
+        throw;
     }
+
+    //anyone waiting either finds the response in the cache or fetches it themselves
+    if (leader) coalescer.land(requestHash);
+    return keepAlive;
 }
 
-void HTTPRequestHandler::handleConnectRequest(HTTPRequest& request, class iosockstream& cs) {
-    cout << oslock << "Handling CONNECT request" << endl << osunlock;
-    try {
-        //create client socket
-        sockbuf sb(configClientSocket(request));
-        iosockstream ss(&sb);
-        handleError(cs, kDefaultProtocol, HTTPStatus::OK, "OK");
-        manageClientServerBridge(cs, ss);
-    } catch (const HTTPProxyException& pe) {
-        handleError(cs, kDefaultProtocol, HTTPStatus::GeneralProxyFailure, pe.what());
+void HTTPRequestHandler::scheduleRevalidation(const HTTPRequest& request, const StaleResponse& stale) {
+    size_t requestHash = cache.hashRequest(request);
+    revalidations.schedule([this, request, stale, requestHash] {
+        //revalidating is never urgent, so it waits for a time when the origin isn't at its limit
+        if (origins.tryAcquire(request.getServer())) {
+            ConcurrencyLimiter::Permit permit(origins, request.getServer());
+            try {
+                revalidate(request, stale);
+            } catch (const exception& e) {
+                LOG(Warning) << "Failed to revalidate " << request.getURL() << ": " << e.what();
+            }
+        }
+        coalescer.land(requestHash);
+    });
+}
+
+bool HTTPRequestHandler::sendCachedResponse(iosockstream& ss, const CachedResponse& cached,
+                                            const StoredPayload& stored, bool keepAlive) const {
+    //cached responses are already serialized, save for the per-client Connection header
+    static const string kKeepAliveEnding = "connection: keep-alive\r\n\r\n";
+    static const string kCloseEnding = "connection: close\r\n\r\n";
+    keepAlive = keepAlive && cached.selfDelimiting;
+    const string& ending = keepAlive ? kKeepAliveEnding : kCloseEnding;
+    struct iovec iov[] = {
+        {const_cast<char *>(cached.header.data()), cached.header.size()},
+        {const_cast<char *>(ending.data()), ending.size()},
+        {const_cast<char *>(cached.payload.data()), cached.payload.size()},
+    };
+    ss.flush();
+    if (!sendFully(ss.rdbuf()->sd(), iov, 3)) return false;
+
+    //payloads left on disk go from the cache file to the socket without a trip through user space
+    off_t offset = stored.offset;
+    size_t remaining = stored.length;
+    while (stored.fd != -1 && remaining > 0) {
+        ssize_t count = sendfile(ss.rdbuf()->sd(), stored.fd, &offset, remaining);
+        if (count == -1 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        remaining -= count;
     }
+    return keepAlive;
 }
 
-const size_t kTimeout = 5;
-const size_t kBridgeBufferSize = 1 << 16;
-void HTTPRequestHandler::manageClientServerBridge(iosockstream& client, iosockstream& server) {
-  // get embedded descriptors leading to client and origin server
-  int clientfd = client.rdbuf()->sd();
-  int serverfd = server.rdbuf()->sd();
-
-  // monitor both descriptors for any activity
-  ProxyWatchset watchset(kTimeout);
-  watchset.add(clientfd);
-  watchset.add(serverfd);
-
-  // map each descriptor to its surrounding iosockstream and the one
-  // surrounding the descriptor on the other side of the bridge we're building
-  map<int, pair<iosockstream *, iosockstream *>> streams;
-  streams[clientfd] = make_pair(&client, &server);
-  streams[serverfd] = make_pair(&server, &client);
-  cout << oslock << buildTunnelString(client, server) << "Establishing HTTPS tunnel" << endl << osunlock;
-
-  while (!streams.empty()) {
-    int fd = watchset.wait();
-    if (fd == -1) break; // return value of -1 means we timed out
-    iosockstream& from = *streams[fd].first;
-    iosockstream& to = *streams[fd].second;
-    char buffer[kBridgeBufferSize];
-    from.read(buffer, 1); // attempt to read one byte to see if we have one
-    if (from.eof() || from.fail() || from.gcount() == 0) {
-       // in here? that's because the watchset detected EOF instead of an unread byte
-       watchset.remove(fd);
-       streams.erase(fd);
-       continue;
+bool HTTPRequestHandler::handleConnectRequest(HTTPRequest& request, class iosockstream& cs) {
+    LOG(Info) << "Handling CONNECT request";
+    int serverfd;
+    try {
+        serverfd = configClientSocket(request);
+    } catch (const HTTPProxyException& pe) {
+        handleError(cs, kDefaultProtocol, HTTPStatus::GeneralProxyFailure, pe.what());
+        return false;
     }
-    to.write(buffer, 1);
 
-    while (true) {
-        //read bytes
-        size_t nBytesRead = from.readsome(buffer, sizeof(buffer));
-        if (from.eof() || from.fail()) {
-            watchset.remove(fd);
-            streams.erase(fd);
-            break;
-        };
-        //quit if no bytes read
-        if (nBytesRead == 0) break;
-        cout << oslock << nBytesRead << " bytes read" << endl << osunlock;
-
-        //write the bytes read
-        to.write(buffer, nBytesRead);
+    //the response has no payload, since everything that follows it belongs to the tunnel
+    HTTPResponse response;
+    response.setProtocol(kDefaultProtocol);
+    response.setResponseCode(HTTPStatus::OK);
+    bool established = sendResponse(cs, response);
+
+    //the client may not have waited for the response before starting in on the tunnel
+    const string& earlyData = request.getEarlyData();
+    struct iovec iov = {const_cast<char *>(earlyData.data()), earlyData.size()};
+    if (established && !earlyData.empty()) established = sendFully(serverfd, &iov, 1);
+
+    //the client's reactor closes its descriptor once we return, so the tunnel gets a duplicate
+    int clientfd = established ? dup(cs.rdbuf()->sd()) : -1;
+    if (clientfd == -1) {
+        close(serverfd);
+        return false;
     }
-    to.flush();
-  }
-  cout << oslock << buildTunnelString(client, server) << "Tearing down HTTPS tunnel" << endl << osunlock;
+    tunnels.add(clientfd, serverfd);
+    return false;
 }
 
-string HTTPRequestHandler::buildTunnelString(iosockstream& from, iosockstream& to) const {
-  return "[" + to_string(from.rdbuf()->sd()) + " --> " + to_string(to.rdbuf()->sd()) + "]: ";
+bool HTTPRequestHandler::handleMetricsRequest(HTTPRequest& request, class iosockstream& ss) const {
+    HTTPResponse response;
+    response.setProtocol(kDefaultProtocol);
+    response.setResponseCode(HTTPStatus::OK);
+    response.addHeader("content-type", "text/plain; version=0.0.4");
+    response.setPayload(metrics.render());
+    bool keepAlive = setConnectionHeader(response, request.requestsPersistentConnection());
+    return sendResponse(ss, response) && keepAlive;
 }
 
 /**
@@ -237,6 +592,23 @@ void HTTPRequestHandler::handleUnsupportedMethodError(iosockstream& ss, const st
   handleError(ss, kDefaultProtocol, HTTPStatus::MethodNotAllowed, message);
 }
 
+/**
+ * Responds to the client with code 503 and the supplied message, and
+ * suggests it try again shortly.
+ */
+static HTTPResponse makeServiceUnavailableResponse(const string& message) {
+  HTTPResponse response;
+  response.setProtocol(kDefaultProtocol);
+  response.setResponseCode(HTTPStatus::ServiceUnavailable);
+  response.addHeader("retry-after", to_string(kRetryAfter.count()));
+  response.setPayload(message);
+  return response;
+}
+
+void HTTPRequestHandler::handleServiceUnavailableError(iosockstream& ss, const string& message) const {
+  sendResponse(ss, makeServiceUnavailableResponse(message));
+}
+
 /**
  * Generic error handler used when our proxy server
  * needs to invent a response because of some error.
@@ -247,7 +619,7 @@ void HTTPRequestHandler::handleError(iosockstream& ss, const string& protocol,
   response.setProtocol(protocol);
   response.setResponseCode(responseCode);
   response.setPayload(message);
-  ss << response << flush;
+  sendResponse(ss, response);
 }
 
 // the following two methods needs to be completed 
@@ -258,3 +630,23 @@ void HTTPRequestHandler::clearCache() {
 void HTTPRequestHandler::setCacheMaxAge(long maxAge) {
     cache.setMaxAge(maxAge);
 }
+void HTTPRequestHandler::setCacheBudgets(size_t memoryBudget, uint64_t diskBudget) {
+    cache.setBudgets(memoryBudget, diskBudget);
+}
+void HTTPRequestHandler::setMaxRequestsPerOrigin(size_t maxPerOrigin) {
+    origins.setLimit(maxPerOrigin);
+}
+void HTTPRequestHandler::rejectRequest(int clientfd) const noexcept {
+    //this runs on a reactor thread, so the response is sent only if it fits in the socket buffer
+    //right away (which it all but always does), and the connection is closed either way
+    try {
+        static const string kMessage = "The proxy is too busy to service this request.";
+        string response = makeServiceUnavailableResponse(kMessage).getHeaderString() + "\r\n" + kMessage;
+        send(clientfd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    } catch (...) {}
+}
+void HTTPRequestHandler::setUpstreamTimeouts(milliseconds connect, milliseconds read, milliseconds write) {
+    connectTimeout = connect;
+    readTimeout = read;
+    writeTimeout = write;
+}
@@ -12,25 +12,74 @@
 #include <string>
 #include <map>
 #include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <memory>
+#include <functional>
 #include "request.h"
 #include "response.h"
 #include "strike-set.h"
 #include "cache.h"
+#include "upstream-pool.h"
+#include "request-coalescer.h"
+#include "rcu-pointer.h"
+#include "concurrency-limiter.h"
+#include "tunnel-reactor.h"
+#include "work-stealing-pool.h"
 
 class HTTPRequestHandler {
  public:
     HTTPRequestHandler();
-    void serviceRequest(const std::pair<int, std::string>& connection) noexcept;
+    bool serviceRequest(const std::pair<int, std::string>& connection, const std::string& bufferedRequest,
+                        bool clientHungUp) noexcept;
     void clearCache();
     void setCacheMaxAge(long maxAge);
+    void setCacheBudgets(size_t memoryBudget, uint64_t diskBudget);
+
+    //bounds the time spent connecting to origin servers, and on any single read from or write to them
+    //(the read and write timeouts bound those on client connections, too)
+    void setUpstreamTimeouts(std::chrono::milliseconds connect, std::chrono::milliseconds read,
+                             std::chrono::milliseconds write);
+
+    //rebuilds the blocklist from its file and swaps it in without disturbing requests in flight
+    void reloadBlockedDomains();
+
+    //bounds how many requests may be fetching from any one origin server at once (0 means no bound)
+    void setMaxRequestsPerOrigin(size_t maxPerOrigin);
+    static const size_t kDefaultMaxRequestsPerOrigin = 32;
+
+    //tells the client the proxy is too busy to service its request, without ever blocking
+    void rejectRequest(int clientfd) const noexcept;
     
  private:
+    //an expired cached response, kept in case the origin confirms it's current or can't be reached
+    struct StaleResponse {
+        std::shared_ptr<const CachedResponse> cached;
+        StoredPayload stored;
+    };
+
+    //handles the response to a request sent upstream, whose header has been ingested from server,
+    //returns true if the entire response was read, so the connection can be reused
+    typedef std::function<bool(HTTPResponse& response, class iosockstream& server)> ResponseHandler;
+
+    static const size_t kNumRevalidators = 2;
+
     HTTPCache cache;
-    StrikeSet strikeSet;
-    mutable std::vector<std::mutex> mutexes;
+    RCUPointer<StrikeSet> strikeSet;
+    //guards the cache entries for the requests hashing to each stripe: lookups share
+    //their stripe, and only adding, refreshing, or removing an entry takes it exclusively
+    mutable std::vector<std::shared_mutex> cacheLocks;
+    mutable UpstreamPool upstream;
+    RequestCoalescer coalescer;
+    ConcurrencyLimiter origins;
+    TunnelReactor tunnels;
+    std::chrono::milliseconds connectTimeout;
+    std::chrono::milliseconds readTimeout;
+    std::chrono::milliseconds writeTimeout;
     
-    typedef void (HTTPRequestHandler::*handlerMethod)(HTTPRequest& request, class iosockstream& ss);
+    typedef bool (HTTPRequestHandler::*handlerMethod)(HTTPRequest& request, class iosockstream& ss);
     std::map<std::string, handlerMethod> handlers;
+    WorkStealingPool revalidations; //last, so it's stopped before anything its tasks use goes away
 
     //check if there is a proxy loop
     static bool containsLoop(HTTPRequest& request);
@@ -38,22 +87,60 @@ class HTTPRequestHandler {
     //add headers
     static void addHeaders(HTTPRequest& request);
 
-    //create client socket
+    //create client socket, throwing if the server can't be reached
     int configClientSocket(const HTTPRequest& request) const;
 
-    //forward request and get response
-    void forwardRequest(HTTPRequest& request, HTTPResponse& response) const;
+    //send a request to its origin server over a pooled connection and pass the response to handleResponse,
+    //throwing if no response arrives, returns whatever handleResponse does
+    bool fetchResponse(const HTTPRequest& request, const ResponseHandler& handleResponse);
+
+    //forward request and relay the response to the client as it arrives, or if a stale cached response
+    //is supplied, revalidate it and send it instead if possible, returns true if the client connection can be reused;
+    //if *leading, the request's flight is landed (and *leading cleared) as soon as there's no point in waiting on it
+    bool forwardRequest(const HTTPRequest& request, class iosockstream& client, bool keepAlive,
+                        const StaleResponse *stale = nullptr, bool *leading = nullptr);
+
+    //relay a response whose header has been ingested from server to client, caching it if possible,
+    //returns true if the entire response was relayed
+    bool relayResponse(const HTTPRequest& request, HTTPResponse& response,
+                       class iosockstream& server, class iosockstream& client, bool& keepAlive,
+                       bool *leading = nullptr);
+
+    //stream the payload of a response whose header has been ingested from server to forward,
+    //caching the response along the way if possible, returns true if the entire payload was streamed;
+    //a flight being led is landed before the payload is streamed if the response won't be cached
+    bool cachePayload(const HTTPRequest& request, const HTTPResponse& response,
+                      class iosockstream& server, const HTTPPayload::Sink& forward, bool *leading = nullptr);
+
+    //land the request's flight in the coalescer, if it's being led and hasn't landed yet
+    void landFlight(const HTTPRequest& request, bool *leading);
+
+    //ask the origin whether a stale cached response is current, in the background, and cache
+    //whatever it says, landing the request's flight in the coalescer once done
+    void scheduleRevalidation(const HTTPRequest& request, const StaleResponse& stale);
+    void revalidate(const HTTPRequest& request, const StaleResponse& stale);
+
+    //extend the life of a stale cached response the origin confirmed with notModified
+    std::shared_ptr<const CachedResponse> refreshCachedResponse(const HTTPRequest& request, const StaleResponse& stale,
+                                                                const HTTPResponse& notModified);
+
+    //send a response from the cache, returns true if the client connection can be reused
+    bool sendCachedResponse(class iosockstream& ss, const CachedResponse& cached,
+                            const StoredPayload& stored, bool keepAlive) const;
+
+    //handles all but CONNECT request, returns true if the client connection can be reused
+    bool handleRequest(HTTPRequest& request, class iosockstream& ss);
+
+    //handles CONNECT request, which always consumes the client connection,
+    //handing it (and the connection to the server) to the tunnel reactor
+    bool handleConnectRequest(HTTPRequest& request, class iosockstream& ss);
 
-    //handles all but CONNECT request
-    void handleRequest(HTTPRequest& request, class iosockstream& ss);
+    //answers a request made of the proxy itself for its metrics, returns true if the client connection can be reused
+    bool handleMetricsRequest(HTTPRequest& request, class iosockstream& ss) const;
 
-    //handles CONNECT request
-    void handleConnectRequest(HTTPRequest& request, class iosockstream& ss);
-     
-    void manageClientServerBridge(iosockstream& client, iosockstream& server);
-    std::string buildTunnelString(iosockstream& from, iosockstream& to) const;
     void handleBadRequestError(class iosockstream& ss, const std::string& message) const;
     void handleUnsupportedMethodError(class iosockstream& ss, const std::string& message) const;
+    void handleServiceUnavailableError(class iosockstream& ss, const std::string& message) const;
     void handleError(class iosockstream& ss, const std::string& protocol,
                    HTTPStatus responseCode, const std::string& message) const;    
 };
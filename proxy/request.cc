@@ -6,54 +6,94 @@
  */
 
 #include <sstream>
+#include <charconv>
 #include "request.h"
 #include "string-utils.h"
+#include "fnv-hash.h"
 using namespace std;
 
-static const string kWhiteSpaceDelimiters = " \r\n\t";
-static const string kProtocolPrefix = "http://";
+static const string_view kProtocolPrefix = "http://";
 static const unsigned short kDefaultPort = 80;
-void HTTPRequest::ingestRequestLine(istream& instream) {
-  getline(instream, requestLine);
-  if (instream.fail()) {
+void HTTPRequest::ingestRequest(string_view buffer, const string& clientIPAddress) {
+  string_view parts[3];
+  size_t lineLength;
+  if (parseStartLine(buffer, parts, lineLength) != HTTPParseResult::Complete) {
     throw HTTPBadRequestException("First line of request could not be read.");
   }
+  method = parts[0];
+  url = parts[1];
+  protocol = parts[2];
 
-  requestLine = trim(requestLine);
-  istringstream iss(requestLine);
-  iss >> method >> url >> protocol;
-  server = url;
-  size_t pos = server.find(kProtocolPrefix);
-  if (pos == 0) server.erase(0, kProtocolPrefix.size());
-  pos = server.find('/');
-  if (pos == string::npos) {
+  string_view server = url;
+  if (server.substr(0, kProtocolPrefix.size()) == kProtocolPrefix) server.remove_prefix(kProtocolPrefix.size());
+  size_t pos = server.find('/');
+  if (pos == string_view::npos) {
     // url came in as something like http://www.google.com, without the trailing /
     // in that case, least server as is (it'd be www.google.com), and manually set
     // path to be "/"
     path = "/";
   } else {
     path = server.substr(pos);
-    server.erase(pos);
+    server.remove_suffix(server.size() - pos);
   }
   port = kDefaultPort;
   pos = server.find(':');
-  if (pos == string::npos) return;
-  port = strtol(server.c_str() + pos + 1, NULL, 0);
-  server.erase(pos);
-}
+  if (pos != string_view::npos) {
+    string_view digits = server.substr(pos + 1);
+    from_chars(digits.data(), digits.data() + digits.size(), port);
+    server.remove_suffix(server.size() - pos);
+  }
+  this->server = server;
+  cacheKeyComputed = false;
 
-void HTTPRequest::ingestHeader(istream& instream, const string& clientIPAddress) {
-  requestHeader.ingestHeader(instream);
+  HTTPHeaderTable fields;
+  size_t headerLength;
+  HTTPParseResult result = parseHeader(buffer.substr(lineLength), fields, headerLength);
+  if (result == HTTPParseResult::Invalid) throw HTTPBadRequestException("Request header has too many fields.");
+  if (result == HTTPParseResult::Incomplete) throw HTTPBadRequestException("Request header is incomplete.");
+  requestHeader.ingestHeader(fields);
   ip = clientIPAddress;
+
+  if (method == "CONNECT") earlyData = buffer.substr(lineLength + headerLength);
+  if (method != "POST") return;
+  istringstream iss(string(buffer.substr(lineLength + headerLength)));
+  payload.ingestPayload(requestHeader, iss);
+}
+
+size_t HTTPRequest::getCacheKey() const {
+  if (cacheKeyComputed) return cacheKey;
+  FNVHash hash;
+  hash.add(method);
+  hash.add(server, /* foldCase = */ true);
+  hash.add(uint64_t(port));
+  hash.add(path);
+  cacheKey = hash.value();
+  cacheKeyComputed = true;
+  return cacheKey;
 }
 
 bool HTTPRequest::containsName(const string& name) const {
   return requestHeader.containsName(name);
 }
 
-void HTTPRequest::ingestPayload(istream& instream) {
-  if (getMethod() != "POST") return;
-  payload.ingestPayload(requestHeader, instream);
+bool HTTPRequest::requestsPersistentConnection() const {
+  const char *name = requestHeader.containsName("connection") ? "connection" : "proxy-connection";
+  string connection = toLowerCase(requestHeader.getValueAsString(name));
+  if (connection.find("close") != string::npos) return false;
+  return protocol == "HTTP/1.1" || connection.find("keep-alive") != string::npos;
+}
+
+string HTTPRequest::getHeaderString() const {
+  string header;
+  header.reserve(method.size() + path.size() + protocol.size() + 4);
+  header += method;
+  header += ' ';
+  header += path;
+  header += ' ';
+  header += protocol;
+  header += "\r\n";
+  requestHeader.appendTo(header);
+  return header;
 }
 
 ostream& operator<<(ostream& os, const HTTPRequest& rh) {
@@ -13,6 +13,7 @@
 #include <vector>
 #include <map>
 #include <ostream>
+#include <string_view>
 
 #include "header.h"
 #include "payload.h"
@@ -30,9 +31,9 @@ class HTTPRequest {
  public:
 
 /**
- * Ingests, parses, and stores the first line of the HTTP request.
- * Recall that the first line of any valid proxied HTTP request is
- * structured as:
+ * Ingests, parses, and stores an entire HTTP request, which must be
+ * the whole of the supplied buffer.  Recall that the first line of any
+ * valid proxied HTTP request is structured as:
  *
  *   <method> <full-URL> <protocol-and-version>
  *
@@ -40,39 +41,27 @@ class HTTPRequest {
  *
  *   GET http://www.facebook.com/jerry HTTP/1.1
  *   POST http://graph.facebook.com/like?url=www.nytimes.com HTTP/1.1
- */
-  void ingestRequestLine(std::istream& instream);
-
-/**
- * Ingests everything beyond the first line up to the first
- * blank line (where all lines, including the visibly blank line,
- * end in either "\r\n" or just a "\n").  Recall that each
- * line is generally a name-value pair, so that the accumulation of
- * all header lines might look like this:
+ *
+ * Everything beyond the first line up to the first blank line (where
+ * all lines, including the visibly blank line, end in either "\r\n" or
+ * just a "\n") is the header, each line of which is generally a name-value
+ * pair:
  *
  *  <key-1>: <value-1>
  *  <key-2>: <value-2>
  *
- * The first ':' character separates the name from the value (except that the
- * "\r\n" or the "\n" at the end of each line is not considered to be part of
- * the value.  In fact, after the split around the ':', the name and value are
- * generally right and left-trimmed.
- *
- * One caveat: if a header line begins with a blank space, then it isn't introducing
- * a new name.  Instead, the line (after being right-trimmed) is providing a continuation 
+ * The first ':' character separates the name from the value, and both
+ * are trimmed.  One caveat: if a header line begins with a blank space, then
+ * it isn't introducing a new name.  Instead, the line is providing a continuation 
  * of the previous line's value.
+ *
+ * Everything after the blank line is the payload, which is only retained
+ * for POST requests, save that for CONNECT requests it's kept as early data
+ * (see getEarlyData).  The whole of the request line and header is parsed
+ * in a single pass over the buffer (see http-parser.h), and an
+ * HTTPBadRequestException is thrown if it's malformed or incomplete.
  */
-  void ingestHeader(std::istream& instream, const std::string& clientIPAddress);
-
-/**
- * Ingests everything after the blank line following the header.
- * As opposed to the header section, the payload isn't necessarily
- * pure text (it might be a photo with pixel bytes that look like
- * text, or newlines, or gobbledygook).  That means that the payload
- * portion isn't read in as C++ string text, but as general character
- * data.
- */
-  void ingestPayload(std::istream& instream);
+  void ingestRequest(std::string_view buffer, const std::string& clientIPAddress);
 
 /**
  * The next 8 methods are all const, inlined accessors.
@@ -87,6 +76,32 @@ class HTTPRequest {
   const std::string& getProtocol() const { return protocol; }
   const std::string& getip() const { return ip; } 
 
+/**
+ * Returns a key identifying the resource requested, for the cache's benefit:
+ * a hash of the method, the server (ignoring case), the port, and the path.
+ * None of the header contributes, so every client asking for the same thing
+ * gets the same key.  It's only computed once, however often it's asked for.
+ */
+  size_t getCacheKey() const;
+
+/**
+ * Returns the payload, which is empty for all but POST requests.
+ */
+  const HTTPPayload& getPayload() const { return payload; }
+
+/**
+ * Returns whatever the client sent after a CONNECT request's header without
+ * waiting for the tunnel to be established, which is owed to the origin server.
+ */
+  const std::string& getEarlyData() const { return earlyData; }
+
+/**
+ * Returns the request line (with the path in place of the full URL, as
+ * it's sent to origin servers) followed by all of the header lines, each
+ * terminated by "\r\n", but without the blank line that ends the header.
+ */
+  std::string getHeaderString() const;
+
 /**
  * Returns true if and only if the supplied, case-insensitive
  * name exists within the collection of (zero or more) name-value
@@ -94,13 +109,24 @@ class HTTPRequest {
  */
   bool containsName(const std::string& name) const;
 
+/**
+ * Returns true if and only if the client expects the connection
+ * to stay open after the response is sent: HTTP/1.1 connections persist
+ * unless the client says "Connection: close", and HTTP/1.0 connections
+ * only persist if the client asks for "Connection: keep-alive".
+ */
+  bool requestsPersistentConnection() const;
+
 //wrapper around addHeader function in header class
   void addHeader(const std::string& name, const std::string&value) { requestHeader.addHeader(name, value); }
 
+//wrapper around removeHeader function in header class
+  void removeHeader(const std::string& name) { requestHeader.removeHeader(name); }
+
  private:
-  std::string requestLine;
   HTTPHeader requestHeader;
   HTTPPayload payload;
+  std::string earlyData;
   
   std::string method;
   std::string url;
@@ -109,6 +135,8 @@ class HTTPRequest {
   std::string path;
   std::string protocol;
   std::string ip;
+  mutable size_t cacheKey = 0;
+  mutable bool cacheKeyComputed = false;
 };
 
 #endif
@@ -8,6 +8,8 @@
 
 #include <sstream>
 #include <cstring>
+#include <charconv>
+#include <string_view>
 #include "proxy-exception.h"
 #include "string-utils.h"
 using namespace std;
@@ -40,9 +42,11 @@ const map<HTTPStatus, std::string> HTTPResponse::kStatusMessages = {
     {HTTPStatus::RequestTimeout, "Request Timeout"},
     {HTTPStatus::Conflict, "Conflict"},
     {HTTPStatus::Gone, "Gone"},
+    {HTTPStatus::PayloadTooLarge, "Payload Too Large"},
     {HTTPStatus::InternalServerError, "Internal Server Error"},
     {HTTPStatus::NotImplemented, "Not Implemented"},
     {HTTPStatus::BadGateway, "Bad Gateway"},
+    {HTTPStatus::ServiceUnavailable, "Service Unavailable"},
     {HTTPStatus::GatewayTimeout, "Gateway Timeout"},
     {HTTPStatus::HTTPVersionNotSupported, "HTTP Version Not Supported"},
     {HTTPStatus::GeneralProxyFailure, "General Proxy Failure"},
@@ -51,12 +55,14 @@ const map<HTTPStatus, std::string> HTTPResponse::kStatusMessages = {
 void HTTPResponse::ingestResponseHeader(istream& instream) {
   string responseCodeLine;
   getline(instream, responseCodeLine);
-  istringstream iss(responseCodeLine);
-  string protocol;
-  iss >> protocol;
-  setProtocol(protocol);
-  int code;
-  iss >> code;
+  responseCodeLine += '\n';
+  string_view parts[3];
+  size_t length;
+  int code = 0;
+  if (parseStartLine(responseCodeLine, parts, length) == HTTPParseResult::Complete) {
+    from_chars(parts[1].data(), parts[1].data() + parts[1].size(), code);
+  }
+  setProtocol(string(parts[0]));
   setResponseCode(code);
   responseHeader.ingestHeader(instream);
 }
@@ -65,6 +71,12 @@ void HTTPResponse::ingestPayload(std::istream& instream) {
   payload.ingestPayload(responseHeader, instream);
 }
 
+bool HTTPResponse::streamPayload(std::istream& instream, const HTTPPayload::Sink& sink) const {
+  if (code < 200 || code == static_cast<int>(HTTPStatus::NoContent) ||
+      code == static_cast<int>(HTTPStatus::NotModified)) return true;
+  return HTTPPayload::streamPayload(responseHeader, instream, sink);
+}
+
 void HTTPResponse::setProtocol(const string& protocol) {
   this->protocol = protocol;
 }
@@ -88,6 +100,14 @@ void HTTPResponse::addHeader(const std::string& name, const std::string& value)
   responseHeader.addHeader(name, value);
 }
 
+void HTTPResponse::removeHeader(const std::string& name) {
+  responseHeader.removeHeader(name);
+}
+
+void HTTPResponse::updateHeader(const HTTPHeader& header, const vector<string_view>& excluded) {
+  responseHeader.update(header, excluded);
+}
+
 void HTTPResponse::setPayload(const string& payload) {
   this->payload.setPayload(responseHeader, payload);
 }
@@ -102,15 +122,61 @@ bool HTTPResponse::permitsCaching() const {
 }
 
 int HTTPResponse::getTTL() const {
+  return getCacheControlSeconds("max-age=");
+}
+
+int HTTPResponse::getStaleWhileRevalidate() const {
+  return getCacheControlSeconds("stale-while-revalidate=");
+}
+
+int HTTPResponse::getStaleIfError() const {
+  return getCacheControlSeconds("stale-if-error=");
+}
+
+/**
+ * Returns the number of seconds supplied to the named Cache-Control
+ * directive (which includes its trailing '='), or 0 if it isn't present.
+ */
+int HTTPResponse::getCacheControlSeconds(const string& directive) const {
   if (!responseHeader.containsName("Cache-Control")) return 0;
   const string& cacheControlValue = responseHeader.getValueAsString("Cache-Control");
-  size_t pos = cacheControlValue.find("max-age=");
+  size_t pos = cacheControlValue.find(directive);
   if (pos == string::npos) return 0;
-  string maxAgeValue = cacheControlValue.substr(pos + strlen("max-age="));
-  istringstream iss(maxAgeValue);
-  int maxAge;
-  iss >> maxAge;
-  return maxAge;
+  string value = cacheControlValue.substr(pos + directive.size());
+  istringstream iss(value);
+  int seconds = 0;
+  iss >> seconds;
+  return seconds;
+}
+
+bool HTTPResponse::permitsConnectionReuse() const {
+  string connection = toLowerCase(responseHeader.getValueAsString("Connection"));
+  if (connection.find("close") != string::npos) return false;
+  if (protocol != "HTTP/1.1" && connection.find("keep-alive") == string::npos) return false;
+  return hasSelfDelimitingPayload();
+}
+
+bool HTTPResponse::hasSelfDelimitingPayload() const {
+  if (code == static_cast<int>(HTTPStatus::NoContent) || code == static_cast<int>(HTTPStatus::NotModified)) return true;
+  return responseHeader.getValueAsString("Transfer-Encoding") == "chunked" ||
+    responseHeader.containsName("Content-Length");
+}
+
+string HTTPResponse::getHeaderString() const {
+  // all of the status line but the protocol depends only on the code, so it's rendered once per code
+  static const map<int, string> kStatusLineEndings = [] {
+    map<int, string> endings;
+    for (const pair<const HTTPStatus, string>& p: kStatusMessages) {
+      endings[static_cast<int>(p.first)] = " " + to_string(static_cast<int>(p.first)) + " " + p.second + "\r\n";
+    }
+    return endings;
+  }();
+
+  string header = protocol;
+  auto found = kStatusLineEndings.find(code);
+  header += found != kStatusLineEndings.end() ? found->second : " " + to_string(code) + " Unknown Code\r\n";
+  responseHeader.appendTo(header);
+  return header;
 }
 
 ostream& operator<<(ostream& os, const HTTPResponse& hr) {
@@ -46,9 +46,11 @@ enum class HTTPStatus {
   RequestTimeout = 408,
   Conflict = 409,
   Gone = 410,
+  PayloadTooLarge = 413,
   InternalServerError = 500,
   NotImplemented = 501,
   BadGateway = 502,
+  ServiceUnavailable = 503,
   GatewayTimeout = 504,
   HTTPVersionNotSupported = 505,
   GeneralProxyFailure = 510,
@@ -81,6 +83,15 @@ class HTTPResponse {
 
   void ingestPayload(std::istream& instream);
 
+  /**
+   * Streams the payload portion of the server's response to sink
+   * instead of ingesting it (see HTTPPayload::streamPayload), and
+   * returns true if and only if all of it was delivered.  Responses
+   * whose codes preclude a payload deliver nothing.
+   */
+
+  bool streamPayload(std::istream& instream, const HTTPPayload::Sink& sink) const;
+
   /**
    * Sets the protocol to be the one specified.  The
    * protocol should be "HTTP/1.0" or "HTTP/1.1".
@@ -116,6 +127,33 @@ class HTTPResponse {
    */
   void addHeader(const std::string& name, const std::string& value);
 
+  /**
+   * Removes the specified key from the response header.
+   */
+  void removeHeader(const std::string& name);
+
+  /**
+   * Updates the response header with the fields of the supplied
+   * one, save for those named in excluded (see HTTPHeader::update).
+   */
+  void updateHeader(const HTTPHeader& header, const std::vector<std::string_view>& excluded);
+
+  /**
+   * Returns a reference to the response header.
+   */
+  const HTTPHeader& getHeader() const { return responseHeader; }
+
+  /**
+   * Returns a reference to the response payload.
+   */
+  const HTTPPayload& getPayload() const { return payload; }
+
+  /**
+   * Returns the status line followed by all of the header lines, each
+   * terminated by "\r\n", but without the blank line that ends the header.
+   */
+  std::string getHeaderString() const;
+
   /**
    * Manually updates the payload to be the provided
    * string (and updates the response header to be
@@ -139,6 +177,32 @@ class HTTPResponse {
    */
 
   int getTTL() const;
+
+  /**
+   * Return the number of seconds past its time-to-live for which
+   * the response may still be served while it's revalidated in the
+   * background, or in place of an error from the server that sent
+   * it (per its stale-while-revalidate and stale-if-error directives).
+   */
+
+  int getStaleWhileRevalidate() const;
+  int getStaleIfError() const;
+
+  /**
+   * Returns true if and only if the end of the payload can be detected
+   * without the sender closing the connection (because it's chunked, its
+   * length was supplied, or the response code implies there isn't one).
+   */
+
+  bool hasSelfDelimitingPayload() const;
+
+  /**
+   * Returns true if and only if the server that sent this response
+   * is willing to keep the connection open for another request, and the
+   * response has a self-delimiting payload.
+   */
+
+  bool permitsConnectionReuse() const;
   
  private:
   int code;
@@ -148,6 +212,7 @@ class HTTPResponse {
   
   static const std::map<HTTPStatus, std::string> kStatusMessages;
   std::string getStatusMessage() const;
+  int getCacheControlSeconds(const std::string& directive) const;
 };
 
 #endif
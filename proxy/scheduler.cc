@@ -5,17 +5,165 @@
  */
 
 #include "scheduler.h"
+#include "metrics.h"
+#include "request.h"
+#include "http-parser.h"
+#include "dns-resolver.h"
 #include <utility>
+#include <thread>
 using namespace std;
+using namespace std::chrono;
 
-const int nt = 64;
+//once requests are waiting this long on average, a standing queue means we're overloaded
+static const milliseconds kTargetQueueDelay(500);
 
-HTTPProxyScheduler::HTTPProxyScheduler(): pool(nt) {}
+static const string kRejectedRequestsName = "proxy_requests_rejected_total";
+static const string kRejectedRequestsHelp = "Requests shed with a 503 before being queued, by the reason why.";
+static MetricCounter& queueFullRejections = MetricsRegistry::getInstance().addCounter(
+    kRejectedRequestsName, kRejectedRequestsHelp, "reason=\"queue_full\"");
+static MetricCounter& queueDelayRejections = MetricsRegistry::getInstance().addCounter(
+    kRejectedRequestsName, kRejectedRequestsHelp, "reason=\"queue_delay\"");
+static MetricCounter& clientLimitRejections = MetricsRegistry::getInstance().addCounter(
+    kRejectedRequestsName, kRejectedRequestsHelp, "reason=\"client_limit\"");
+static LatencyHistogram& requestTimes = MetricsRegistry::getInstance().addHistogram(
+    "proxy_request_seconds", "Time spent servicing requests, from a worker starting on one to its response being sent.");
+static LatencyHistogram& queueWaits = MetricsRegistry::getInstance().addHistogram(
+    "proxy_queue_wait_seconds", "Time requests spend queued before a worker starts on them.");
 
-void HTTPProxyScheduler::scheduleRequest(int clientfd, const string& clientIPAddr) {
-    pool.schedule([this, clientfd, clientIPAddr]() {
-                      requestHandler.serviceRequest(make_pair(clientfd, clientIPAddr));
-                  });
+//returns the name of the origin server a request is bound for, or the empty string if there isn't one
+//(or the request is malformed, which is for the request handler to report); only the header is ingested
+static string findOriginServer(const string& request) {
+    string_view parts[3];
+    HTTPHeaderTable fields;
+    size_t lineLength, headerLength;
+    if (parseStartLine(request, parts, lineLength) != HTTPParseResult::Complete ||
+        parseHeader(string_view(request).substr(lineLength), fields, headerLength) != HTTPParseResult::Complete) {
+        return "";
+    }
+    HTTPRequest parsed;
+    try {
+        parsed.ingestRequest(string_view(request).substr(0, lineLength + headerLength), "");
+    } catch (const HTTPBadRequestException& bre) {
+        return "";
+    }
+    return parsed.getServer();
+}
+
+HTTPProxyScheduler::HTTPProxyScheduler(): pool(new WorkStealingPool(kDefaultNumWorkers)),
+  clients(kDefaultMaxRequestsPerClient), maxQueued(kDefaultMaxQueuedRequests), queueDelay(0), numParked(0) {
+    size_t numReactors = max(thread::hardware_concurrency(), 1U);
+    for (size_t i = 0; i < numReactors; i++) {
+        reactors.push_back(make_unique<ProxyReactor>([this, i](int clientfd, const string& clientIPAddr, string&& request, bool hungUp) {
+                                                         dispatchRequest(i, clientfd, clientIPAddr, move(request), hungUp);
+                                                     }));
+    }
+    MetricsRegistry::getInstance().addGaugeFunction("proxy_queue_depth", "Requests queued for a worker.",
+                                                    [this] { return pool->getNumQueued(); });
+}
+
+HTTPProxyScheduler::~HTTPProxyScheduler() {
+    MetricsRegistry::getInstance().removeGaugeFunction("proxy_queue_depth");
+    //in-flight requests hand their connections back to a reactor, so
+    //the reactors have to outlive them
+    for (unique_ptr<ProxyReactor>& reactor: reactors) reactor->stop();
+    //requests waiting on a lookup are queued once it's done, so the pool has to outlive them, too
+    {
+        unique_lock<mutex> ul(parkedLock);
+        parkedCV.wait(ul, [this] { return numParked == 0; });
+    }
+    pool->wait();
+}
+
+void HTTPProxyScheduler::configureWorkers(size_t numWorkers, bool pinWorkers) {
+    pool.reset(new WorkStealingPool(numWorkers, pinWorkers));
+}
+
+void HTTPProxyScheduler::setAdmissionLimits(size_t maxPerClient, size_t maxPerOrigin, size_t maxQueued) {
+    clients.setLimit(maxPerClient);
+    requestHandler.setMaxRequestsPerOrigin(maxPerOrigin);
+    this->maxQueued = maxQueued;
+}
+
+void HTTPProxyScheduler::scheduleRequest(int clientfd, const string& clientIPAddr, size_t listener, size_t numListeners) {
+    //listener i takes turns among reactors i, i + numListeners, i + 2 * numListeners, and so on;
+    //each listener has an accept loop of its own, so the turn can be tracked per thread
+    static thread_local size_t turn = 0;
+    size_t numOwned = listener < reactors.size() ? (reactors.size() - listener - 1) / numListeners + 1 : 1;
+    size_t reactor = (listener + (turn++ % numOwned) * numListeners) % reactors.size();
+    reactors[reactor]->add(clientfd, clientIPAddr);
+}
+
+void HTTPProxyScheduler::dispatchRequest(size_t reactor, int clientfd, const string& clientIPAddr, string&& request,
+                                         bool hungUp) {
+    //turning a request away right now is far cheaper than making everyone behind it wait
+    if (!admitRequest(clientIPAddr)) {
+        requestHandler.rejectRequest(clientfd);
+        reactors[reactor]->resume(clientfd, false);
+        return;
+    }
+
+    //a worker handed a request for a host that's never been resolved would sit blocked on the
+    //lookup, so the request waits on it here instead, without a thread, its connection still
+    //parked with the reactor (which doesn't watch it until it's resumed), and is queued once it's done
+    string server = findOriginServer(request);
+    if (!server.empty()) {
+        shared_ptr<string> parked = make_shared<string>(move(request));
+        numParked++;
+        bool resolved = DNSResolver::getInstance().resolveAsync(server, [this, reactor, clientfd, clientIPAddr,
+                                                                          parked, hungUp] {
+            queueRequest(reactor, clientfd, clientIPAddr, move(*parked), hungUp);
+            lock_guard<mutex> lg(parkedLock);
+            numParked--;
+            parkedCV.notify_all();
+        });
+        if (!resolved) return;
+        numParked--; //nothing to wait on after all
+        request = move(*parked);
+    }
+    queueRequest(reactor, clientfd, clientIPAddr, move(request), hungUp);
+}
+
+void HTTPProxyScheduler::queueRequest(size_t reactor, int clientfd, const string& clientIPAddr, string&& request,
+                                      bool hungUp) {
+    //the request is moved into the task, which is small enough to be stored without allocating
+    steady_clock::time_point queued = steady_clock::now();
+    pool->schedule([this, reactor, clientfd, clientIPAddr, request = move(request), hungUp, queued]() {
+                       steady_clock::time_point started = steady_clock::now();
+                       recordQueueDelay(duration_cast<microseconds>(started - queued));
+                       bool keepAlive = requestHandler.serviceRequest(make_pair(clientfd, clientIPAddr), request, hungUp);
+                       requestTimes.record(duration_cast<microseconds>(steady_clock::now() - started));
+                       clients.release(clientIPAddr);
+                       reactors[reactor]->resume(clientfd, keepAlive);
+                   });
+}
+
+bool HTTPProxyScheduler::admitRequest(const string& clientIPAddr) {
+    size_t queued = pool->getNumQueued();
+    if (maxQueued > 0 && queued >= maxQueued) {
+        queueFullRejections.add();
+        return false;
+    }
+
+    //a queue that never drains below the target delay only adds latency to
+    //every request, so shed until it does (an empty queue always admits, which
+    //is how the delay estimate comes back down)
+    if (queued > 0 && microseconds(queueDelay) > kTargetQueueDelay) {
+        queueDelayRejections.add();
+        return false;
+    }
+    if (!clients.tryAcquire(clientIPAddr)) {
+        clientLimitRejections.add();
+        return false;
+    }
+    return true;
+}
+
+//folds delay into a moving average weighted 1/8 toward the latest sample, as TCP does for
+//round-trip times; concurrent updates may drop a sample, which the average shrugs off
+void HTTPProxyScheduler::recordQueueDelay(microseconds delay) {
+    queueWaits.record(delay);
+    int64_t smoothed = queueDelay;
+    queueDelay = smoothed + (delay.count() - smoothed) / 8;
 }
 
 void HTTPProxyScheduler::setProxy(const std::string& server, unsigned short port) {
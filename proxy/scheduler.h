@@ -3,28 +3,76 @@
  * -----------------
  * This class defines the HTTPProxyScheduler class, which eventually takes all
  * proxied requests off of the main thread and schedules them to 
- * be handled by a constant number of child threads.
+ * be handled by a constant number of child threads (see work-stealing-pool.h).  Connections are first
+ * parked with one of several ProxyReactors (one per core), and are only passed
+ * to the thread pool once a complete request has been read.
+ *
+ * Requests are shed with a 503 instead of being queued when the pool can't
+ * keep up: when too many are already waiting, when those waiting have been
+ * kept waiting too long, or when their client already has too many underway.
+ * Requests bound for an origin whose name has yet to be resolved aren't queued
+ * until it has been, so workers never sit idle waiting on DNS.
  */
 
 #ifndef _scheduler_
 #define _scheduler_
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
 #include "request-handler.h"
-#include "thread-pool-reference.h"
-
-using reference::ThreadPool;
+#include "reactor.h"
+#include "work-stealing-pool.h"
+#include "concurrency-limiter.h"
 
 class HTTPProxyScheduler {
  public:
   HTTPProxyScheduler();
+  ~HTTPProxyScheduler();
   void clearCache() { requestHandler.clearCache(); }
   void setCacheMaxAge(long maxAge) { requestHandler.setCacheMaxAge(maxAge); }
+  void setCacheBudgets(size_t memoryBudget, uint64_t diskBudget) { requestHandler.setCacheBudgets(memoryBudget, diskBudget); }
+  void reloadBlockedDomains() { requestHandler.reloadBlockedDomains(); }
+  void setUpstreamTimeouts(std::chrono::milliseconds connect, std::chrono::milliseconds read,
+                           std::chrono::milliseconds write) { requestHandler.setUpstreamTimeouts(connect, read, write); }
   void setProxy(const std::string& server, unsigned short port);
-  void scheduleRequest(int clientfd, const std::string& clientIPAddr);
+
+  //replaces the worker pool; only to be called before any requests are scheduled
+  void configureWorkers(size_t numWorkers, bool pinWorkers);
+  static const size_t kDefaultNumWorkers = 64;
+
+  //bounds the requests underway for any one client, to any one origin, and waiting for a worker (0 means no bound)
+  void setAdmissionLimits(size_t maxPerClient, size_t maxPerOrigin, size_t maxQueued);
+  static const size_t kDefaultMaxRequestsPerClient = 64;
+  static const size_t kDefaultMaxQueuedRequests = 1024;
+
+  //parks a freshly accepted, non-blocking connection with one of the reactors; connections
+  //accepted by each of numListeners listeners go to that listener's own share of the reactors
+  void scheduleRequest(int clientfd, const std::string& clientIPAddr, size_t listener = 0, size_t numListeners = 1);
   
  private:
   HTTPRequestHandler requestHandler;
-  ThreadPool pool;
+  std::unique_ptr<WorkStealingPool> pool;
+  std::vector<std::unique_ptr<ProxyReactor>> reactors;
+  ConcurrencyLimiter clients;
+  std::atomic<size_t> maxQueued;
+  std::atomic<int64_t> queueDelay; // smoothed microseconds requests spend waiting for a worker
+  std::mutex parkedLock;
+  std::condition_variable parkedCV;
+  std::atomic<size_t> numParked; // requests admitted but waiting on a lookup before they're queued
+
+  void dispatchRequest(size_t reactor, int clientfd, const std::string& clientIPAddr, std::string&& request,
+                       bool hungUp);
+  void queueRequest(size_t reactor, int clientfd, const std::string& clientIPAddr, std::string&& request,
+                    bool hungUp);
+
+  //decides whether a request from the supplied client can be queued now, and if so counts it against the client
+  bool admitRequest(const std::string& clientIPAddr);
+  void recordQueueDelay(std::chrono::microseconds delay);
 };
 
 #endif
@@ -0,0 +1,56 @@
+/**
+ * File: socket-writer.cc
+ * ----------------------
+ * Presents the implementation of the sendFully routine
+ * exported by socket-writer.h.
+ */
+
+#include "socket-writer.h"
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+using namespace std;
+
+bool sendFully(int s, struct iovec *iov, int iovcnt, chrono::milliseconds timeout) {
+  while (iovcnt > 0 && iov->iov_len == 0) {
+    iov++;
+    iovcnt--;
+  }
+
+  while (iovcnt > 0) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+    ssize_t count = sendmsg(s, &message, MSG_NOSIGNAL);
+    if (count == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+
+      // a blocking socket only reports EAGAIN once its send timeout has expired
+      if ((fcntl(s, F_GETFL) & O_NONBLOCK) == 0) return false;
+      struct pollfd pfd = {s, POLLOUT, 0};
+      int ready;
+      do {
+        ready = poll(&pfd, 1, timeout.count());
+      } while (ready == -1 && errno == EINTR);
+      if (ready <= 0) return false;
+      continue;
+    }
+
+    // skip past whatever was written, which may end partway through an iovec
+    size_t written = count;
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
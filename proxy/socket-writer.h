@@ -0,0 +1,30 @@
+/**
+ * File: socket-writer.h
+ * ---------------------
+ * Presents a routine that writes a message held in several separate
+ * buffers (a rendered header and a payload, say) to a socket in as few
+ * system calls as possible, without first copying them into one buffer.
+ */
+
+#ifndef _socket_writer_
+#define _socket_writer_
+
+#include <chrono>
+#include <sys/uio.h>
+#include "client-socket.h"
+
+/**
+ * Function: sendFully
+ * -------------------
+ * Writes the iovcnt buffers described by iov to the socket s, in order, with
+ * sendmsg, picking up where each partial write left off.  If s is non-blocking,
+ * sendFully waits up to timeout for it to become writable whenever it's full.
+ * Returns true if and only if everything was written.  The iovecs are consumed
+ * along the way, so their contents are unspecified afterward.  SIGPIPE is never
+ * raised, even if the peer has closed its end.
+ */
+
+bool sendFully(int s, struct iovec *iov, int iovcnt,
+               std::chrono::milliseconds timeout = kDefaultIOTimeout);
+
+#endif
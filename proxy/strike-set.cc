@@ -4,13 +4,28 @@
  * Presents the implementation of the StrikeSet class, which
  * manages a collection of regular expressions.  Each regular expressions
  * encodes a host aka server name that out proxy views as off limits.
+ *
+ * Nearly all of the expressions in practice are plain domains or (.*)\.domain,
+ * so those are compiled into a trie of domain labels, with the top-level domain
+ * at the root.  A lookup walks the server's labels from the right, so it visits
+ * at most one node per label no matter how many patterns there are.  Verdicts are
+ * additionally remembered in a small direct-mapped table of atomic words, each
+ * holding most of a server's hash along with its verdict, so that repeat lookups
+ * for popular servers don't even split the server into labels.
  */
 
 #include <fstream>
 #include <iostream>
+#include <functional>
+#include <cctype>
 #include "strike-set.h"
+#include "string-utils.h"
 using namespace std;
 
+// each cached verdict is the server's hash, with its low two bits replaced by these
+static const uint64_t kVerdictValid = 0x2;
+static const uint64_t kVerdictBlocked = 0x1;
+
 StrikeSet::StrikeSet() {
   // libstdc++ has a bug (#77704) that causes a data race in std::regex,
   // which we use in our implementation. The following code, which was
@@ -22,6 +37,7 @@ StrikeSet::StrikeSet() {
       ct.narrow(static_cast<char>(i), '\0');
   }
 #endif
+  clearVerdicts();
 }
 
 void StrikeSet::addFrom(const std::string& filename) {
@@ -36,12 +52,86 @@ void StrikeSet::addFrom(const std::string& filename) {
     string line;
     getline(infile, line);
     if (infile.fail()) break;
-    regex re(line);
-    blocked.push_back(re);
+    addPattern(line);
   }
+  clearVerdicts();
 }
 
 bool StrikeSet::contains(const string& server) const {
+  uint64_t hash = std::hash<string>()(server);
+  uint64_t tag = (hash & ~uint64_t(0x3)) | kVerdictValid;
+  atomic<uint64_t>& verdict = verdicts[hash % kNumCachedVerdicts];
+  uint64_t cached = verdict.load(memory_order_relaxed);
+  if ((cached & ~kVerdictBlocked) == tag) return cached & kVerdictBlocked;
+
+  bool blocked = matches(server);
+  verdict.store(tag | (blocked ? kVerdictBlocked : 0), memory_order_relaxed);
+  return blocked;
+}
+
+/**
+ * Splits a pattern of the form label.label...label, optionally preceded by (.*)\.,
+ * into its labels, and returns true, or returns false if the pattern isn't of that
+ * form.  Dots may be escaped or not, but either way they're taken to separate labels.
+ */
+static bool parseDomainPattern(const string& pattern, vector<string>& labels, bool& subdomains) {
+  static const string kAnySubdomain = "(.*)\\.";
+  subdomains = startsWith(pattern, kAnySubdomain);
+  labels.assign(1, "");
+  for (size_t i = subdomains ? kAnySubdomain.size() : 0; i < pattern.size(); i++) {
+    char ch = pattern[i];
+    if (ch == '\\' && i + 1 < pattern.size() && pattern[i + 1] == '.') continue;
+    if (ch == '.') {
+      if (labels.back().empty()) return false;
+      labels.push_back("");
+    } else if (isalnum(static_cast<unsigned char>(ch)) || ch == '-' || ch == '_') {
+      labels.back() += tolower(static_cast<unsigned char>(ch));
+    } else {
+      return false;
+    }
+  }
+  return !labels.back().empty();
+}
+
+void StrikeSet::addPattern(const string& pattern) {
+  vector<string> labels;
+  bool subdomains;
+  if (!parseDomainPattern(pattern, labels, subdomains)) {
+    blocked.push_back(regex(pattern));
+    return;
+  }
+
+  Node *node = &root;
+  for (auto label = labels.rbegin(); label != labels.rend(); ++label) {
+    unique_ptr<Node>& child = node->children[*label];
+    if (!child) child.reset(new Node);
+    node = child.get();
+  }
+  if (subdomains) {
+    node->subdomainsBlocked = true;
+  } else {
+    node->blocked = true;
+  }
+}
+
+bool StrikeSet::matches(const string& server) const {
+  const Node *node = &root;
+  string host = toLowerCase(server);
+  size_t end = host.size();
+  while (true) {
+    size_t dot = end == 0 ? string::npos : host.rfind('.', end - 1);
+    size_t start = dot == string::npos ? 0 : dot + 1;
+    auto found = node->children.find(host.substr(start, end - start));
+    if (found == node->children.end()) break;
+    node = found->second.get();
+    if (dot == string::npos) {
+      if (node->blocked) return true;
+      break;
+    }
+    if (node->subdomainsBlocked) return true;
+    end = dot;
+  }
+
   for (const regex& re: blocked) {
     if (regex_match(server, re)) {
       return true;
@@ -50,3 +140,7 @@ bool StrikeSet::contains(const string& server) const {
 
   return false;
 }
+
+void StrikeSet::clearVerdicts() {
+  for (atomic<uint64_t>& verdict: verdicts) verdict.store(0, memory_order_relaxed);
+}
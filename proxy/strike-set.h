@@ -9,6 +9,11 @@
 #include <vector>
 #include <string>
 #include <regex>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
 #include "proxy-exception.h"
 
 class StrikeSet {
@@ -32,6 +37,11 @@ class StrikeSet {
  *   (.*)\.microsoft.com
  *   (.*)\.org
  *
+ * Patterns that name a domain (e.g. microsoft.com), or every subdomain of
+ * one (e.g. (.*)\.microsoft.com), are compiled into a trie keyed on
+ * domain labels, last label first, and are matched without regard to case.
+ * Only the patterns that aren't of either form are kept as regular expressions.
+ *
  * If there's any drama (e.g. the file doesn't exist), then an
  * HTTPProxyException is thrown.
  */
@@ -41,10 +51,26 @@ class StrikeSet {
  * Method: contains
  * ----------------
  * Returns true if the specified server (e.g. `web.stanford.edu`) is blocked,
- * or false if access to that server should be permitted.
+ * or false if access to that server should be permitted.  The cost of a lookup
+ * depends on the number of labels in server, not on the number of domain
+ * patterns, and recent verdicts are remembered.  Thread safe.
  */
   bool contains(const std::string& server) const;
 
  private:
+  struct Node {
+    bool blocked = false;           // the domain spelled out on the way here is blocked
+    bool subdomainsBlocked = false; // as is every domain below it
+    std::unordered_map<std::string, std::unique_ptr<Node>> children;
+  };
+
+  static const size_t kNumCachedVerdicts = 4096;
+
+  Node root;
   std::vector<std::regex> blocked;
+  mutable std::array<std::atomic<uint64_t>, kNumCachedVerdicts> verdicts;
+
+  void addPattern(const std::string& pattern);
+  bool matches(const std::string& server) const;
+  void clearVerdicts();
 };
@@ -0,0 +1,176 @@
+/**
+ * File: tunnel-reactor.cc
+ * -----------------------
+ * Presents the implementation of the TunnelReactor class, as exported
+ * by tunnel-reactor.h.
+ */
+
+#include "tunnel-reactor.h"
+#include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "log.h"
+#include "metrics.h"
+using namespace std;
+
+static const size_t kReactorTimeout = 1;      // seconds between idle sweeps
+static const size_t kSpliceSize = 1 << 16;    // the default capacity of a pipe
+
+static MetricCounter& tunnelBytes = MetricsRegistry::getInstance().addCounter(
+  "proxy_tunnel_bytes_total", "Bytes relayed through HTTPS tunnels, in either direction.");
+static MetricGauge& activeTunnels = MetricsRegistry::getInstance().addGauge(
+  "proxy_tunnels_active", "HTTPS tunnels currently open.");
+
+TunnelReactor::TunnelReactor(time_t idleTimeout):
+  idleTimeout(idleTimeout), watchset(kReactorTimeout, /* edgeTriggered = */ true), running(true) {
+  loop = thread([this] { run(); });
+}
+
+TunnelReactor::~TunnelReactor() {
+  running = false;
+  if (loop.joinable()) loop.join();
+  lock_guard<mutex> lg(m);
+  while (!tunnels.empty()) closeTunnel(tunnels.begin()->second);
+}
+
+bool TunnelReactor::add(int clientfd, int serverfd) {
+  shared_ptr<Tunnel> tunnel = make_shared<Tunnel>();
+  tunnel->directions[0].from = tunnel->directions[1].to = clientfd;
+  tunnel->directions[0].to = tunnel->directions[1].from = serverfd;
+  tunnel->lastActivity = time(NULL);
+  int created = 0;
+  for (; created < 2; created++) {
+    if (pipe2(tunnel->directions[created].pipefds, O_NONBLOCK | O_CLOEXEC) == -1) break;
+  }
+  if (created < 2) {
+    for (int i = 0; i < created; i++) {
+      close(tunnel->directions[i].pipefds[0]);
+      close(tunnel->directions[i].pipefds[1]);
+    }
+    close(clientfd);
+    close(serverfd);
+    return false;
+  }
+
+  fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+  fcntl(serverfd, F_SETFL, fcntl(serverfd, F_GETFL) | O_NONBLOCK);
+  {
+    lock_guard<mutex> lg(m);
+    tunnels[clientfd] = tunnel;
+    tunnels[serverfd] = tunnel;
+  }
+  activeTunnels.add(1);
+  LOG(Info) << "[" << clientfd << " <-> " << serverfd << "]: Establishing HTTPS tunnel";
+
+  // either end may already have bytes waiting, and the edge-triggered watchset
+  // still reports them because they're present when it's added
+  watchset.add(clientfd, /* writable = */ true);
+  watchset.add(serverfd, /* writable = */ true);
+  return true;
+}
+
+void TunnelReactor::run() {
+  vector<int> ready;
+  while (running) {
+    ready.clear();
+    watchset.waitAll(ready);
+    for (int fd: ready) relay(fd);
+    closeIdleTunnels();
+  }
+}
+
+/**
+ * Makes whatever progress is possible in both directions of the tunnel fd
+ * belongs to; each involves fd, whether it became readable or writable.
+ */
+void TunnelReactor::relay(int fd) {
+  lock_guard<mutex> lg(m);
+  auto found = tunnels.find(fd);
+  if (found == tunnels.end()) return; // closed earlier in the same batch of events
+  shared_ptr<Tunnel> tunnel = found->second;
+
+  bool progressed = false;
+  for (Direction& direction: tunnel->directions) {
+    if (!pump(direction, progressed)) {
+      closeTunnel(tunnel);
+      return;
+    }
+  }
+  if (progressed) tunnel->lastActivity = time(NULL);
+  if (tunnel->directions[0].done && tunnel->directions[1].done) closeTunnel(tunnel);
+}
+
+/**
+ * Moves bytes from direction.from into the pipe and from the pipe to direction.to
+ * until one side would block, and shuts down direction.to's write side once
+ * direction.from is finished and the pipe is empty.  The source is only read from
+ * once the pipe is empty, so a full destination stops reading (rather than
+ * buffering without bound), and the destination becoming writable resumes it.
+ * Returns false if either socket fails.
+ */
+bool TunnelReactor::pump(Direction& direction, bool& progressed) {
+  while (!direction.done) {
+    if (direction.buffered > 0) {
+      ssize_t count = splice(direction.pipefds[0], NULL, direction.to, NULL, direction.buffered,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (count > 0) {
+        direction.buffered -= count;
+        tunnelBytes.add(count);
+        progressed = true;
+        continue;
+      }
+      if (count < 0 && errno == EINTR) continue;
+      return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+    if (direction.eof) {
+      shutdown(direction.to, SHUT_WR);
+      direction.done = true;
+      break;
+    }
+
+    ssize_t count = splice(direction.from, NULL, direction.pipefds[1], NULL, kSpliceSize,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (count > 0) {
+      direction.buffered += count;
+      progressed = true;
+    } else if (count == 0) {
+      direction.eof = true;
+    } else if (errno != EINTR) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+  }
+  return true;
+}
+
+/**
+ * Stops watching and closes both of the tunnel's sockets, along with its
+ * pipes.  Assumes the lock is held.
+ */
+void TunnelReactor::closeTunnel(const shared_ptr<Tunnel>& tunnel) {
+  int clientfd = tunnel->directions[0].from;
+  int serverfd = tunnel->directions[0].to;
+  LOG(Info) << "[" << clientfd << " <-> " << serverfd << "]: Tearing down HTTPS tunnel";
+  activeTunnels.add(-1);
+  for (Direction& direction: tunnel->directions) {
+    watchset.remove(direction.from);
+    tunnels.erase(direction.from);
+    close(direction.from);
+    close(direction.pipefds[0]);
+    close(direction.pipefds[1]);
+  }
+}
+
+void TunnelReactor::closeIdleTunnels() {
+  lock_guard<mutex> lg(m);
+  time_t now = time(NULL);
+  vector<shared_ptr<Tunnel>> idle;
+  for (const pair<const int, shared_ptr<Tunnel>>& p: tunnels) {
+    // each tunnel is listed under both of its sockets, but only needs to be collected once
+    const Tunnel& tunnel = *p.second;
+    if (p.first == tunnel.directions[0].from && now - tunnel.lastActivity > idleTimeout) idle.push_back(p.second);
+  }
+  for (const shared_ptr<Tunnel>& tunnel: idle) closeTunnel(tunnel);
+}
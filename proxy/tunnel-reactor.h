@@ -0,0 +1,85 @@
+/**
+ * File: tunnel-reactor.h
+ * ----------------------
+ * Defines the TunnelReactor class, which owns a single event loop thread that
+ * relays bytes in both directions between the ends of any number of tunnels
+ * (established by CONNECT requests).  Bytes are moved with splice, through a
+ * pipe for each direction, so they never pass through user space, and no
+ * thread is tied up by a tunnel that has nothing to relay.  When one end stops
+ * sending, the other end's write side is shut down once everything sent before
+ * that has been relayed, and a tunnel is closed once both directions are
+ * finished, either end fails, or it's been idle for too long.
+ */
+
+#ifndef _tunnel_reactor_
+#define _tunnel_reactor_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <ctime>
+#include <cstddef>
+#include "watchset.h"
+
+class TunnelReactor {
+ public:
+
+/**
+ * Constructor: TunnelReactor
+ * --------------------------
+ * Constructs the reactor and launches its event loop thread.  Tunnels that
+ * relay nothing in either direction for idleTimeout seconds are closed.
+ */
+  TunnelReactor(time_t idleTimeout = 300);
+
+/**
+ * Destructor: ~TunnelReactor
+ * --------------------------
+ * Stops the event loop and closes every tunnel still open.
+ */
+  ~TunnelReactor();
+
+/**
+ * Method: add
+ * -----------
+ * Transfers ownership of the two supplied, connected sockets to the reactor,
+ * which relays between them until the tunnel is closed, and then closes them.
+ * Returns false (having closed both) if the tunnel can't be set up.  Thread safe.
+ */
+  bool add(int clientfd, int serverfd);
+
+ private:
+  struct Direction {
+    int from;
+    int to;
+    int pipefds[2];       // bytes read from from, but not yet written to to
+    size_t buffered = 0;
+    bool eof = false;     // from has no more to send
+    bool done = false;    // to's write side has been shut down
+  };
+
+  struct Tunnel {
+    Direction directions[2];
+    time_t lastActivity;
+  };
+
+  time_t idleTimeout;
+  ProxyWatchset watchset;
+  std::mutex m;
+  std::map<int, std::shared_ptr<Tunnel>> tunnels; // each tunnel appears under both its sockets
+  std::atomic<bool> running;
+  std::thread loop;
+
+  void run();
+  void relay(int fd);
+  static bool pump(Direction& direction, bool& progressed);
+  void closeTunnel(const std::shared_ptr<Tunnel>& tunnel);
+  void closeIdleTunnels();
+
+  TunnelReactor(const TunnelReactor& original) = delete;
+  void operator=(const TunnelReactor& rhs) = delete;
+};
+
+#endif
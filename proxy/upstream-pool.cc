@@ -0,0 +1,87 @@
+/**
+ * File: upstream-pool.cc
+ * ----------------------
+ * Presents the implementation of the UpstreamPool class, as exported
+ * by upstream-pool.h.
+ */
+
+#include "upstream-pool.h"
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+using namespace std;
+
+UpstreamPool::UpstreamPool(size_t maxIdlePerOrigin, size_t maxIdle, time_t idleTimeout):
+  maxIdlePerOrigin(maxIdlePerOrigin), maxIdle(maxIdle), idleTimeout(idleTimeout), numIdle(0) {}
+
+UpstreamPool::~UpstreamPool() {
+  for (const pair<const Origin, deque<IdleConnection>>& p: idle) {
+    for (const IdleConnection& connection: p.second) close(connection.fd);
+  }
+}
+
+int UpstreamPool::acquire(const string& server, unsigned short port, bool& reused,
+                          chrono::milliseconds timeout, ClientSocketTimings *timings) {
+  reused = false;
+  while (true) {
+    int fd;
+    {
+      lock_guard<mutex> lg(m);
+      closeExpiredConnections(time(NULL));
+      auto found = idle.find(make_pair(server, port));
+      if (found == idle.end() || found->second.empty()) break;
+      fd = found->second.back().fd; // most recently used is least likely to have been closed
+      found->second.pop_back();
+      numIdle--;
+    }
+
+    if (isHealthy(fd)) {
+      reused = true;
+      return fd;
+    }
+    close(fd);
+  }
+
+  return createClientSocket(server, port, timeout, timings);
+}
+
+void UpstreamPool::release(const string& server, unsigned short port, int fd) {
+  lock_guard<mutex> lg(m);
+  time_t now = time(NULL);
+  closeExpiredConnections(now);
+  deque<IdleConnection>& connections = idle[make_pair(server, port)];
+  if (connections.size() >= maxIdlePerOrigin || numIdle >= maxIdle) {
+    close(fd);
+    return;
+  }
+
+  connections.push_back({fd, now});
+  numIdle++;
+}
+
+/**
+ * An idle connection is healthy if there's nothing to read from it: a
+ * readable EOF means the origin closed its end, and unsolicited bytes mean
+ * we can't trust where the next response begins.
+ */
+bool UpstreamPool::isHealthy(int fd) {
+  char byte;
+  ssize_t count = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void UpstreamPool::closeExpiredConnections(time_t now) {
+  for (auto curr = idle.begin(); curr != idle.end();) {
+    deque<IdleConnection>& connections = curr->second;
+    while (!connections.empty() && now - connections.front().since > idleTimeout) {
+      close(connections.front().fd);
+      connections.pop_front();
+      numIdle--;
+    }
+    if (connections.empty()) {
+      curr = idle.erase(curr);
+    } else {
+      ++curr;
+    }
+  }
+}
@@ -0,0 +1,84 @@
+/**
+ * File: upstream-pool.h
+ * ---------------------
+ * Defines the UpstreamPool class, which retains idle, keep-alive connections
+ * to origin servers so that subsequent requests to the same (server, port)
+ * pair can skip the DNS lookup and TCP handshake.
+ */
+
+#ifndef _upstream_pool_
+#define _upstream_pool_
+
+#include <string>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <ctime>
+#include <chrono>
+#include "client-socket.h"
+
+class UpstreamPool {
+ public:
+
+/**
+ * Constructor: UpstreamPool
+ * -------------------------
+ * Constructs an empty pool that retains at most maxIdlePerOrigin idle connections
+ * for any one (server, port) pair, at most maxIdle idle connections overall, and
+ * closes any connection that's been idle for longer than idleTimeout seconds.
+ */
+  UpstreamPool(size_t maxIdlePerOrigin = 8, size_t maxIdle = 256, time_t idleTimeout = 30);
+
+/**
+ * Destructor: ~UpstreamPool
+ * -------------------------
+ * Closes all idle connections.
+ */
+  ~UpstreamPool();
+
+/**
+ * Method: acquire
+ * ---------------
+ * Returns a connected socket descriptor for the supplied server and port, preferring
+ * an idle connection that's passed a health check over a brand new one.  reused is
+ * set to true if and only if the returned descriptor came from the pool.  New connections
+ * are made by createClientSocket, which is passed timeout and timings.  If no connection
+ * could be made, kClientSocketError (from client-socket.h) is returned.  The caller
+ * owns the returned descriptor, and should either release it back to the pool or close it.
+ */
+  int acquire(const std::string& server, unsigned short port, bool& reused,
+              std::chrono::milliseconds timeout = kDefaultConnectTimeout,
+              ClientSocketTimings *timings = NULL);
+
+/**
+ * Method: release
+ * ---------------
+ * Returns the supplied descriptor to the pool so it can be reused by a later request
+ * to the same server and port.  Callers should only release connections whose last
+ * response was read in full and where the origin agreed to keep the connection alive.
+ */
+  void release(const std::string& server, unsigned short port, int fd);
+
+ private:
+  typedef std::pair<std::string, unsigned short> Origin;
+  struct IdleConnection {
+    int fd;
+    time_t since;
+  };
+
+  size_t maxIdlePerOrigin;
+  size_t maxIdle;
+  time_t idleTimeout;
+  size_t numIdle;
+  std::mutex m;
+  std::map<Origin, std::deque<IdleConnection>> idle;
+
+  static bool isHealthy(int fd);
+  void closeExpiredConnections(time_t now);
+
+  UpstreamPool(const UpstreamPool& original) = delete;
+  void operator=(const UpstreamPool& rhs) = delete;
+};
+
+#endif
@@ -8,8 +8,9 @@
 #include <sys/epoll.h>
 #include <unistd.h>
 
-ProxyWatchset::ProxyWatchset(size_t timeout) {
+ProxyWatchset::ProxyWatchset(size_t timeout, bool edgeTriggered) {
   this->timeout = timeout;
+  this->edgeTriggered = edgeTriggered;
   watchset = epoll_create1(0);
 }
 
@@ -18,9 +19,11 @@ ProxyWatchset::~ProxyWatchset() {
 }
 
 // NOLINTNEXTLINE(readability-make-member-function-const): watchset is modified
-void ProxyWatchset::add(int fd) {
+void ProxyWatchset::add(int fd, bool writable) {
   struct epoll_event event;
   event.events = EPOLLIN;
+  if (edgeTriggered) event.events |= EPOLLET | EPOLLRDHUP;
+  if (writable) event.events |= EPOLLOUT;
   event.data.fd = fd;
   epoll_ctl(watchset, EPOLL_CTL_ADD, fd, &event);
 }
@@ -41,3 +44,11 @@ int ProxyWatchset::wait() const {
   if (numEvents <= 0) return -1;
   return event.data.fd;
 }
+
+size_t ProxyWatchset::waitAll(std::vector<int>& ready, size_t maxEvents) const {
+  std::vector<struct epoll_event> events(maxEvents);
+  int numEvents = epoll_wait(watchset, events.data(), maxEvents, /* timeout in ms: */ timeout * kMsPerSecond);
+  if (numEvents <= 0) return 0;
+  for (int i = 0; i < numEvents; i++) ready.push_back(events[i].data.fd);
+  return numEvents;
+}
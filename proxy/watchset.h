@@ -7,6 +7,7 @@
 
 #pragma once
 #include <cstddef>
+#include <vector>
 
 class ProxyWatchset {
  public:
@@ -16,9 +17,12 @@ class ProxyWatchset {
  * Constructs a ProxyWatchset that can be used to poll one or more
  * descriptors for data availability.  The timeout parameter specifies
  * the number of seconds the watchset is willing to wait for data to
- * become available on any of the descriptors being watched.
+ * become available on any of the descriptors being watched.  When
+ * edgeTriggered is true, a descriptor is only reported once each time new
+ * data arrives, so clients must drain it (typically until read fails with
+ * EAGAIN on a non-blocking descriptor) before waiting again.
  */
-  ProxyWatchset(size_t timeout = 5);
+  ProxyWatchset(size_t timeout = 5, bool edgeTriggered = false);
 
 /**
  * Destructor: ~ProxyWatchset
@@ -32,10 +36,13 @@ class ProxyWatchset {
  * Method: add
  * -----------
  * Adds the supplied descriptor--assumed to be attached to a resource that
- * supplies bytes--to the watchset.  If the supplied fd isn't valid, then add's
+ * supplies bytes--to the watchset.  If writable is true, the descriptor is also
+ * reported whenever it can accept more bytes, which only makes sense for an
+ * edge-triggered watchset (a level-triggered one would report a writable
+ * descriptor over and over).  If the supplied fd isn't valid, then add's
  * behavior is undefined.
  */ 
-  void add(int fd);
+  void add(int fd, bool writable = false);
 
 /**
  * Method: remove
@@ -56,10 +63,20 @@ class ProxyWatchset {
  * at all, wait returns -1.
  */
   int wait() const;
+
+/**
+ * Method: waitAll
+ * ---------------
+ * Behaves like wait, except that all descriptors (up to maxEvents of them) with
+ * data available are appended to ready in a single call.  The number of descriptors
+ * appended is returned, which is 0 if the timeout is exceeded or if there are any errors.
+ */
+  size_t waitAll(std::vector<int>& ready, size_t maxEvents = 64) const;
   
  private:
   int watchset;
   int timeout;
+  bool edgeTriggered;
   
   ProxyWatchset(const ProxyWatchset& original) = delete;
   void operator=(const ProxyWatchset& rhs) = delete;
@@ -0,0 +1,105 @@
+/**
+ * File: work-stealing-pool.cc
+ * ---------------------------
+ * Presents the implementation of the WorkStealingPool class, as exported
+ * by work-stealing-pool.h.
+ */
+
+#include "work-stealing-pool.h"
+#include <pthread.h>
+#include <sched.h>
+using namespace std;
+
+// the worker (if any) running on this thread, so its own submissions stay local
+static thread_local WorkStealingPool *currentPool = nullptr;
+static thread_local size_t currentWorker = 0;
+
+WorkStealingPool::WorkStealingPool(size_t numWorkers, bool pinWorkers):
+  nextQueue(0), numQueued(0), numOutstanding(0), numSleeping(0), running(true) {
+  if (numWorkers == 0) numWorkers = 1;
+  for (size_t i = 0; i < numWorkers; i++) queues.push_back(make_unique<Queue>());
+  for (size_t i = 0; i < numWorkers; i++) {
+    workers.push_back(thread([this, i, pinWorkers] {
+      if (pinWorkers) pin(i);
+      work(i);
+    }));
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  wait();
+  {
+    lock_guard<mutex> lg(m);
+    running = false;
+  }
+  workCV.notify_all();
+  for (thread& worker: workers) worker.join();
+}
+
+void WorkStealingPool::schedule(Task&& task) {
+  size_t id = currentPool == this ? currentWorker : nextQueue++ % queues.size();
+  numOutstanding++;
+  {
+    lock_guard<mutex> lg(queues[id]->m);
+    queues[id]->tasks.push_back(move(task));
+  }
+  numQueued++;
+
+  // a sleeping worker must either see numQueued go up or be woken
+  if (numSleeping > 0) {
+    lock_guard<mutex> lg(m);
+    workCV.notify_one();
+  }
+}
+
+void WorkStealingPool::wait() {
+  unique_lock<mutex> ul(m);
+  doneCV.wait(ul, [this] { return numOutstanding == 0; });
+}
+
+void WorkStealingPool::work(size_t id) {
+  currentPool = this;
+  currentWorker = id;
+  while (true) {
+    Task task;
+    if (take(id, task)) {
+      task();
+      task = Task(); // release whatever the task captured before reporting it done
+      if (--numOutstanding == 0) {
+        lock_guard<mutex> lg(m);
+        doneCV.notify_all();
+      }
+      continue;
+    }
+
+    unique_lock<mutex> ul(m);
+    numSleeping++;
+    workCV.wait(ul, [this] { return !running || numQueued > 0; });
+    numSleeping--;
+    if (!running && numQueued == 0) return;
+  }
+}
+
+/**
+ * Takes the oldest task from the worker's own queue, or failing that, from
+ * the first other queue (starting with its neighbor) that has one.
+ */
+bool WorkStealingPool::take(size_t id, Task& task) {
+  for (size_t i = 0; i < queues.size(); i++) {
+    Queue& queue = *queues[(id + i) % queues.size()];
+    lock_guard<mutex> lg(queue.m);
+    if (queue.tasks.empty()) continue;
+    task = move(queue.tasks.front());
+    queue.tasks.pop_front();
+    numQueued--;
+    return true;
+  }
+  return false;
+}
+
+void WorkStealingPool::pin(size_t id) {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(id % max(thread::hardware_concurrency(), 1U), &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
@@ -0,0 +1,184 @@
+/**
+ * File: work-stealing-pool.h
+ * --------------------------
+ * Defines the WorkStealingPool class, a thread pool in which every worker
+ * has its own queue of tasks.  Tasks scheduled by a worker go onto its own
+ * queue, tasks scheduled from elsewhere are spread across the queues, and a
+ * worker whose queue runs dry takes tasks from the others before going to
+ * sleep.  There's no single queue (or lock) for every submission to contend on.
+ *
+ * Tasks are held in Task objects, which store small callables (such as lambdas
+ * capturing a few words and strings) inline, so scheduling one doesn't allocate.
+ */
+
+#ifndef _work_stealing_pool_
+#define _work_stealing_pool_
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+
+/**
+ * Class: Task
+ * -----------
+ * A move-only, type-erased void() callable.  Callables of up to kInlineSize bytes
+ * are stored within the Task itself, and only larger ones are placed on the heap.
+ */
+class Task {
+ public:
+  static const size_t kInlineSize = 128;
+
+  Task() = default;
+
+  template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+  Task(F&& f) {
+    typedef std::decay_t<F> Callable;
+    if constexpr (sizeof(Callable) <= kInlineSize && alignof(Callable) <= alignof(std::max_align_t) &&
+                  std::is_nothrow_move_constructible_v<Callable>) {
+      new (storage) Callable(std::forward<F>(f));
+      ops = &InlineOps<Callable>::ops;
+    } else {
+      *reinterpret_cast<Callable **>(storage) = new Callable(std::forward<F>(f));
+      ops = &HeapOps<Callable>::ops;
+    }
+  }
+
+  Task(Task&& other) noexcept { take(other); }
+  Task& operator=(Task&& rhs) noexcept {
+    if (this != &rhs) {
+      reset();
+      take(rhs);
+    }
+    return *this;
+  }
+  ~Task() { reset(); }
+
+  void operator()() { ops->invoke(storage); }
+  explicit operator bool() const { return ops != nullptr; }
+
+ private:
+  struct Ops {
+    void (*invoke)(void *storage);
+    void (*move)(void *from, void *to); // leaves from destroyed
+    void (*destroy)(void *storage);
+  };
+
+  template <typename Callable>
+  struct InlineOps {
+    static void invoke(void *storage) { (*static_cast<Callable *>(storage))(); }
+    static void move(void *from, void *to) {
+      new (to) Callable(std::move(*static_cast<Callable *>(from)));
+      static_cast<Callable *>(from)->~Callable();
+    }
+    static void destroy(void *storage) { static_cast<Callable *>(storage)->~Callable(); }
+    static constexpr Ops ops = {invoke, move, destroy};
+  };
+
+  template <typename Callable>
+  struct HeapOps {
+    static Callable *&get(void *storage) { return *static_cast<Callable **>(storage); }
+    static void invoke(void *storage) { (*get(storage))(); }
+    static void move(void *from, void *to) { *static_cast<Callable **>(to) = get(from); }
+    static void destroy(void *storage) { delete get(storage); }
+    static constexpr Ops ops = {invoke, move, destroy};
+  };
+
+  alignas(std::max_align_t) unsigned char storage[kInlineSize];
+  const Ops *ops = nullptr;
+
+  void take(Task& other) {
+    ops = other.ops;
+    if (ops != nullptr) ops->move(other.storage, storage);
+    other.ops = nullptr;
+  }
+
+  void reset() {
+    if (ops != nullptr) ops->destroy(storage);
+    ops = nullptr;
+  }
+
+  Task(const Task& original) = delete;
+  void operator=(const Task& rhs) = delete;
+};
+
+class WorkStealingPool {
+ public:
+
+/**
+ * Constructor: WorkStealingPool
+ * -----------------------------
+ * Launches numWorkers workers.  If pinWorkers is true, worker i is
+ * confined to CPU i modulo the number of CPUs.
+ */
+  WorkStealingPool(size_t numWorkers, bool pinWorkers = false);
+
+/**
+ * Destructor: ~WorkStealingPool
+ * -----------------------------
+ * Waits for all scheduled tasks to finish, then stops the workers.
+ */
+  ~WorkStealingPool();
+
+/**
+ * Method: schedule
+ * ----------------
+ * Schedules the supplied task to be run by some worker.  Thread safe.
+ */
+  void schedule(Task&& task);
+
+/**
+ * Method: wait
+ * ------------
+ * Blocks until every task scheduled so far has run to completion.  Thread safe,
+ * but must not be called by a task.
+ */
+  void wait();
+
+/**
+ * Method: getNumWorkers
+ * ---------------------
+ * Returns the number of workers.
+ */
+  size_t getNumWorkers() const { return queues.size(); }
+
+/**
+ * Method: getNumQueued
+ * --------------------
+ * Returns the number of scheduled tasks that no worker has started yet.
+ */
+  size_t getNumQueued() const { return numQueued; }
+
+ private:
+  struct Queue {
+    std::mutex m;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> nextQueue;
+  std::atomic<size_t> numQueued;      // scheduled but not yet taken by a worker
+  std::atomic<size_t> numOutstanding; // scheduled but not yet finished
+  std::atomic<size_t> numSleeping;
+  bool running;
+  std::mutex m;                       // guards running, and is what sleeping workers wait on
+  std::condition_variable workCV;
+  std::condition_variable doneCV;
+
+  void work(size_t id);
+  bool take(size_t id, Task& task);
+  static void pin(size_t id);
+
+  WorkStealingPool(const WorkStealingPool& original) = delete;
+  void operator=(const WorkStealingPool& rhs) = delete;
+};
+
+#endif